@@ -0,0 +1,136 @@
+#!/bin/bash
+# Runs coripper over a matrix of synthetic cores and prints one line per run:
+# case, variant, wall ms, user ms, sys ms, peak RSS KB, bytes read, bytes written,
+# read and write syscalls, output size. With a baseline file given, the results are
+# also compared against it and the runs slower or bigger by more than 10% are reported.
+#
+# Pipeline variants account the I/O and CPU time of all pipe members and the RSS
+# of the largest of them.
+#
+# Cases with an RSS cap fail when a run without compression peaks above it, notes
+# of many threads must not stay in memory.
+#
+# Cold variants drop the page cache before every run, so the core is read from the
+# disk. They need root and are left out without it.
+
+CORIPPER=$(readlink -f "${1:?Usage: $0 <coripper> [baseline]}")
+BASELINE=$2
+BENCH_DIR=${BENCH_DIR:-/var/tmp/coripper-bench}
+THRESHOLD=${THRESHOLD:-10}
+REPEAT=${REPEAT:-3}
+HERE=$(dirname "$(readlink -f "$0")")
+RESULT=$HERE/result.tsv
+
+# name, generator options and optional RSS cap in KB of every case
+CASES=(
+	"small|--threads 4"
+	"threads-1k|--threads 1000"
+	"threads-20k|--threads 20000 --stack 32|65536"
+	"threads-70k|--threads 70000 --stack 16|65536"
+	"mappings-70k|--threads 8 --mappings 70000"
+	"libs-1k|--threads 8 --libs 1000"
+	"static|--threads 64 --static"
+	"elf32|--threads 64 --elf32"
+	"stacks-8m|--threads 64 --stack 8192 --stack-used 512"
+	"data-last|--threads 8 --mappings 100 --mapping-size 12 --data-last"
+	"stacks-zero|--threads 64 --stack 1024 --stack-used 1024 --stack-zero 960"
+)
+
+mkdir -p "$BENCH_DIR" || exit 1
+
+# cores are regenerated only when the generator or its options change
+gen()
+{
+	local core=$BENCH_DIR/$1.core opts=$2
+	if [ "$(cat "$core.opts" 2>/dev/null)" != "$opts" ] || [ "$core" -ot "$HERE/gencore" ]; then
+		"$HERE/gencore" $opts "$core" || exit 1
+		echo "$opts" > "$core.opts"
+	fi
+}
+
+run()
+{
+	local name=$1 variant=$2 out=$BENCH_DIR/out
+	shift 2
+	local stats best i
+	# the fastest of several runs is the least noisy
+	for ((i = 0; i < REPEAT; i++)); do
+		if [ "${variant%-cold}" != "$variant" ]; then
+			sync && echo 3 > /proc/sys/vm/drop_caches || return 1
+		fi
+		stats=$("$HERE/runbench" "$@") || { echo "FAILED: $name $variant" >&2; return 1; }
+		if [ -z "$best" ] || [ "${stats%%	*}" -lt "${best%%	*}" ]; then
+			best=$stats
+		fi
+	done
+	stats=$best
+	printf "%s\t%s\t%s\t%s\n" "$name" "$variant" "$stats" "$(stat -c %s "$out")"
+}
+
+declare -A CAPS
+: > "$RESULT"
+for c in "${CASES[@]}"; do
+	IFS='|' read -r name opts cap <<< "$c"
+	CAPS[$name]=$cap
+	gen "$name" "$opts"
+	core=$BENCH_DIR/$name.core
+	out=$BENCH_DIR/out
+	if [ -z "$ZSTD" ]; then
+		# coripper may be built without zstd
+		"$CORIPPER" -z zstd "$core" > /dev/null 2>&1 && type zstd > /dev/null 2>&1
+		ZSTD=$?
+	fi
+	{
+		run "$name" default sh -c "exec $CORIPPER $core > $out"
+		run "$name" j4 sh -c "exec $CORIPPER -j 4 $core > $out"
+		run "$name" stdin sh -c "exec $CORIPPER - < $core > $out"
+		run "$name" stdin-1m sh -c "exec $CORIPPER -s 1M - < $core > $out"
+		run "$name" sparse sh -c "exec $CORIPPER --sparse $core > $out"
+		run "$name" sparse-pipe sh -c "$CORIPPER --sparse $core | cat > $out"
+		if [ -w /proc/sys/vm/drop_caches ]; then
+			run "$name" default-cold sh -c "exec $CORIPPER $core > $out"
+			run "$name" stdin-cold sh -c "exec $CORIPPER - < $core > $out"
+		fi
+		if [ "$ZSTD" = 0 ]; then
+			run "$name" zstd sh -c "exec $CORIPPER -z zstd $core > $out"
+			run "$name" zstd-pipe sh -c "$CORIPPER $core | zstd -q -T0 > $out"
+		fi
+	} | tee -a "$RESULT"
+done
+rm -f "$BENCH_DIR/out"
+
+capped=0
+while IFS=$'\t' read -r name variant wall user sys rss rest; do
+	cap=${CAPS[$name]}
+	case $variant in zstd*) continue ;; esac
+	if [ -n "$cap" ] && [ "$rss" -gt "$cap" ]; then
+		echo "RSS CAP EXCEEDED: $name $variant $rss KB > $cap KB" >&2
+		capped=1
+	fi
+done < "$RESULT"
+
+[ -n "$BASELINE" ] || exit $capped
+if [ ! -f "$BASELINE" ]; then
+	echo "No baseline $BASELINE, record it with 'make bench-baseline'" >&2
+	exit $capped
+fi
+
+# wall time, CPU time, RSS and output size are compared, small values are noise
+awk -F '\t' -v threshold="$THRESHOLD" '
+	NR == FNR { base[$1 "\t" $2] = $0; next }
+	($1 "\t" $2) in base {
+		split(base[$1 "\t" $2], b, "\t")
+		check($1, $2, "wall ms", b[3], $3, 50)
+		check($1, $2, "cpu ms", b[4] + b[5], $4 + $5, 50)
+		check($1, $2, "rss KB", b[6], $6, 4096)
+		check($1, $2, "output bytes", b[10], $10, 0)
+	}
+	function check(name, variant, what, old, new, floor)
+	{
+		if (new > floor && new > old * (1 + threshold / 100)) {
+			printf "REGRESSION: %s %s %s %d -> %d\n", name, variant, what, old, new
+			failed = 1
+		}
+	}
+	END { exit failed }
+' "$BASELINE" "$RESULT" && exit $capped
@@ -0,0 +1,787 @@
+/*
+ * Copyright (c) 2015-2017 Parallels IP Holdings GmbH
+ * Copyright (c) 2017-2019 Virtuozzo International GmbH. All rights reserved.
+ *
+ * This file is part of OpenVZ. OpenVZ is free software; you can redistribute
+ * it and/or modify it under the terms of the GNU General Public License as
+ * published by the Free Software Foundation; either version 2 of the License,
+ * or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA
+ * 02110-1301, USA.
+ *
+ * Our contact details: Virtuozzo International GmbH, Vordergasse 59, 8200
+ * Schaffhausen, Switzerland.
+ */
+
+// Generator of synthetic ELF cores for benchmarks. The core looks like the one
+// written by the kernel for x86_64 process: NOTE segment with registers of every
+// thread, executable image with .dynamic, r_debug and linkmap chain, code of shared
+// libraries, anonymous mappings and thread stacks with code addresses in them.
+// ELF32 cores look like the ones of a 32-bit process on x86_64 kernel: i386 notes,
+// r_debug, link_map and stack words.
+
+#include <iostream>
+#include <vector>
+#include <algorithm>
+#include <string>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <cstddef>
+#include <csignal>
+#include <getopt.h>
+#include <link.h>
+#include <sys/user.h>
+#include <sys/procfs.h>
+#include <core_elf.h>
+
+#ifndef NT_X86_XSTATE
+#define NT_X86_XSTATE	0x202
+#endif
+
+enum {
+	PAGE_SIZE_ = 4096,
+	WRITE_BUFF_SIZE = 1 << 20,
+	EXEC_DATA_OFFSET = 0x200000,
+	FPREGSET_SIZE = 512,
+	// user_i387_struct of i386, FXSAVE area goes to NT_PRXFPREG
+	FPREGSET32_SIZE = 108
+};
+
+#ifndef NT_PRXFPREG
+#define NT_PRXFPREG	0x46e62b7f
+#endif
+
+namespace
+{
+
+////////////////////////////////////////////////////////////////////////////////////////////////////
+// struct Prstatus32, Prpsinfo32
+
+// Compat notes the kernel writes for i386 processes
+struct Prstatus32
+{
+	int32_t si_signo;
+	int32_t si_code;
+	int32_t si_errno;
+	int16_t pr_cursig;
+	uint32_t pr_sigpend;
+	uint32_t pr_sighold;
+	int32_t pr_pid;
+	int32_t pr_ppid;
+	int32_t pr_pgrp;
+	int32_t pr_sid;
+	int32_t pr_times[8];
+	uint32_t pr_reg[17];
+	int32_t pr_fpvalid;
+};
+
+struct Prpsinfo32
+{
+	char pr_state;
+	char pr_sname;
+	char pr_zomb;
+	char pr_nice;
+	uint32_t pr_flag;
+	uint16_t pr_uid;
+	uint16_t pr_gid;
+	int32_t pr_pid;
+	int32_t pr_ppid;
+	int32_t pr_pgrp;
+	int32_t pr_sid;
+	char pr_fname[16];
+	char pr_psargs[80];
+};
+
+typedef char prstatus32_size_check[sizeof(Prstatus32) == CoRipper::Elf32Traits::PRSTATUS_SIZE
+	&& offsetof(Prstatus32, pr_reg) == CoRipper::Elf32Traits::PRSTATUS_REGS ? 1 : -1];
+
+////////////////////////////////////////////////////////////////////////////////////////////////////
+// struct Config
+
+struct Config
+{
+	Config(): threads(4), stackSize(128 << 10), stackUsed(0), stackZero(0), mappings(16), mappingSize(PAGE_SIZE_),
+		libs(8), dynamic(32), xstate(2688), pie(true), elf32(false), dataLast(false), seed(1)
+	{
+	}
+
+	unsigned threads;
+	size_t stackSize;
+	// bytes above stack pointer, a quarter of the stack by default
+	size_t stackUsed;
+	// zero pages in the used part of the stack, as left by big zeroed locals
+	size_t stackZero;
+	unsigned mappings;
+	size_t mappingSize;
+	unsigned libs;
+	// number of .dynamic entries
+	unsigned dynamic;
+	// size of NT_X86_XSTATE note of every thread, 0 for none
+	size_t xstate;
+	bool pie;
+	bool elf32;
+	// executable data and heap are put after all other segments, as if big
+	// mappings were below them
+	bool dataLast;
+	unsigned long seed;
+};
+
+////////////////////////////////////////////////////////////////////////////////////////////////////
+// struct Mapping
+
+struct Mapping
+{
+	enum kind_t {
+		EXEC_IMAGE,
+		EXEC_DATA,
+		HEAP,
+		LIB,
+		ANON,
+		STACK
+	};
+
+	GElf_Addr vaddr;
+	size_t size;
+	unsigned flags;
+	kind_t kind;
+	// for stacks: the thread's stack pointer
+	GElf_Addr sp;
+};
+
+////////////////////////////////////////////////////////////////////////////////////////////////////
+// struct Generator
+
+template <class Traits>
+struct Generator
+{
+	typedef typename Traits::Ehdr Ehdr;
+	typedef typename Traits::Phdr Phdr;
+	typedef typename Traits::Shdr Shdr;
+	typedef typename Traits::Dyn Dyn;
+	typedef typename Traits::Auxv Auxv;
+	typedef typename Traits::Addr Addr;
+	typedef typename Traits::RDebug RDebug;
+	typedef typename Traits::Linkmap Linkmap;
+
+	explicit Generator(const Config& config_): m_config(config_), m_random(config_.seed)
+	{
+	}
+
+	bool write(FILE* out_);
+
+private:
+	void layout();
+	void makeNotes();
+	void addNote(const char* name_, unsigned type_, const void* desc_, size_t size_);
+	void addPrStatus(const Mapping& m_, unsigned ndx_);
+	void addPrPsInfo();
+	void fillMapping(const Mapping& m_, std::vector<char>& dst_);
+	void fillExecImage(std::vector<char>& dst_);
+	void fillExecData(std::vector<char>& dst_);
+	void fillHeap(std::vector<char>& dst_);
+	void fillStack(const Mapping& m_, std::vector<char>& dst_);
+	uint64_t random();
+	GElf_Addr getCodeAddress();
+
+	GElf_Addr getExecBase() const
+	{
+		return m_config.pie ? (m_config.elf32 ? 0x56555000ULL : 0x555555554000ULL) : 0x400000ULL;
+	}
+	GElf_Addr getRDebug() const
+	{
+		return getExecBase() + EXEC_DATA_OFFSET + m_config.dynamic * sizeof(Dyn);
+	}
+	// every library has a link_map followed by its name on the heap
+	GElf_Addr getLinkmap(unsigned ndx_) const
+	{
+		return m_heap + ndx_ * (sizeof(Linkmap) + 64);
+	}
+
+	Config m_config;
+	uint64_t m_random;
+	std::vector<Mapping> m_mappings;
+	std::vector<char> m_notes;
+	GElf_Addr m_heap;
+	std::vector<GElf_Addr> m_libs;
+};
+
+template <class Traits>
+uint64_t Generator<Traits>::random()
+{
+	// xorshift64, the same core for the same seed
+	m_random ^= m_random << 13;
+	m_random ^= m_random >> 7;
+	m_random ^= m_random << 17;
+	return m_random;
+}
+
+template <class Traits>
+GElf_Addr Generator<Traits>::getCodeAddress()
+{
+	if (m_libs.empty())
+		return getExecBase() + 0x100 + random() % (PAGE_SIZE_ - 0x100);
+	return m_libs[random() % m_libs.size()] + random() % PAGE_SIZE_;
+}
+
+// Virtual address space of the process, in the order segments are put into the core
+template <class Traits>
+void Generator<Traits>::layout()
+{
+	bool is32 = m_config.elf32;
+	GElf_Addr base = getExecBase();
+	Mapping m;
+
+	m.sp = 0;
+	m.kind = Mapping::EXEC_IMAGE;
+	m.vaddr = base;
+	m.size = PAGE_SIZE_;
+	m.flags = PF_R | PF_X;
+	m_mappings.push_back(m);
+
+	m.kind = Mapping::EXEC_DATA;
+	m.vaddr = base + EXEC_DATA_OFFSET;
+	m.size = (m_config.dynamic * sizeof(Dyn) + sizeof(RDebug) + PAGE_SIZE_ - 1)
+		/ PAGE_SIZE_ * PAGE_SIZE_;
+	m.flags = PF_R | PF_W;
+	m_mappings.push_back(m);
+
+	m_heap = base + 0x1000000;
+	m.kind = Mapping::HEAP;
+	m.vaddr = m_heap;
+	m.size = (m_config.libs * (sizeof(Linkmap) + 64) + PAGE_SIZE_) / PAGE_SIZE_ * PAGE_SIZE_;
+	m_mappings.push_back(m);
+
+	GElf_Addr libBase = is32 ? 0xe0000000ULL : 0x7f0000000000ULL;
+	for (unsigned i = 0; i < m_config.libs; i++) {
+		m.kind = Mapping::LIB;
+		m.vaddr = libBase + (GElf_Addr)i * (is32 ? 0x10000 : 0x100000);
+		m.size = PAGE_SIZE_;
+		m.flags = PF_R | PF_X;
+		m_mappings.push_back(m);
+		m_libs.push_back(m.vaddr);
+	}
+
+	GElf_Addr anonBase = is32 ? 0x80000000ULL : 0x7e0000000000ULL;
+	for (unsigned i = 0; i < m_config.mappings; i++) {
+		m.kind = Mapping::ANON;
+		m.vaddr = anonBase + (GElf_Addr)i * (m_config.mappingSize + PAGE_SIZE_);
+		m.size = m_config.mappingSize;
+		m.flags = PF_R | PF_W;
+		m_mappings.push_back(m);
+	}
+
+	size_t used = m_config.stackUsed ? m_config.stackUsed : m_config.stackSize / 4;
+	used = std::min(std::max<size_t>(used, 256), m_config.stackSize) & ~15;
+	GElf_Addr top = is32 ? 0xff000000ULL : 0x7ff000000000ULL;
+	for (unsigned i = 0; i < m_config.threads; i++) {
+		m.kind = Mapping::STACK;
+		m.size = m_config.stackSize;
+		// stacks with a guard page between them
+		m.vaddr = top - (GElf_Addr)(i + 1) * (m.size + PAGE_SIZE_);
+		m.sp = m.vaddr + m.size - used;
+		m.flags = PF_R | PF_W;
+		m_mappings.push_back(m);
+	}
+}
+
+template <class Traits>
+void Generator<Traits>::addNote(const char* name_, unsigned type_, const void* desc_, size_t size_)
+{
+	Elf64_Nhdr nhdr;
+	size_t namesz = strlen(name_) + 1;
+	const char* desc = reinterpret_cast<const char*>(desc_);
+
+	nhdr.n_namesz = namesz;
+	nhdr.n_descsz = size_;
+	nhdr.n_type = type_;
+	m_notes.insert(m_notes.end(), reinterpret_cast<char*>(&nhdr),
+		reinterpret_cast<char*>(&nhdr) + sizeof(nhdr));
+	m_notes.insert(m_notes.end(), name_, name_ + namesz);
+	m_notes.resize((m_notes.size() + 3) & ~3);
+	m_notes.insert(m_notes.end(), desc, desc + size_);
+	m_notes.resize((m_notes.size() + 3) & ~3);
+}
+
+// Notes in the order of the kernel: prstatus of the first thread, process-wide notes,
+// its register sets, then every other thread with its register sets
+// NT_PRSTATUS of the thread, the kernel puts the dump signal in every thread and the
+// first one is crashing
+template <class Traits>
+void Generator<Traits>::addPrStatus(const Mapping& m_, unsigned ndx_)
+{
+	if (m_config.elf32) {
+		Prstatus32 prs;
+
+		memset(&prs, 0, sizeof(prs));
+		prs.pr_reg[CoRipper::Elf32Traits::REG_SP] = m_.sp;
+		// EBP
+		prs.pr_reg[5] = m_.sp + 32;
+		prs.pr_reg[CoRipper::Elf32Traits::REG_IP] = getCodeAddress();
+		prs.pr_pid = 1000 + ndx_;
+		prs.pr_fpvalid = 1;
+		prs.pr_cursig = SIGSEGV;
+		if (ndx_ == 0)
+			prs.si_signo = SIGSEGV;
+		addNote("CORE", NT_PRSTATUS, &prs, sizeof(prs));
+		return;
+	}
+
+	prstatus_t prs;
+	struct user_regs_struct regs;
+
+	memset(&prs, 0, sizeof(prs));
+	memset(&regs, 0, sizeof(regs));
+	regs.rsp = m_.sp;
+	regs.rbp = m_.sp + 64;
+	regs.rip = getCodeAddress();
+	memcpy(&prs.pr_reg, &regs, sizeof(regs));
+	prs.pr_pid = 1000 + ndx_;
+	prs.pr_fpvalid = 1;
+	prs.pr_cursig = SIGSEGV;
+	if (ndx_ == 0)
+		prs.pr_info.si_signo = SIGSEGV;
+	addNote("CORE", NT_PRSTATUS, &prs, sizeof(prs));
+}
+
+template <class Traits>
+void Generator<Traits>::addPrPsInfo()
+{
+	if (m_config.elf32) {
+		Prpsinfo32 psinfo;
+
+		memset(&psinfo, 0, sizeof(psinfo));
+		psinfo.pr_pid = 1000;
+		psinfo.pr_sname = 'R';
+		strcpy(psinfo.pr_fname, "bench");
+		strcpy(psinfo.pr_psargs, "bench --synthetic");
+		addNote("CORE", NT_PRPSINFO, &psinfo, sizeof(psinfo));
+		return;
+	}
+
+	prpsinfo_t psinfo;
+
+	memset(&psinfo, 0, sizeof(psinfo));
+	psinfo.pr_pid = 1000;
+	psinfo.pr_sname = 'R';
+	strcpy(psinfo.pr_fname, "bench");
+	strcpy(psinfo.pr_psargs, "bench --synthetic");
+	addNote("CORE", NT_PRPSINFO, &psinfo, sizeof(psinfo));
+}
+
+template <class Traits>
+void Generator<Traits>::makeNotes()
+{
+	std::vector<char> fpregs(m_config.elf32 ? FPREGSET32_SIZE : FPREGSET_SIZE);
+	std::vector<char> fxregs(m_config.elf32 ? FPREGSET_SIZE : 0), xstate(m_config.xstate);
+	unsigned ndx = 0;
+
+	for (size_t i = 0; i < fpregs.size(); i++)
+		fpregs[i] = random();
+	for (size_t i = 0; i < fxregs.size(); i++)
+		fxregs[i] = random();
+	for (size_t i = 0; i < xstate.size(); i++)
+		xstate[i] = random();
+
+	for (size_t i = 0; i < m_mappings.size(); i++) {
+		const Mapping& m = m_mappings[i];
+		if (m.kind != Mapping::STACK)
+			continue;
+
+		addPrStatus(m, ndx);
+		if (ndx == 0) {
+			addPrPsInfo();
+
+			siginfo_t si;
+			memset(&si, 0, sizeof(si));
+			si.si_signo = SIGSEGV;
+			addNote("CORE", NT_SIGINFO, &si, sizeof(si));
+
+			GElf_Addr phdr = getExecBase() + sizeof(Ehdr);
+			Auxv auxv[] = {
+				{ AT_PHDR, { 0 } }, { AT_PHENT, { sizeof(Phdr) } }, { AT_PHNUM, { 4 } },
+				{ AT_PAGESZ, { PAGE_SIZE_ } }, { AT_ENTRY, { 0 } }, { AT_NULL, { 0 } }
+			};
+			auxv[0].a_un.a_val = phdr;
+			auxv[4].a_un.a_val = phdr + 0x100;
+			addNote("CORE", NT_AUXV, auxv, sizeof(auxv));
+
+			// mapped files: count, page size, ranges and names of the executable
+			// and the libraries
+			std::vector<GElf_Addr> words;
+			std::string names;
+			words.push_back(m_libs.size() + 2);
+			words.push_back(PAGE_SIZE_);
+			for (size_t e = 0; e < 2; e++) {
+				const Mapping& exec = m_mappings[e];
+				words.push_back(exec.vaddr);
+				words.push_back(exec.vaddr + exec.size);
+				words.push_back(exec.kind == Mapping::EXEC_DATA ? EXEC_DATA_OFFSET / PAGE_SIZE_ : 0);
+				names.append("/usr/bin/bench", sizeof("/usr/bin/bench"));
+			}
+			for (size_t l = 0; l < m_libs.size(); l++) {
+				char name[64];
+				snprintf(name, sizeof(name), "/usr/lib/libbench%zu.so", l);
+				words.push_back(m_libs[l]);
+				words.push_back(m_libs[l] + PAGE_SIZE_);
+				words.push_back(0);
+				names.append(name, strlen(name) + 1);
+			}
+			std::vector<char> file;
+			for (size_t w = 0; w < words.size(); w++) {
+				if (m_config.elf32) {
+					uint32_t v = words[w];
+					file.insert(file.end(), (char*)&v, (char*)&v + sizeof(v));
+				}
+				else
+					file.insert(file.end(), (char*)&words[w], (char*)&words[w] + sizeof(words[w]));
+			}
+			file.insert(file.end(), names.begin(), names.end());
+			addNote("CORE", NT_FILE, &file[0], file.size());
+		}
+
+		addNote("CORE", NT_FPREGSET, &fpregs[0], fpregs.size());
+		if (!fxregs.empty())
+			addNote("LINUX", NT_PRXFPREG, &fxregs[0], fxregs.size());
+		if (!xstate.empty())
+			addNote("LINUX", NT_X86_XSTATE, &xstate[0], xstate.size());
+		ndx++;
+	}
+}
+
+// Executable's ELF header and program headers, as the loader left them in memory
+template <class Traits>
+void Generator<Traits>::fillExecImage(std::vector<char>& dst_)
+{
+	GElf_Addr bias = m_config.pie ? 0 : getExecBase();
+	Ehdr ehdr;
+	Phdr phdrs[4];
+
+	memset(&ehdr, 0, sizeof(ehdr));
+	memset(phdrs, 0, sizeof(phdrs));
+	memcpy(ehdr.e_ident, ELFMAG, SELFMAG);
+	ehdr.e_ident[EI_CLASS] = m_config.elf32 ? ELFCLASS32 : ELFCLASS64;
+	ehdr.e_ident[EI_DATA] = ELFDATA2LSB;
+	ehdr.e_ident[EI_VERSION] = EV_CURRENT;
+	ehdr.e_type = m_config.pie ? ET_DYN : ET_EXEC;
+	ehdr.e_machine = m_config.elf32 ? EM_386 : EM_X86_64;
+	ehdr.e_version = EV_CURRENT;
+	ehdr.e_phoff = sizeof(ehdr);
+	ehdr.e_ehsize = sizeof(ehdr);
+	ehdr.e_phentsize = sizeof(Phdr);
+	ehdr.e_phnum = 4;
+
+	phdrs[0].p_type = PT_PHDR;
+	phdrs[0].p_offset = sizeof(ehdr);
+	phdrs[0].p_vaddr = bias + sizeof(ehdr);
+	phdrs[0].p_filesz = phdrs[0].p_memsz = sizeof(phdrs);
+	phdrs[0].p_flags = PF_R;
+	phdrs[1].p_type = PT_LOAD;
+	phdrs[1].p_vaddr = bias;
+	phdrs[1].p_filesz = phdrs[1].p_memsz = PAGE_SIZE_;
+	phdrs[1].p_flags = PF_R | PF_X;
+	phdrs[2].p_type = PT_LOAD;
+	phdrs[2].p_vaddr = bias + EXEC_DATA_OFFSET;
+	phdrs[2].p_filesz = phdrs[2].p_memsz = PAGE_SIZE_;
+	phdrs[2].p_flags = PF_R | PF_W;
+	phdrs[3].p_type = PT_DYNAMIC;
+	phdrs[3].p_vaddr = bias + EXEC_DATA_OFFSET;
+	phdrs[3].p_filesz = phdrs[3].p_memsz = m_config.dynamic * sizeof(Dyn);
+	phdrs[3].p_flags = PF_R | PF_W;
+
+	for (size_t i = 0; i < dst_.size(); i++)
+		dst_[i] = random();
+	memcpy(&dst_[0], &ehdr, sizeof(ehdr));
+	memcpy(&dst_[sizeof(ehdr)], phdrs, sizeof(phdrs));
+}
+
+// .dynamic with DT_DEBUG pointing to r_debug which follows it
+template <class Traits>
+void Generator<Traits>::fillExecData(std::vector<char>& dst_)
+{
+	std::vector<Dyn> dyn(m_config.dynamic);
+
+	memset(&dyn[0], 0, dyn.size() * sizeof(Dyn));
+	for (size_t i = 0; i + 2 < dyn.size(); i++) {
+		dyn[i].d_tag = DT_NEEDED;
+		dyn[i].d_un.d_val = i * 16;
+	}
+	if (dyn.size() >= 2) {
+		dyn[dyn.size() - 2].d_tag = DT_DEBUG;
+		dyn[dyn.size() - 2].d_un.d_ptr = getRDebug();
+	}
+	memcpy(&dst_[0], &dyn[0], dyn.size() * sizeof(Dyn));
+
+	RDebug rdebug;
+	memset(&rdebug, 0, sizeof(rdebug));
+	rdebug.r_version = 1;
+	rdebug.r_map = m_libs.empty() ? 0 : getLinkmap(0);
+	memcpy(&dst_[dyn.size() * sizeof(Dyn)], &rdebug, sizeof(rdebug));
+}
+
+// Linkmap chain of all libraries, each entry followed by the library name
+template <class Traits>
+void Generator<Traits>::fillHeap(std::vector<char>& dst_)
+{
+	for (unsigned i = 0; i < m_libs.size(); i++) {
+		GElf_Addr vaddr = getLinkmap(i);
+		char* p = &dst_[vaddr - m_heap];
+		Linkmap lmap;
+
+		memset(&lmap, 0, sizeof(lmap));
+		lmap.l_addr = m_libs[i];
+		lmap.l_name = vaddr + sizeof(lmap);
+		if (i + 1 < m_libs.size())
+			lmap.l_next = getLinkmap(i + 1);
+		if (i > 0)
+			lmap.l_prev = getLinkmap(i - 1);
+		memcpy(p, &lmap, sizeof(lmap));
+		snprintf(p + sizeof(lmap), 64, "/usr/lib/libbench%u.so", i);
+	}
+}
+
+// Stack is zero below stack pointer, above it frames have code addresses mixed
+// with other data
+template <class Traits>
+void Generator<Traits>::fillStack(const Mapping& m_, std::vector<char>& dst_)
+{
+	Addr* words = reinterpret_cast<Addr*>(&dst_[m_.sp - m_.vaddr]);
+	size_t count = (m_.vaddr + m_.size - m_.sp) / sizeof(Addr);
+
+	for (size_t i = 0; i < count; i++)
+		words[i] = (i % 4 == 1) ? getCodeAddress() : random() >> (random() % 64);
+
+	// zero pages start one page above the stack pointer, the frames around stay
+	size_t zero = (m_.sp - m_.vaddr + 2 * PAGE_SIZE_ - 1) / PAGE_SIZE_ * PAGE_SIZE_;
+	if (zero < m_.size)
+		memset(&dst_[zero], 0, std::min(m_config.stackZero, m_.size - zero));
+}
+
+template <class Traits>
+void Generator<Traits>::fillMapping(const Mapping& m_, std::vector<char>& dst_)
+{
+	dst_.assign(m_.size, 0);
+
+	switch (m_.kind) {
+	case Mapping::EXEC_IMAGE:
+		fillExecImage(dst_);
+		break;
+	case Mapping::EXEC_DATA:
+		fillExecData(dst_);
+		break;
+	case Mapping::HEAP:
+		fillHeap(dst_);
+		break;
+	case Mapping::STACK:
+		fillStack(m_, dst_);
+		break;
+	default:
+		for (size_t i = 0; i < dst_.size(); i += sizeof(uint64_t)) {
+			uint64_t r = random();
+			memcpy(&dst_[i], &r, sizeof(r));
+		}
+	}
+}
+
+template <class Traits>
+bool Generator<Traits>::write(FILE* out_)
+{
+	layout();
+	makeNotes();
+
+	size_t phnum = m_mappings.size() + 1;
+	std::vector<Phdr> phdrs(phnum);
+	Ehdr ehdr;
+	Shdr shdr;
+
+	memset(&ehdr, 0, sizeof(ehdr));
+	memset(&shdr, 0, sizeof(shdr));
+	memset(&phdrs[0], 0, phnum * sizeof(Phdr));
+	memcpy(ehdr.e_ident, ELFMAG, SELFMAG);
+	ehdr.e_ident[EI_CLASS] = m_config.elf32 ? ELFCLASS32 : ELFCLASS64;
+	ehdr.e_ident[EI_DATA] = ELFDATA2LSB;
+	ehdr.e_ident[EI_VERSION] = EV_CURRENT;
+	ehdr.e_type = ET_CORE;
+	ehdr.e_machine = m_config.elf32 ? EM_386 : EM_X86_64;
+	ehdr.e_version = EV_CURRENT;
+	ehdr.e_phoff = sizeof(ehdr);
+	ehdr.e_ehsize = sizeof(ehdr);
+	ehdr.e_phentsize = sizeof(Phdr);
+	ehdr.e_phnum = phnum < PN_XNUM ? phnum : PN_XNUM;
+
+	size_t offset = sizeof(ehdr) + phnum * sizeof(Phdr);
+	phdrs[0].p_type = PT_NOTE;
+	phdrs[0].p_offset = offset;
+	phdrs[0].p_filesz = m_notes.size();
+	phdrs[0].p_align = 4;
+	offset = (offset + m_notes.size() + PAGE_SIZE_ - 1) / PAGE_SIZE_ * PAGE_SIZE_;
+	size_t dataOffset = offset;
+
+	// mappings in the order of their data in the core
+	std::vector<size_t> order;
+	for (size_t i = 0; i < m_mappings.size(); i++) {
+		Mapping::kind_t k = m_mappings[i].kind;
+		if (!m_config.dataLast || (k != Mapping::EXEC_DATA && k != Mapping::HEAP))
+			order.push_back(i);
+	}
+	for (size_t i = 0; order.size() < m_mappings.size(); i++) {
+		Mapping::kind_t k = m_mappings[i].kind;
+		if (k == Mapping::EXEC_DATA || k == Mapping::HEAP)
+			order.push_back(i);
+	}
+
+	for (size_t o = 0; o < order.size(); o++) {
+		size_t i = order[o];
+		Phdr& p = phdrs[i + 1];
+		p.p_type = PT_LOAD;
+		p.p_offset = offset;
+		p.p_vaddr = m_mappings[i].vaddr;
+		p.p_filesz = p.p_memsz = m_mappings[i].size;
+		p.p_flags = m_mappings[i].flags;
+		p.p_align = PAGE_SIZE_;
+		offset += m_mappings[i].size;
+	}
+
+	// extended numbering, section header 0 after the data keeps the number
+	if (phnum >= PN_XNUM) {
+		shdr.sh_info = phnum;
+		ehdr.e_shoff = offset;
+		ehdr.e_shentsize = sizeof(shdr);
+		ehdr.e_shnum = 1;
+	}
+
+	std::vector<char> head(dataOffset, 0);
+	memcpy(&head[0], &ehdr, sizeof(ehdr));
+	memcpy(&head[sizeof(ehdr)], &phdrs[0], phnum * sizeof(Phdr));
+	memcpy(&head[phdrs[0].p_offset], &m_notes[0], m_notes.size());
+	if (fwrite(&head[0], head.size(), 1, out_) != 1)
+		return false;
+
+	std::vector<char> data;
+	for (size_t o = 0; o < order.size(); o++) {
+		fillMapping(m_mappings[order[o]], data);
+		if (fwrite(&data[0], data.size(), 1, out_) != 1)
+			return false;
+	}
+
+	if (phnum >= PN_XNUM && fwrite(&shdr, sizeof(shdr), 1, out_) != 1)
+		return false;
+
+	return fflush(out_) == 0;
+}
+
+void usage(const char* name)
+{
+	std::cerr << "Usage: "
+		<< name
+		<< " [--threads <N>] [--stack <KB>] [--stack-used <KB>] [--stack-zero <KB>] [--mappings <N>]"
+		<< " [--mapping-size <KB>]"
+		<< " [--libs <N>] [--dynamic <N>] [--xstate <bytes>] [--static] [--elf32] [--data-last]"
+		<< " [--seed <N>] <output path>"
+		<< std::endl;
+}
+
+} // namespace
+
+int main(int argc, char** argv)
+{
+	static const struct option options[] = {
+		{"threads", required_argument, NULL, 't'},
+		{"stack", required_argument, NULL, 's'},
+		{"stack-used", required_argument, NULL, 'u'},
+		{"stack-zero", required_argument, NULL, 'z'},
+		{"mappings", required_argument, NULL, 'm'},
+		{"mapping-size", required_argument, NULL, 'M'},
+		{"libs", required_argument, NULL, 'l'},
+		{"dynamic", required_argument, NULL, 'd'},
+		{"xstate", required_argument, NULL, 'x'},
+		{"static", no_argument, NULL, 'S'},
+		{"elf32", no_argument, NULL, '3'},
+		{"data-last", no_argument, NULL, 'L'},
+		{"seed", required_argument, NULL, 'r'},
+		{"help", no_argument, NULL, 'h'},
+		{NULL, 0, NULL, 0}
+	};
+
+	Config config;
+	int c;
+
+	while ((c = getopt_long(argc, argv, "t:s:u:z:m:M:l:d:x:S3Lr:h", options, NULL)) != -1) {
+		switch (c) {
+		case 't':
+			config.threads = strtoul(optarg, NULL, 10);
+			break;
+		case 's':
+			config.stackSize = (strtoul(optarg, NULL, 10) << 10) / PAGE_SIZE_ * PAGE_SIZE_;
+			break;
+		case 'u':
+			config.stackUsed = strtoul(optarg, NULL, 10) << 10;
+			break;
+		case 'z':
+			config.stackZero = (strtoul(optarg, NULL, 10) << 10) / PAGE_SIZE_ * PAGE_SIZE_;
+			break;
+		case 'm':
+			config.mappings = strtoul(optarg, NULL, 10);
+			break;
+		case 'M':
+			config.mappingSize = (strtoul(optarg, NULL, 10) << 10) / PAGE_SIZE_ * PAGE_SIZE_;
+			break;
+		case 'l':
+			config.libs = strtoul(optarg, NULL, 10);
+			break;
+		case 'd':
+			config.dynamic = strtoul(optarg, NULL, 10);
+			break;
+		case 'x':
+			config.xstate = strtoul(optarg, NULL, 10);
+			break;
+		case 'S':
+			config.pie = false;
+			break;
+		case '3':
+			config.elf32 = true;
+			break;
+		case 'L':
+			config.dataLast = true;
+			break;
+		case 'r':
+			config.seed = strtoul(optarg, NULL, 10);
+			break;
+		default:
+			usage(argv[0]);
+			return -1;
+		}
+	}
+
+	if (optind + 1 != argc || config.threads == 0 || config.stackSize == 0
+		|| config.mappingSize == 0 || config.dynamic < 2 || config.seed == 0) {
+		usage(argv[0]);
+		return -1;
+	}
+
+	FILE* out = fopen(argv[optind], "w");
+	if (out == NULL) {
+		std::cerr << "Failed to create " << argv[optind] << std::endl;
+		return -1;
+	}
+
+	bool res;
+	if (config.elf32)
+		res = Generator<CoRipper::Elf32Traits>(config).write(out);
+	else
+		res = Generator<CoRipper::Elf64Traits>(config).write(out);
+
+	if (fclose(out) != 0 || !res) {
+		std::cerr << "Failed to write " << argv[optind] << std::endl;
+		return -1;
+	}
+	return 0;
+}
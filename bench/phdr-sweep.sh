@@ -0,0 +1,41 @@
+#!/bin/bash
+# Sweeps the number of mappings of a synthetic core with many threads and libraries
+# and prints one line per core: mappings, program header lookups, wall ms of the
+# phases which look segments up by address (dynamic, r_debug, linkmaps, stacks),
+# the same per lookup in ns, and wall ms of opening the core. With the lookups
+# done by binary search, the time per lookup has to stay flat as mappings grow.
+
+CORIPPER=$(readlink -f "${1:?Usage: $0 <coripper>}")
+BENCH_DIR=${BENCH_DIR:-/var/tmp/coripper-bench}
+MAPPINGS=${MAPPINGS:-"1000 10000 70000 200000"}
+HERE=$(dirname "$(readlink -f "$0")")
+
+mkdir -p "$BENCH_DIR" || exit 1
+
+printf "mappings\tlookups\tlookup ms\tns/lookup\topen ms\n"
+for n in $MAPPINGS; do
+	core=$BENCH_DIR/sweep-$n.core
+	opts="--threads 1000 --libs 200 --mappings $n"
+	if [ "$(cat "$core.opts" 2>/dev/null)" != "$opts" ] || [ "$core" -ot "$HERE/gencore" ]; then
+		"$HERE/gencore" $opts "$core" || exit 1
+		echo "$opts" > "$core.opts"
+	fi
+	"$CORIPPER" --stats="$BENCH_DIR/sweep.json" "$core" > /dev/null || exit 1
+	awk '
+		/"name": "(readDynamic|readRDebug|readLinkmaps|readStacks)"/ {
+			lookup += $4
+		}
+		/"name": "open"/ {
+			open = $4
+		}
+		/"phdr_lookups"/ {
+			lookups = $2
+		}
+		END {
+			sub(",", "", lookups)
+			printf "%s\t%d\t%.3f\t%.0f\t%.3f\n", n, lookups, lookup,
+				lookups ? lookup * 1e6 / lookups : 0, open
+		}
+	' n="$n" FS='[ ,]+' "$BENCH_DIR/sweep.json"
+done
+rm -f "$BENCH_DIR/sweep.json"
@@ -0,0 +1,151 @@
+/*
+ * Copyright (c) 2015-2017 Parallels IP Holdings GmbH
+ * Copyright (c) 2017-2019 Virtuozzo International GmbH. All rights reserved.
+ *
+ * This file is part of OpenVZ. OpenVZ is free software; you can redistribute
+ * it and/or modify it under the terms of the GNU General Public License as
+ * published by the Free Software Foundation; either version 2 of the License,
+ * or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA
+ * 02110-1301, USA.
+ *
+ * Our contact details: Virtuozzo International GmbH, Vordergasse 59, 8200
+ * Schaffhausen, Switzerland.
+ */
+
+// Runs a command and prints one tab separated line with its wall time in ms,
+// user and system CPU time in ms, peak RSS in KB, bytes read and written and
+// the number of read and write syscalls, as accounted in /proc/<pid>/io.
+
+#include <iostream>
+#include <fstream>
+#include <sstream>
+#include <string>
+#include <cstdlib>
+#include <cstring>
+#include <cerrno>
+#include <ctime>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <sys/time.h>
+#include <sys/resource.h>
+
+namespace
+{
+
+////////////////////////////////////////////////////////////////////////////////////////////////////
+// struct Io
+
+struct Io
+{
+	Io(): rchar(0), wchar(0), syscr(0), syscw(0)
+	{
+	}
+
+	bool read(pid_t pid_);
+
+	unsigned long long rchar;
+	unsigned long long wchar;
+	unsigned long long syscr;
+	unsigned long long syscw;
+};
+
+bool Io::read(pid_t pid_)
+{
+	std::ostringstream path;
+	path << "/proc/" << pid_ << "/io";
+
+	std::ifstream in(path.str().c_str());
+	std::string name;
+	unsigned long long value;
+
+	while (in >> name >> value) {
+		if (name == "rchar:")
+			rchar = value;
+		else if (name == "wchar:")
+			wchar = value;
+		else if (name == "syscr:")
+			syscr = value;
+		else if (name == "syscw:")
+			syscw = value;
+	}
+	return in.eof();
+}
+
+long getMs(const struct timeval& tv_)
+{
+	return tv_.tv_sec * 1000 + tv_.tv_usec / 1000;
+}
+
+double getNow()
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000.0 + ts.tv_nsec / 1000000.0;
+}
+
+} // namespace
+
+int main(int argc, char** argv)
+{
+	if (argc < 2) {
+		std::cerr << "Usage: " << argv[0] << " <command> [args]" << std::endl;
+		return -1;
+	}
+
+	double start = getNow();
+	pid_t pid = fork();
+	if (pid < 0) {
+		std::cerr << "ERROR: fork: " << strerror(errno) << std::endl;
+		return -1;
+	}
+	if (pid == 0) {
+		execvp(argv[1], argv + 1);
+		std::cerr << "ERROR: exec " << argv[1] << ": " << strerror(errno) << std::endl;
+		_exit(127);
+	}
+
+	// the child stays a zombie until reaped, so its io counters are still there
+	siginfo_t info;
+	while (waitid(P_PID, pid, &info, WEXITED | WNOWAIT) != 0) {
+		if (errno != EINTR) {
+			std::cerr << "ERROR: waitid: " << strerror(errno) << std::endl;
+			return -1;
+		}
+	}
+	double wall = getNow() - start;
+
+	Io io;
+	if (!io.read(pid))
+		std::cerr << "Failed to read io counters of " << pid << std::endl;
+
+	int status;
+	struct rusage usage;
+	if (wait4(pid, &status, 0, &usage) != pid) {
+		std::cerr << "ERROR: wait4: " << strerror(errno) << std::endl;
+		return -1;
+	}
+
+	std::cout << (long)wall
+		<< '\t' << getMs(usage.ru_utime)
+		<< '\t' << getMs(usage.ru_stime)
+		<< '\t' << usage.ru_maxrss
+		<< '\t' << io.rchar
+		<< '\t' << io.wchar
+		<< '\t' << io.syscr + io.syscw
+		<< std::endl;
+
+	if (!WIFEXITED(status))
+		return -1;
+	return WEXITSTATUS(status);
+}
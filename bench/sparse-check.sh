@@ -0,0 +1,68 @@
+#!/bin/bash
+# Reads the memory of --sparse cores written to a pipe and compressed back with gdb
+# and compares it with the plain output. Zero pages are left out of the split stack
+# segments and kept only in p_memsz there, gdb 10 or later reads them as zeros.
+# Needs gdb, and zstd for the compressed output.
+
+CORIPPER=$(readlink -f "${1:?Usage: $0 <coripper>}")
+BENCH_DIR=${BENCH_DIR:-/var/tmp/coripper-bench}
+HERE=$(dirname "$(readlink -f "$0")")
+
+if ! type gdb > /dev/null 2>&1; then
+	echo "gdb is required" >&2
+	exit 1
+fi
+
+mkdir -p "$BENCH_DIR" || exit 1
+
+core=$BENCH_DIR/sparse-check.core
+opts="--threads 8 --stack 1024 --stack-used 1024 --stack-zero 960"
+if [ "$(cat "$core.opts" 2>/dev/null)" != "$opts" ] || [ "$core" -ot "$HERE/gencore" ]; then
+	"$HERE/gencore" $opts "$core" || exit 1
+	echo "$opts" > "$core.opts"
+fi
+
+dir=$BENCH_DIR/sparse-check
+rm -rf "$dir" && mkdir -p "$dir" || exit 1
+
+"$CORIPPER" "$core" > "$dir/plain.core" || exit 1
+"$CORIPPER" --sparse "$core" | cat > "$dir/pipe.core" || exit 1
+variants="pipe"
+if type zstd > /dev/null 2>&1 && "$CORIPPER" --sparse -z zstd "$core" > "$dir/zstd.core.zst"; then
+	zstd -q -d "$dir/zstd.core.zst" -o "$dir/zstd.core" || exit 1
+	variants="$variants zstd"
+fi
+
+# address ranges of all loadable segments of the plain output as gdb sees them
+gdb -batch -nx -c "$dir/plain.core" -ex "info files" 2>/dev/null \
+	| awk '$2 == "-" && $4 == "is" && $5 ~ /^load/ && $1 != $3 { print $1, $3 }' > "$dir/ranges"
+if [ ! -s "$dir/ranges" ]; then
+	echo "No loadable segments found by gdb in $dir/plain.core" >&2
+	exit 1
+fi
+
+# every range is dumped by its own command, so one failed read doesn't stop the rest
+dump()
+{
+	local name=$1 start end n=0
+	local cmds=()
+	mkdir -p "$dir/$name" || exit 1
+	while read -r start end; do
+		n=$((n + 1))
+		cmds+=(-ex "dump binary memory $dir/$name/$n $start $end")
+	done < "$dir/ranges"
+	gdb -batch -nx -c "$dir/$name.core" "${cmds[@]}" > "$dir/$name.log" 2>&1
+}
+
+dump plain
+failed=0
+for v in $variants; do
+	dump "$v"
+	if diff -r "$dir/plain" "$dir/$v" > /dev/null; then
+		echo "OK: $v $(stat -c %s "$dir/$v.core") bytes, plain $(stat -c %s "$dir/plain.core") bytes"
+	else
+		echo "MISMATCH: $v memory differs from plain output, see $dir/$v.log"
+		failed=1
+	fi
+done
+exit $failed
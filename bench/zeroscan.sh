@@ -0,0 +1,41 @@
+#!/bin/bash
+# Measures how fast --sparse finds zero pages: a core with stacks kept whole and zero
+# but for the frames at their ends is
+# stripped to a pipe, where zero pages are elided before writing, and the stack
+# bytes are divided by the wall time of the zeroScan phase from --stats. The time
+# includes reading the data with pread(2), the core is in page cache.
+
+CORIPPER=$(readlink -f "${1:?Usage: $0 <coripper>}")
+BENCH_DIR=${BENCH_DIR:-/var/tmp/coripper-bench}
+REPEAT=${REPEAT:-3}
+THREADS=64
+STACK_KB=8192
+HERE=$(dirname "$(readlink -f "$0")")
+
+mkdir -p "$BENCH_DIR" || exit 1
+
+core=$BENCH_DIR/zeroscan.core
+opts="--threads $THREADS --stack $STACK_KB --stack-used $STACK_KB --stack-zero $((STACK_KB - 64))"
+if [ "$(cat "$core.opts" 2>/dev/null)" != "$opts" ] || [ "$core" -ot "$HERE/gencore" ]; then
+	"$HERE/gencore" $opts "$core" || exit 1
+	echo "$opts" > "$core.opts"
+fi
+cat "$core" > /dev/null
+
+printf "stack MB\tzeroScan ms\tGB/s\n"
+for ((i = 0; i < REPEAT; i++)); do
+	"$CORIPPER" --sparse --stats="$BENCH_DIR/zeroscan.json" "$core" | cat > /dev/null || exit 1
+	awk '
+		/"name": "zeroScan"/ {
+			ms = $4
+		}
+		END {
+			if (ms == "") {
+				print "No zeroScan phase in --stats" > "/dev/stderr"
+				exit 1
+			}
+			printf "%d\t%.3f\t%.2f\n", bytes / 1048576, ms, (ms > 0 ? bytes / ms / 1e6 : 0)
+		}
+	' bytes=$((THREADS * STACK_KB * 1024)) FS='[ ,]+' "$BENCH_DIR/zeroscan.json" || exit 1
+done
+rm -f "$BENCH_DIR/zeroscan.json"
@@ -0,0 +1,98 @@
+/*
+ * Copyright (c) 2015-2017 Parallels IP Holdings GmbH
+ * Copyright (c) 2017-2019 Virtuozzo International GmbH. All rights reserved.
+ *
+ * This file is part of OpenVZ. OpenVZ is free software; you can redistribute
+ * it and/or modify it under the terms of the GNU General Public License as
+ * published by the Free Software Foundation; either version 2 of the License,
+ * or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA
+ * 02110-1301, USA.
+ *
+ * Our contact details: Virtuozzo International GmbH, Vordergasse 59, 8200
+ * Schaffhausen, Switzerland.
+ */
+
+#ifndef __CORE_BATCH_H__
+#define __CORE_BATCH_H__
+
+#include <map>
+#include <string>
+#include <vector>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <boost/thread/mutex.hpp>
+#include <coripper.h>
+
+namespace CoRipper
+{
+
+////////////////////////////////////////////////////////////////////////////////////////////////////
+// struct Batch
+
+// Strips many cores in one process. Files are taken by a fixed number of
+// workers, each reusing its own Core, largest files first so that the big
+// ones don't end up alone at the tail of the run.
+struct Batch
+{
+	Batch(const std::string& outDir_, const Policy& policy_, size_t scratchLimit_,
+		unsigned threads_, const Compression& compression_, const SignatureCache* cache_ = NULL);
+
+	// add all regular files from directory or paths listed one per line in file,
+	// files whose output name is already taken by another one or which are in the
+	// output directory are rejected
+	bool add(const char* path_);
+	// returns number of failed cores
+	size_t run(unsigned workers_);
+
+	// name of stripped core: source name without compression suffix, with
+	// suffix of output compression
+	static std::string getOutName(const std::string& name_, const Compression& compression_);
+
+private:
+	struct Item
+	{
+		std::string path;
+		off_t size;
+
+		bool operator<(const Item& other_) const
+		{
+			return size > other_.size;
+		}
+	};
+
+	bool addFile(const std::string& path_);
+	bool addDir(const std::string& path_);
+	bool addList(const std::string& path_);
+	void runWorker();
+	bool strip(Core& core_, const Item& item_, off_t& outSize_);
+
+	Policy m_policy;
+	size_t m_scratchLimit;
+	unsigned m_threads;
+	Compression m_compression;
+	const SignatureCache* m_cache;
+	std::string m_outDir;
+	// output directory identity, zero st_ino if it can't be accessed
+	struct stat m_outStat;
+	std::vector<Item> m_items;
+	// output names taken by the items and number of rejected files
+	std::map<std::string, std::string> m_names;
+	size_t m_rejected;
+	// guards m_next, m_failed and status output
+	boost::mutex m_lock;
+	size_t m_next;
+	size_t m_failed;
+};
+
+} //namespace CoRipper
+
+#endif //__CORE_BATCH_H__
@@ -0,0 +1,107 @@
+/*
+ * Copyright (c) 2015-2017 Parallels IP Holdings GmbH
+ * Copyright (c) 2017-2019 Virtuozzo International GmbH. All rights reserved.
+ *
+ * This file is part of OpenVZ. OpenVZ is free software; you can redistribute
+ * it and/or modify it under the terms of the GNU General Public License as
+ * published by the Free Software Foundation; either version 2 of the License,
+ * or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA
+ * 02110-1301, USA.
+ *
+ * Our contact details: Virtuozzo International GmbH, Vordergasse 59, 8200
+ * Schaffhausen, Switzerland.
+ */
+
+#ifndef __CORE_COMPRESS_H__
+#define __CORE_COMPRESS_H__
+
+#include <cstddef>
+#include <sys/types.h>
+#include <boost/shared_ptr.hpp>
+
+namespace CoRipper
+{
+
+////////////////////////////////////////////////////////////////////////////////////////////////////
+// struct Compression
+
+struct Compression
+{
+	enum type_t {
+		NONE,
+		ZSTD,
+		LZ4
+	};
+
+	Compression(): type(NONE), level(0), threads(1)
+	{
+	}
+
+	// parse "zstd|lz4[:level]"
+	bool parse(const char* spec_);
+
+	type_t type;
+	// 0 stands for library default
+	int level;
+	// zstd workers, 0 compresses in the writing thread. Every worker keeps its own
+	// window and buffers, so they are not spread over all CPUs by default.
+	unsigned threads;
+};
+
+////////////////////////////////////////////////////////////////////////////////////////////////////
+// struct Sink
+
+// Final destination of the written data, either plain file descriptor or
+// compressor producing standard frames into it
+struct Sink
+{
+	typedef boost::shared_ptr<Sink> ptr_t;
+
+	virtual ~Sink()
+	{
+	}
+
+	virtual bool write(const char* buff_, size_t size_) = 0;
+	// complete the output, no writes are allowed after that
+	virtual bool finish() = 0;
+
+	// output function returns false to stop writing
+	typedef bool (*write_t)(void* ctx_, const char* buff_, size_t size_);
+
+	static ptr_t create(int fd_, const Compression& compression_);
+	static ptr_t create(write_t write_, void* ctx_, const Compression& compression_);
+};
+
+////////////////////////////////////////////////////////////////////////////////////////////////////
+// struct Source
+
+// Sequential input which transparently decompresses zstd, lz4 and xz streams
+struct Source
+{
+	typedef boost::shared_ptr<Source> ptr_t;
+
+	virtual ~Source()
+	{
+	}
+
+	// returns number of bytes read, 0 at the end of data and -1 on error
+	virtual ssize_t read(char* buff_, size_t size_) = 0;
+
+	// detect compression format by the magic at the head of descriptor
+	static ptr_t open(int fd_);
+	static ptr_t open(const char* buff_, size_t size_);
+	static bool isCompressed(const char* head_, size_t size_);
+};
+
+} //namespace CoRipper
+
+#endif //__CORE_COMPRESS_H__
@@ -0,0 +1,148 @@
+/*
+ * Copyright (c) 2015-2017 Parallels IP Holdings GmbH
+ * Copyright (c) 2017-2019 Virtuozzo International GmbH. All rights reserved.
+ *
+ * This file is part of OpenVZ. OpenVZ is free software; you can redistribute
+ * it and/or modify it under the terms of the GNU General Public License as
+ * published by the Free Software Foundation; either version 2 of the License,
+ * or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA
+ * 02110-1301, USA.
+ *
+ * Our contact details: Virtuozzo International GmbH, Vordergasse 59, 8200
+ * Schaffhausen, Switzerland.
+ */
+
+#ifndef __CORE_DAEMON_H__
+#define __CORE_DAEMON_H__
+
+#include <set>
+#include <map>
+#include <deque>
+#include <string>
+#include <vector>
+#include <ctime>
+#include <sys/types.h>
+#include <boost/thread/mutex.hpp>
+#include <boost/thread/condition_variable.hpp>
+#include <coripper.h>
+
+namespace CoRipper
+{
+
+////////////////////////////////////////////////////////////////////////////////////////////////////
+// struct Daemon
+
+// Long-running stripper. Cores come from a spool directory watched with inotify
+// and from core_pattern clients passing their stdin over AF_UNIX socket. Jobs
+// are run by a fixed number of workers; admission is limited by the estimated
+// bytes in flight (jobs are deferred) and by per-binary rate (jobs are shed).
+struct Daemon
+{
+	struct Config
+	{
+		Config(): workers(1), maxInflight(0), rateLimit(0), scratchLimit(0), cache(NULL)
+		{
+		}
+
+		std::string spoolDir;
+		std::string outDir;
+		std::string socketPath;
+		unsigned workers;
+		// 0 means no limit
+		size_t maxInflight;
+		// cores per binary per minute, 0 means no limit
+		unsigned rateLimit;
+		size_t scratchLimit;
+		Policy policy;
+		Compression compression;
+		const SignatureCache* cache;
+	};
+
+	// status sent back to the client
+	enum status_t {
+		STATUS_OK,
+		STATUS_FAILED,
+		STATUS_SHED,
+		STATUS_DUPLICATE
+	};
+
+	explicit Daemon(const Config& config_);
+	~Daemon();
+
+	bool run();
+
+	// core_pattern side: pass stdin to the daemon and wait for the result
+	static int runClient(const char* socket_, const char* name_);
+
+private:
+	struct Job
+	{
+		Job(): fd(-1), client(-1), size(0), seq(0)
+		{
+		}
+
+		// streamed cores block the crashing process, so they go first, then
+		// smaller cores to get through the storm faster
+		bool operator<(const Job& other_) const
+		{
+			if ((fd < 0) != (other_.fd < 0))
+				return fd >= 0;
+			if (size != other_.size)
+				return size < other_.size;
+			return seq < other_.seq;
+		}
+
+		std::string name;
+		std::string binary;
+		// spool file for spooled cores, the core is read from fd for streamed ones
+		std::string path;
+		int fd;
+		int client;
+		off_t size;
+		unsigned seq;
+	};
+
+	bool openSocket();
+	bool openSpool();
+	void scanSpool();
+	void addSpoolFile(const std::string& name_);
+	void acceptClient();
+	bool readClient(int client_);
+	int getClientTimeout() const;
+	void submit(Job& job_);
+	bool isRateLimited(const std::string& binary_);
+	void runWorker();
+	bool takeJob(Job& job_);
+	bool process(Core& core_, const Job& job_, off_t& outSize_);
+	void finish(const Job& job_, status_t status_);
+
+	Config m_config;
+	int m_socket;
+	int m_inotify;
+	int m_signal;
+	// accepted clients waiting for their message, by accept time
+	std::map<int, double> m_clients;
+	// guards everything below
+	boost::mutex m_lock;
+	boost::condition_variable m_cond;
+	std::set<Job> m_queue;
+	std::set<std::string> m_pending;
+	std::map<std::string, std::deque<time_t> > m_admitted;
+	size_t m_inflight;
+	unsigned m_running;
+	unsigned m_seq;
+	bool m_stop;
+};
+
+} //namespace CoRipper
+
+#endif //__CORE_DAEMON_H__
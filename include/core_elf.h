@@ -0,0 +1,191 @@
+/*
+ * Copyright (c) 2015-2017 Parallels IP Holdings GmbH
+ * Copyright (c) 2017-2019 Virtuozzo International GmbH. All rights reserved.
+ *
+ * This file is part of OpenVZ. OpenVZ is free software; you can redistribute
+ * it and/or modify it under the terms of the GNU General Public License as
+ * published by the Free Software Foundation; either version 2 of the License,
+ * or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA
+ * 02110-1301, USA.
+ *
+ * Our contact details: Virtuozzo International GmbH, Vordergasse 59, 8200
+ * Schaffhausen, Switzerland.
+ */
+
+#ifndef __CORE_ELF_H__
+#define __CORE_ELF_H__
+
+#include <cstring>
+#include <stdint.h>
+#include <libelf.h>
+#include <gelf.h>
+
+namespace CoRipper
+{
+
+////////////////////////////////////////////////////////////////////////////////////////////////////
+// struct RDebugLayout, LinkmapLayout
+
+// Dynamic linker structures in the memory of a process with the given address size
+template <class Addr>
+struct RDebugLayout
+{
+	int32_t r_version;
+	Addr r_map;
+	Addr r_brk;
+	int32_t r_state;
+	Addr r_ldbase;
+};
+
+template <class Addr>
+struct LinkmapLayout
+{
+	Addr l_addr;
+	Addr l_name;
+	Addr l_ld;
+	Addr l_next;
+	Addr l_prev;
+};
+
+////////////////////////////////////////////////////////////////////////////////////////////////////
+// struct Elf32Traits, Elf64Traits
+
+// Native structures of an ELF class. Data returned by libelf is already in host byte
+// order, so it can be scanned directly instead of converting every entry with gelf.
+// Process data follows i386 and x86_64 layouts, the ones the kernel dumps for them.
+struct Elf32Traits
+{
+	typedef Elf32_Ehdr Ehdr;
+	typedef Elf32_Phdr Phdr;
+	typedef Elf32_Shdr Shdr;
+	typedef Elf32_Dyn Dyn;
+	typedef Elf32_auxv_t Auxv;
+	typedef Elf32_Addr Addr;
+	typedef RDebugLayout<Elf32_Addr> RDebug;
+	typedef LinkmapLayout<Elf32_Addr> Linkmap;
+
+	// compat NT_PRSTATUS: its size, offset of pr_reg and ESP and EIP in it
+	enum {
+		PRSTATUS_SIZE = 144,
+		PRSTATUS_REGS = 72,
+		REG_SP = 15,
+		REG_IP = 12
+	};
+
+	static Phdr* getPhdrs(Elf* e_)
+	{
+		return elf32_getphdr(e_);
+	}
+	static Elf_Data* xlatetof(Elf_Data* dst_, const Elf_Data* src_, unsigned encoding_)
+	{
+		return elf32_xlatetof(dst_, src_, encoding_);
+	}
+};
+
+struct Elf64Traits
+{
+	typedef Elf64_Ehdr Ehdr;
+	typedef Elf64_Phdr Phdr;
+	typedef Elf64_Shdr Shdr;
+	typedef Elf64_Dyn Dyn;
+	typedef Elf64_auxv_t Auxv;
+	typedef Elf64_Addr Addr;
+	typedef RDebugLayout<Elf64_Addr> RDebug;
+	typedef LinkmapLayout<Elf64_Addr> Linkmap;
+
+	// NT_PRSTATUS: its size, offset of pr_reg and RSP and RIP in it
+	enum {
+		PRSTATUS_SIZE = 336,
+		PRSTATUS_REGS = 112,
+		REG_SP = 19,
+		REG_IP = 16
+	};
+
+	static Phdr* getPhdrs(Elf* e_)
+	{
+		return elf64_getphdr(e_);
+	}
+	static Elf_Data* xlatetof(Elf_Data* dst_, const Elf_Data* src_, unsigned encoding_)
+	{
+		return elf64_xlatetof(dst_, src_, encoding_);
+	}
+};
+
+////////////////////////////////////////////////////////////////////////////////////////////////////
+// Conversion between class-agnostic and native headers
+
+template <class Src, class Dst>
+void copyEhdr(const Src& src_, Dst& dst_)
+{
+	memcpy(dst_.e_ident, src_.e_ident, EI_NIDENT);
+	dst_.e_type = src_.e_type;
+	dst_.e_machine = src_.e_machine;
+	dst_.e_version = src_.e_version;
+	dst_.e_entry = src_.e_entry;
+	dst_.e_phoff = src_.e_phoff;
+	dst_.e_shoff = src_.e_shoff;
+	dst_.e_flags = src_.e_flags;
+	dst_.e_ehsize = src_.e_ehsize;
+	dst_.e_phentsize = src_.e_phentsize;
+	dst_.e_phnum = src_.e_phnum;
+	dst_.e_shentsize = src_.e_shentsize;
+	dst_.e_shnum = src_.e_shnum;
+	dst_.e_shstrndx = src_.e_shstrndx;
+}
+
+template <class Src, class Dst>
+void copyPhdr(const Src& src_, Dst& dst_)
+{
+	dst_.p_type = src_.p_type;
+	dst_.p_offset = src_.p_offset;
+	dst_.p_vaddr = src_.p_vaddr;
+	dst_.p_paddr = src_.p_paddr;
+	dst_.p_filesz = src_.p_filesz;
+	dst_.p_memsz = src_.p_memsz;
+	dst_.p_flags = src_.p_flags;
+	dst_.p_align = src_.p_align;
+}
+
+template <class Src, class Dst>
+void copyShdr(const Src& src_, Dst& dst_)
+{
+	dst_.sh_name = src_.sh_name;
+	dst_.sh_type = src_.sh_type;
+	dst_.sh_flags = src_.sh_flags;
+	dst_.sh_addr = src_.sh_addr;
+	dst_.sh_offset = src_.sh_offset;
+	dst_.sh_size = src_.sh_size;
+	dst_.sh_link = src_.sh_link;
+	dst_.sh_info = src_.sh_info;
+	dst_.sh_addralign = src_.sh_addralign;
+	dst_.sh_entsize = src_.sh_entsize;
+}
+
+// Convert array of native headers to the byte order of the file
+template <class Traits>
+bool toFile(void* dst_, const void* src_, size_t size_, Elf_Type type_, unsigned encoding_)
+{
+	Elf_Data s, d;
+
+	memset(&s, 0, sizeof(s));
+	s.d_buf = const_cast<void*>(src_);
+	s.d_type = type_;
+	s.d_version = EV_CURRENT;
+	s.d_size = size_;
+	d = s;
+	d.d_buf = dst_;
+	return Traits::xlatetof(&d, &s, encoding_) != NULL;
+}
+
+} //namespace CoRipper
+
+#endif //__CORE_ELF_H__
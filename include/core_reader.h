@@ -25,17 +25,102 @@
 #define __CORE_READER_H__
 
 #include <vector>
-#include <libelf.h>
-#include <gelf.h>
-#include <link.h>
-#include <sys/procfs.h>
+#include <stdint.h>
+#include <sys/types.h>
+#include <core_elf.h>
+#include <core_compress.h>
 #include <boost/shared_ptr.hpp>
 
 namespace CoRipper
 {
 
-typedef struct r_debug rdebug_t;
-typedef struct link_map linkmap_t;
+////////////////////////////////////////////////////////////////////////////////////////////////////
+// struct RDebugData, LinkmapData
+
+// r_debug and link_map of the dumped process: the data as it is in the core, in the
+// layout of the core class, and the fields which are followed
+struct RDebugData
+{
+	std::vector<char> data;
+	GElf_Addr map;
+};
+
+struct LinkmapData
+{
+	std::vector<char> data;
+	GElf_Addr addr;
+	GElf_Addr name;
+	GElf_Addr next;
+};
+
+////////////////////////////////////////////////////////////////////////////////////////////////////
+// struct NoteEntry
+
+// Location of a single note inside NOTE segment data
+struct NoteEntry
+{
+	NoteEntry(): type(0), pos(0), size(0), descPos(0), descSize(0)
+	{
+	}
+
+	bool empty() const
+	{
+		return descSize == 0;
+	}
+
+	GElf_Word type;
+	// whole note with header and padding
+	size_t pos;
+	size_t size;
+	size_t descPos;
+	size_t descSize;
+};
+
+////////////////////////////////////////////////////////////////////////////////////////////////////
+// struct NoteIndex
+
+// Notes grouped by thread, built in one pass through NOTE segment data
+struct NoteIndex
+{
+	struct Thread
+	{
+		NoteEntry prstatus;
+		// FP/XSTATE and other register sets following thread's prstatus
+		std::vector<NoteEntry> regsets;
+	};
+
+	std::vector<Thread> threads;
+	NoteEntry prpsinfo;
+	NoteEntry auxv;
+	NoteEntry file;
+	NoteEntry siginfo;
+	// unknown notes found before the first thread
+	std::vector<NoteEntry> other;
+};
+
+////////////////////////////////////////////////////////////////////////////////////////////////////
+// struct ReadStats
+
+// Counters of the core data accesses made through Reader
+struct ReadStats
+{
+	ReadStats(): readCalls(0), readBytes(0), chunkCalls(0), chunkBytes(0), prefetchCalls(0),
+		prefetchBytes(0), phdrLookups(0)
+	{
+	}
+
+	// copies with readCoreData()
+	uint64_t readCalls;
+	uint64_t readBytes;
+	// views with elf_getdata_rawchunk()
+	uint64_t chunkCalls;
+	uint64_t chunkBytes;
+	// reads into page cache issued by prefetchData()
+	uint64_t prefetchCalls;
+	uint64_t prefetchBytes;
+	// program header searches by type or address
+	uint64_t phdrLookups;
+};
 
 ////////////////////////////////////////////////////////////////////////////////////////////////////
 // struct Reader
@@ -51,11 +136,14 @@ struct Reader
 	GElf_Phdr* findNotePhdr(GElf_Phdr& dst_);
 	Elf_Data* getNoteData(const GElf_Phdr& phdr_);
 
-	Elf_Data* getAuxvData(const GElf_Phdr& phdr_, Elf_Data* noteData_);
+	bool indexNotes(Elf_Data* noteData_, NoteIndex& dst_);
+
+	Elf_Data* getAuxvData(const GElf_Phdr& phdr_, const NoteEntry& auxv_);
 	GElf_auxv_t* findAuxvByType(Elf_Data *auxvData_, unsigned type_, GElf_auxv_t& dst_);
 
 	GElf_Phdr* findPhdrByVaddr(GElf_Addr vaddr_, GElf_Phdr& dst_);
 	off_t findOffsetByVaddr(GElf_Addr vaddr_);
+	bool isCodeAddress(GElf_Addr vaddr_);
 
 	Elf_Data* getDynData(GElf_Phdr& phdr_);
 	GElf_Dyn* findDynByTag(Elf_Data* data_, GElf_Sxword tag_, GElf_Dyn& dst_);
@@ -63,26 +151,112 @@ struct Reader
 	Elf_Data* getExecPhdrData(Elf_Data* auxvData_);
 	GElf_Phdr* findExecPhdrByType(Elf_Data *phdrData_, unsigned type_, GElf_Phdr& dst_);
 
+	// mapped_ false reads with pread, so a scan of much data doesn't leave it in RSS
+	bool readMemory(GElf_Addr vaddr_, void* buff_, size_t size_, bool mapped_ = true);
 	bool getString(GElf_Addr vaddr_, std::vector<char>& buf_);
-	rdebug_t* getRDebug(GElf_Dyn& dyn_, rdebug_t& rdebug_);
-	linkmap_t* getLinkmap(GElf_Addr vaddr_, linkmap_t& lmap_);
+	RDebugData* getRDebug(GElf_Dyn& dyn_, RDebugData& rdebug_);
+	LinkmapData* getLinkmap(GElf_Addr vaddr_, LinkmapData& lmap_);
+
+	// stack and instruction pointers of the thread
+	bool getRegisters(Elf_Data* notes_, const NoteEntry& prstatus_, GElf_Addr& sp_, GElf_Addr& ip_);
+	bool getStackRange(Elf_Data* notes_, const NoteEntry& prstatus_, GElf_Addr& vaddr_,
+			off_t& offset_, size_t& size_, size_t limit_ = 0, size_t maxSize_ = 0);
+	// offset and size of the window_ bytes above stack pointer read by getCodeAddresses()
+	std::pair<off_t, size_t> getCodeWindow(Elf_Data* notes_, const NoteEntry& prstatus_,
+			size_t window_);
+	bool getCodeAddresses(Elf_Data* notes_, const NoteEntry& prstatus_, size_t window_,
+			std::vector<GElf_Addr>& addrs_);
+	uint64_t getStackFingerprint(Elf_Data* notes_, const NoteEntry& prstatus_, size_t window_);
 
-	size_t getNextPrStatus(Elf_Data* notes_, size_t pos_, prstatus_t& prs_);
-	Elf_Data* getStackData(const prstatus_t& prs_, GElf_Addr& vaddr_);
+	// offset and size of data in the core file
+	typedef std::pair<off_t, size_t> range_t;
 
-	static ptr_t openCoreFile(const char* fname_);
+	// make sure the data at given core offset is in place before it is read
+	// directly from the file, only needed in live mode
+	bool fetchData(off_t offset_, size_t size_);
+
+	// Bring independent ranges, which are read one by one right after, into page cache
+	// with PREFETCH_DEPTH reads in flight, so on a slow device they don't wait for a
+	// round trip each. Ranges already cached are skipped, failures are left to the reads.
+	void prefetchData(std::vector<range_t> ranges_);
+	void prefetchStrings(const std::vector<GElf_Addr>& vaddrs_);
+
+	int getFd() const
+	{
+		return m_fd;
+	}
+	const ReadStats& getStats() const
+	{
+		return m_stats;
+	}
+	// bytes of streamed segments left out of the scratch file by its limit
+	size_t getSkipped() const
+	{
+		return m_skipped;
+	}
+	size_t getScratchLimit() const
+	{
+		return m_scratchLimit;
+	}
+	// ELFCLASS32 or ELFCLASS64, native structures of the class are used for lookups
+	int getClass() const
+	{
+		return m_class;
+	}
+
+	static ptr_t openCoreFile(const char* fname_, size_t scratchLimit_);
+	static ptr_t openCoreDescriptor(int fd_, size_t scratchLimit_);
+	static ptr_t openCoreBuffer(const char* buff_, size_t size_, size_t scratchLimit_);
+	// with pid_ given only NOTE is taken from the stream, loadable segments data is
+	// read from the memory of the process held by the kernel while it is dumped
+	static ptr_t openCoreStream(int fd_, size_t scratchLimit_, pid_t pid_ = 0);
+	static ptr_t openProcess(const std::vector<char>& head_, off_t size_, pid_t pid_);
 
 private:
-	Reader(int fd_, Elf* e_)
-	: m_fd(fd_), m_core(e_)
+	Reader(int fd_, Elf* e_, char* image_ = NULL, size_t size_ = 0)
+	: m_fd(fd_), m_core(e_), m_class(gelf_getclass(e_)), m_image(image_), m_size(size_), m_pid(0),
+	m_source(-1), m_refetchPos(0), m_skipped(0), m_scratchLimit(0), m_released(NULL)
 	{
 	}
 
-	ssize_t readCoreData(void* buff_, size_t size_, off_t offset_);
-	GElf_Addr getStack(const prstatus_t& prs_);
+	static ptr_t openCoreFd(int fd_);
+	static ptr_t openCoreSource(const Source::ptr_t& source_, size_t scratchLimit_, pid_t pid_,
+			int refetch_ = -1);
+	void setLive(pid_t pid_);
+	void setRefetch(int source_, const std::vector<range_t>& holes_);
+	void initFetched(bool fetched_);
+
+	bool indexLoads();
+
+	ssize_t readCoreData(void* buff_, size_t size_, off_t offset_, bool mapped_ = true);
+	Elf_Data* getRawChunk(off_t offset_, size_t size_, Elf_Type type_);
+	bool fetchPages(const GElf_Phdr& phdr_, off_t begin_, off_t end_);
+	bool refetchData(off_t offset_, size_t size_);
+	void releaseNotes(Elf_Data* notes_, size_t pos_);
 
 	int m_fd;
 	Elf* m_core;
+	int m_class;
+	// whole core file mapping, all data chunks are views into it
+	char* m_image;
+	size_t m_size;
+	// all PT_LOAD program headers sorted by virtual address
+	std::vector<GElf_Phdr> m_loads;
+	// live mode: process to read memory from, PT_LOAD headers sorted by offset
+	// and pages of the core which are already fetched into the scratch file
+	pid_t m_pid;
+	std::vector<GElf_Phdr> m_loadsByOffset;
+	std::vector<bool> m_fetched;
+	ReadStats m_stats;
+	// compressed core file to fetch skipped segments from instead of the process,
+	// its decompression going on at m_refetchPos
+	int m_source;
+	Source::ptr_t m_refetch;
+	off_t m_refetchPos;
+	size_t m_skipped;
+	size_t m_scratchLimit;
+	// notes mapping below this address is already given back by releaseNotes()
+	char* m_released;
 };
 
 } //namespace CoRipper
@@ -25,10 +25,26 @@
 #define __CORE_SEGMENTS_H__
 
 #include <list>
+#include <string>
+#include <cstring>
 #include <core_reader.h>
 
+// Notes produced by coripper, named "CORIPPER"
+#define NT_CORIPPER_COLLAPSED	1	// array of collapsed_t
+
 namespace CoRipper
 {
+// Class of threads with identical top of stack
+struct collapsed_t
+{
+	uint64_t fingerprint;
+	uint32_t threads;
+	uint32_t collapsed;
+};
+
+// Check if given block of data is all zeros
+bool isZeroBlock(const char* data_, size_t size_);
+
 ////////////////////////////////////////////////////////////////////////////////////////////////////
 // struct Header
 
@@ -36,28 +52,45 @@ struct Header
 {
 	typedef boost::shared_ptr<Header> ptr_t;
 
-	Header(const GElf_Ehdr h_ = GElf_Ehdr()): m_header(h_)
+	Header(const GElf_Ehdr h_ = GElf_Ehdr(), size_t phnum_ = 0)
+	: m_header(h_), m_phnum(phnum_)
 	{
 	}
 
-	const char* getData() const
+	const GElf_Ehdr& getEhdr() const
 	{
-		return reinterpret_cast<const char*>(&m_header);
+		return m_header;
 	}
-	size_t getSize() const
+	// ELF class and byte order of the output, the same as of the source core
+	int getClass() const
 	{
-		return sizeof(m_header);
+		return m_header.e_ident[EI_CLASS];
 	}
-	size_t getHeaderSize() const
+	unsigned getEncoding() const
 	{
-		return m_header.e_phentsize;
+		return m_header.e_ident[EI_DATA];
 	}
 	size_t getOffset() const
 	{
-		return sizeof(m_header) + m_header.e_phnum * m_header.e_phentsize;
+		return m_header.e_ehsize + m_phnum * m_header.e_phentsize;
+	}
+	// Section header 0 keeping the number of program headers when it doesn't fit
+	// e_phnum (extended numbering). It is written after all segments data.
+	bool getSectionHeader(GElf_Shdr& dst_) const
+	{
+		if (m_header.e_phnum != PN_XNUM)
+			return false;
+
+		memset(&dst_, 0, sizeof(dst_));
+		dst_.sh_type = SHT_NULL;
+		dst_.sh_size = m_header.e_shnum;
+		dst_.sh_link = m_header.e_shstrndx;
+		dst_.sh_info = m_phnum;
+		return true;
 	}
 private:
 	GElf_Ehdr m_header;
+	size_t m_phnum;
 };
 
 ////////////////////////////////////////////////////////////////////////////////////////////////////
@@ -84,8 +117,17 @@ struct Segment
 		return phdr;
 	}
 
+	// Segment data in memory, NULL if data is read from the source core when written
 	virtual const char* getBuffer() const = 0;
 	virtual size_t getSize() const = 0;
+	// short name of the segment class for statistics
+	virtual const char* getKind() const = 0;
+
+	// Offset of segment data in the source core file, -1 if data exists in memory only
+	virtual off_t getSourceOffset() const
+	{
+		return -1;
+	}
 }; //struct Segment
 
 ////////////////////////////////////////////////////////////////////////////////////////////////////
@@ -95,8 +137,10 @@ struct Stack: Segment
 {
 	typedef boost::shared_ptr<Stack> ptr_t;
 
-	Stack(GElf_Addr vaddr, Elf_Data* stackData)
-	: m_vaddr(vaddr),  m_stackData(stackData)
+	// zeros bytes following the data in memory are not stored in the core,
+	// pieces of other segments split by --sparse keep their kind
+	Stack(GElf_Addr vaddr, off_t offset, size_t size, size_t zeros = 0, const char* kind = "stack")
+	: m_vaddr(vaddr), m_offset(offset), m_size(size), m_zeros(zeros), m_kind(kind)
 	{
 	}
 
@@ -106,20 +150,33 @@ struct Stack: Segment
 		phdr.p_vaddr = m_vaddr;
 		phdr.p_filesz = getSize();
 		phdr.p_offset = offset;
+		if (m_zeros > 0)
+			phdr.p_memsz = m_size + m_zeros;
 		return phdr;
 	}
 	virtual const char* getBuffer() const
 	{
-		return reinterpret_cast<const char*>(m_stackData->d_buf);
+		return NULL;
 	}
 	virtual size_t getSize() const
 	{
-		return m_stackData->d_size;
+		return m_size;
+	}
+	virtual const char* getKind() const
+	{
+		return m_kind;
+	}
+	virtual off_t getSourceOffset() const
+	{
+		return m_offset;
 	}
 
 private:
 	GElf_Addr m_vaddr;
-	Elf_Data* m_stackData;
+	off_t m_offset;
+	size_t m_size;
+	size_t m_zeros;
+	const char* m_kind;
 }; //struct Stack
 
 ////////////////////////////////////////////////////////////////////////////////////////////////////
@@ -152,12 +209,68 @@ struct String: Segment
 	{
 		return m_buf.size();
 	}
+	virtual const char* getKind() const
+	{
+		return "string";
+	}
 
 private:
 	GElf_Addr m_vaddr;
 	std::vector<char> m_buf;
 }; //struct String
 
+////////////////////////////////////////////////////////////////////////////////////////////////////
+// struct Chunk
+
+// Memory range assembled from several small segments and the core data between them
+struct Chunk: Segment
+{
+	typedef boost::shared_ptr<Chunk> ptr_t;
+
+	Chunk(GElf_Addr vaddr, size_t size)
+	: m_vaddr(vaddr), m_buf(size)
+	{
+	}
+
+	virtual Segment::Header getHeader(GElf_Off offset) const
+	{
+		GElf_Phdr phdr = Segment::getHeader();
+		phdr.p_vaddr = m_vaddr;
+		phdr.p_filesz = getSize();
+		phdr.p_offset = offset;
+		return phdr;
+	}
+
+	virtual const char* getBuffer() const
+	{
+		return &m_buf[0];
+	}
+
+	virtual size_t getSize() const
+	{
+		return m_buf.size();
+	}
+	virtual const char* getKind() const
+	{
+		return "chunk";
+	}
+
+	// copy segment data to its place inside the chunk
+	void put(GElf_Addr vaddr, const char* data, size_t size)
+	{
+		memcpy(&m_buf[vaddr - m_vaddr], data, size);
+	}
+
+	char* getData()
+	{
+		return &m_buf[0];
+	}
+
+private:
+	GElf_Addr m_vaddr;
+	std::vector<char> m_buf;
+}; //struct Chunk
+
 ////////////////////////////////////////////////////////////////////////////////////////////////////
 // struct Linkmap
 
@@ -166,7 +279,7 @@ struct Linkmap: Segment
 	typedef boost::shared_ptr<Linkmap> ptr_t;
 	typedef std::pair<CoRipper::Segment::list_t, CoRipper::Segment::list_t> listPair_t;
 
-	Linkmap(GElf_Addr vaddr, const linkmap_t& lmap)
+	Linkmap(GElf_Addr vaddr, const LinkmapData& lmap)
 	: m_vaddr(vaddr), m_lmap(lmap)
 	{
 	}
@@ -181,24 +294,28 @@ struct Linkmap: Segment
 	}
 	virtual const char* getBuffer() const
 	{
-		return reinterpret_cast<const char*>(&m_lmap);
+		return &m_lmap.data[0];
 	}
 	virtual size_t getSize() const
 	{
-		return sizeof(m_lmap);
+		return m_lmap.data.size();
+	}
+	virtual const char* getKind() const
+	{
+		return "linkmap";
 	}
 	GElf_Addr getNext() const
 	{
-		return reinterpret_cast<GElf_Addr>(m_lmap.l_next);
+		return m_lmap.next;
 	}
 	GElf_Addr getName() const
 	{
-		return reinterpret_cast<GElf_Addr>(m_lmap.l_name);
+		return m_lmap.name;
 	}
 
 private:
 	GElf_Addr m_vaddr;
-	linkmap_t m_lmap;
+	LinkmapData m_lmap;
 }; //struct Linkmap
 
 ////////////////////////////////////////////////////////////////////////////////////////////////////
@@ -208,7 +325,7 @@ struct RDebug: Segment
 {
 	typedef boost::shared_ptr<RDebug> ptr_t;
 
-	RDebug(const GElf_Dyn& debugDyn, const rdebug_t& rdebug)
+	RDebug(const GElf_Dyn& debugDyn, const RDebugData& rdebug)
 	: m_debugDyn(debugDyn), m_rdebug(rdebug)
 	{
 	}
@@ -223,20 +340,24 @@ struct RDebug: Segment
 	}
 	virtual const char* getBuffer() const
 	{
-		return reinterpret_cast<const char*>(&m_rdebug);
+		return &m_rdebug.data[0];
 	}
 	virtual size_t getSize() const
 	{
-		return sizeof(m_rdebug);
+		return m_rdebug.data.size();
 	}
-	const rdebug_t& getData() const
+	virtual const char* getKind() const
+	{
+		return "rdebug";
+	}
+	const RDebugData& getData() const
 	{
 		return m_rdebug;
 	}
 
 private:
 	GElf_Dyn m_debugDyn;
-	rdebug_t m_rdebug;
+	RDebugData m_rdebug;
 }; //struct RDebug
 
 ////////////////////////////////////////////////////////////////////////////////////////////////////
@@ -246,8 +367,8 @@ struct Dynamic: Segment
 {
 	typedef boost::shared_ptr<Dynamic> ptr_t;
 
-	Dynamic(const GElf_Phdr& dynPhdr, Elf_Data* dynData)
-	: m_dynPhdr(dynPhdr), m_dynData(dynData)
+	Dynamic(const GElf_Phdr& dynPhdr, Elf_Data* dynData, off_t offset)
+	: m_dynPhdr(dynPhdr), m_dynData(dynData), m_offset(offset)
 	{
 	}
 
@@ -267,6 +388,14 @@ struct Dynamic: Segment
 	{
 		return m_dynData->d_size;
 	}
+	virtual const char* getKind() const
+	{
+		return "dynamic";
+	}
+	virtual off_t getSourceOffset() const
+	{
+		return m_offset;
+	}
 	Elf_Data* getData()
 	{
 		return m_dynData;
@@ -275,6 +404,7 @@ struct Dynamic: Segment
 private:
 	GElf_Phdr m_dynPhdr;
 	Elf_Data* m_dynData;
+	off_t m_offset;
 }; //struct Dynamic
 
 ////////////////////////////////////////////////////////////////////////////////////////////////////
@@ -293,30 +423,117 @@ struct Note: Segment
 	{
 		GElf_Phdr phdr = m_notePhdr;
 		phdr.p_offset = offset;
+		phdr.p_filesz = getSize();
 		return phdr;
 	}
 	virtual const char* getBuffer() const
 	{
+		if (!m_buf.empty())
+			return &m_buf[0];
 		return reinterpret_cast<const char*>(m_noteData->d_buf);
 	}
 	virtual size_t getSize() const
 	{
-		return m_noteData->d_size;
+		return m_buf.empty() ? m_noteData->d_size : m_buf.size();
+	}
+	virtual const char* getKind() const
+	{
+		return "note";
+	}
+	virtual off_t getSourceOffset() const
+	{
+		return m_buf.empty() ? off_t(m_notePhdr.p_offset) : -1;
 	}
 	GElf_Phdr& getHeader()
 	{
 		return m_notePhdr;
 	}
+	// Source NOTE data, notes are located in it even after rewrite
 	Elf_Data* getData()
 	{
 		return m_noteData;
 	}
+	// Replace output data with given notes only, in source order
+	void rewrite(std::vector<NoteEntry> keep_);
 
 private:
 	GElf_Phdr m_notePhdr;
 	Elf_Data* m_noteData;
+	std::vector<char> m_buf;
 }; //struct Note
 
+////////////////////////////////////////////////////////////////////////////////////////////////////
+// struct Policy
+
+// What to keep from the source core. Zero values mean no limit.
+struct Policy
+{
+	// which threads keep register set notes other than NT_PRSTATUS (FP, XSTATE, ...)
+	enum regsets_t
+	{
+		REGSETS_ALL,
+		REGSETS_CRASHING,
+		REGSETS_NONE
+	};
+
+	Policy(): stackLimit(0), outputBudget(0), collapseKeep(0), collapseWindow(4096),
+		regsets(REGSETS_ALL), keepFileNote(true), sparse(false)
+	{
+	}
+
+	// innermost stack bytes kept for every thread except the crashing one
+	size_t stackLimit;
+	// total size of the stripped core, stacks are dropped to fit into it
+	size_t outputBudget;
+	// number of threads with identical top of stack which keep stack limit, the rest
+	// keep only collapseWindow bytes; 0 disables collapsing
+	size_t collapseKeep;
+	size_t collapseWindow;
+	regsets_t regsets;
+	// NT_FILE table of mapped files
+	bool keepFileNote;
+	// zero pages of segments are not stored: regular output files get holes in their
+	// place, other outputs get segments split into data and zero tail
+	bool sparse;
+};
+
+////////////////////////////////////////////////////////////////////////////////////////////////////
+// struct ExtraNote
+
+// NOTE segment with notes produced by coripper itself
+struct ExtraNote: Segment
+{
+	typedef boost::shared_ptr<ExtraNote> ptr_t;
+
+	ExtraNote(GElf_Word type, const std::vector<char>& desc);
+
+	virtual Segment::Header getHeader(GElf_Off offset) const
+	{
+		GElf_Phdr phdr = Segment::getHeader();
+		phdr.p_type = PT_NOTE;
+		phdr.p_flags = 0;
+		phdr.p_align = 4;
+		phdr.p_filesz = getSize();
+		phdr.p_offset = offset;
+		return phdr;
+	}
+	virtual const char* getBuffer() const
+	{
+		return &m_buf[0];
+	}
+	virtual size_t getSize() const
+	{
+		return m_buf.size();
+	}
+	virtual const char* getKind() const
+	{
+		return "extra-note";
+	}
+
+private:
+	std::vector<char> m_buf;
+}; //struct ExtraNote
+
 ////////////////////////////////////////////////////////////////////////////////////////////////////
 // struct Builder
 
@@ -324,7 +541,7 @@ struct Builder
 {
 	typedef std::pair<Header, Segment::list_t> data_t;
 
-	Builder(Reader& r_): m_reader(&r_)
+	Builder(Reader& r_, const Policy& p_ = Policy()): m_reader(&r_), m_policy(p_)
 	{
 	}
 
@@ -338,17 +555,46 @@ struct Builder
 	bool readRDebug();
 	bool readStacks();
 	bool readLinkmaps();
+	// crash signature: code addresses on top of crashing thread's stack taken
+	// relative to the modules from the linkmap list
+	bool getSignature(uint64_t& signature_);
+
+	// Split segments copied from the source core at zero pages, each piece keeps
+	// its data and the zero pages following it only in p_memsz
+	static bool elideZeroPages(Reader& r_, data_t& data_);
 
 private:
+	struct Module
+	{
+		GElf_Addr base;
+		std::string name;
+
+		bool operator<(const Module& other_) const
+		{
+			return base < other_.base;
+		}
+	};
+
+	static void makeHeader(GElf_Ehdr h_, data_t& dst_);
+	size_t findCrashingThread();
+	void filterNotes();
+	size_t getFreeBudget() const;
+	void collapseStacks(const std::vector<size_t>& order_, std::vector<size_t>& limits_);
+	void coalesce();
+	void coalesceViews(Segment::list_t& views_);
+	void coalesceChunks(Segment::list_t& chunks_);
+
 	Reader* m_reader;
+	Policy m_policy;
 	Segment::list_t m_segments;
 	Note::ptr_t m_note;
+	NoteIndex m_noteIndex;
 	Dynamic::ptr_t m_dynamic;
 	RDebug::ptr_t m_rdebug;
+	// sorted by load base
+	std::vector<Module> m_modules;
 };
 
-std::ostream& operator<<(std::ostream& o_, const Builder::data_t& d_);
-
 } //namespace CoRipper
 
 #endif //__CORE_SEGMENTS_H__
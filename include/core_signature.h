@@ -0,0 +1,58 @@
+/*
+ * Copyright (c) 2015-2017 Parallels IP Holdings GmbH
+ * Copyright (c) 2017-2019 Virtuozzo International GmbH. All rights reserved.
+ *
+ * This file is part of OpenVZ. OpenVZ is free software; you can redistribute
+ * it and/or modify it under the terms of the GNU General Public License as
+ * published by the Free Software Foundation; either version 2 of the License,
+ * or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA
+ * 02110-1301, USA.
+ *
+ * Our contact details: Virtuozzo International GmbH, Vordergasse 59, 8200
+ * Schaffhausen, Switzerland.
+ */
+
+#ifndef __CORE_SIGNATURE_H__
+#define __CORE_SIGNATURE_H__
+
+#include <string>
+#include <ctime>
+#include <stdint.h>
+
+namespace CoRipper
+{
+
+////////////////////////////////////////////////////////////////////////////////////////////////////
+// struct SignatureCache
+
+// Counts cores per crash signature in a directory shared by all coripper
+// processes, one locked file per signature. Only the first keep_ cores of a
+// signature within ttl_ seconds from its first one are stripped.
+struct SignatureCache
+{
+	SignatureCache(const std::string& dir_, unsigned keep_, time_t ttl_)
+	: m_dir(dir_), m_keep(keep_), m_ttl(ttl_)
+	{
+	}
+
+	// count core with the signature, returns false when it is a duplicate
+	bool admit(uint64_t signature_, unsigned& count_) const;
+
+private:
+	std::string m_dir;
+	unsigned m_keep;
+	time_t m_ttl;
+};
+
+} //namespace CoRipper
+
+#endif //__CORE_SIGNATURE_H__
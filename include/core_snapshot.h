@@ -0,0 +1,82 @@
+/*
+ * Copyright (c) 2015-2017 Parallels IP Holdings GmbH
+ * Copyright (c) 2017-2019 Virtuozzo International GmbH. All rights reserved.
+ *
+ * This file is part of OpenVZ. OpenVZ is free software; you can redistribute
+ * it and/or modify it under the terms of the GNU General Public License as
+ * published by the Free Software Foundation; either version 2 of the License,
+ * or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA
+ * 02110-1301, USA.
+ *
+ * Our contact details: Virtuozzo International GmbH, Vordergasse 59, 8200
+ * Schaffhausen, Switzerland.
+ */
+
+#ifndef __CORE_SNAPSHOT_H__
+#define __CORE_SNAPSHOT_H__
+
+#include <vector>
+#include <ctime>
+#include <sys/types.h>
+
+namespace CoRipper
+{
+
+////////////////////////////////////////////////////////////////////////////////////////////////////
+// struct Snapshot
+
+// Stops all threads of a running process with PTRACE_SEIZE/PTRACE_INTERRUPT and
+// makes up the head of its core: ELF and program headers for readable mappings
+// and notes with registers of every thread and auxv. Memory is not copied here.
+struct Snapshot
+{
+	explicit Snapshot(pid_t pid_): m_pid(pid_), m_stopped(false), m_pause(0)
+	{
+	}
+
+	~Snapshot()
+	{
+		resume();
+	}
+
+	bool stop();
+	void resume();
+	// head_ is put at the beginning of core of size_ bytes
+	bool makeCore(std::vector<char>& head_, off_t& size_);
+
+	// milliseconds the process was stopped for
+	double getPause() const
+	{
+		return m_pause;
+	}
+
+private:
+	struct Thread
+	{
+		pid_t tid;
+		// signal caught while stopping, delivered on detach
+		int signal;
+	};
+
+	bool attach(pid_t tid_);
+	bool wait(Thread& thread_);
+
+	pid_t m_pid;
+	bool m_stopped;
+	struct timespec m_start;
+	double m_pause;
+	std::vector<Thread> m_threads;
+};
+
+} //namespace CoRipper
+
+#endif //__CORE_SNAPSHOT_H__
@@ -0,0 +1,87 @@
+/*
+ * Copyright (c) 2015-2017 Parallels IP Holdings GmbH
+ * Copyright (c) 2017-2019 Virtuozzo International GmbH. All rights reserved.
+ *
+ * This file is part of OpenVZ. OpenVZ is free software; you can redistribute
+ * it and/or modify it under the terms of the GNU General Public License as
+ * published by the Free Software Foundation; either version 2 of the License,
+ * or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA
+ * 02110-1301, USA.
+ *
+ * Our contact details: Virtuozzo International GmbH, Vordergasse 59, 8200
+ * Schaffhausen, Switzerland.
+ */
+
+#ifndef __CORE_STATS_H__
+#define __CORE_STATS_H__
+
+#include <string>
+#include <vector>
+#include <map>
+#include <ostream>
+#include <stdint.h>
+#include <core_reader.h>
+#include <core_segments.h>
+
+namespace CoRipper
+{
+
+////////////////////////////////////////////////////////////////////////////////////////////////////
+// struct Stats
+
+// Statistics of stripping one core: wall and CPU time of every phase, data
+// accesses of the reader, emitted segments and resources used by the process
+struct Stats
+{
+	struct Phase
+	{
+		std::string name;
+		double wallMs;
+		double cpuMs;
+	};
+
+	Stats(): m_outputBytes(0), m_started(false)
+	{
+	}
+
+	// start timing of the named phase, the previous one ends
+	void enter(const char* name_);
+	void leave();
+
+	void setReadStats(const ReadStats& read_)
+	{
+		m_read = read_;
+	}
+	// segments of the resulting core and the number of bytes written out
+	void setOutput(const Builder::data_t& data_, uint64_t bytes_);
+
+	void writeJson(std::ostream& out_) const;
+	bool writeJson(const std::string& path_) const;
+	// add counters to node_exporter textfile shared by all coripper processes
+	bool updateTextfile(const std::string& path_) const;
+
+private:
+	void getClocks(double& wallMs_, double& cpuMs_) const;
+
+	std::vector<Phase> m_phases;
+	ReadStats m_read;
+	std::map<std::string, unsigned> m_segments;
+	uint64_t m_outputBytes;
+	// clocks when the current phase was entered
+	bool m_started;
+	double m_wallMs;
+	double m_cpuMs;
+};
+
+} //namespace CoRipper
+
+#endif //__CORE_STATS_H__
@@ -0,0 +1,109 @@
+/*
+ * Copyright (c) 2015-2017 Parallels IP Holdings GmbH
+ * Copyright (c) 2017-2019 Virtuozzo International GmbH. All rights reserved.
+ *
+ * This file is part of OpenVZ. OpenVZ is free software; you can redistribute
+ * it and/or modify it under the terms of the GNU General Public License as
+ * published by the Free Software Foundation; either version 2 of the License,
+ * or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA
+ * 02110-1301, USA.
+ *
+ * Our contact details: Virtuozzo International GmbH, Vordergasse 59, 8200
+ * Schaffhausen, Switzerland.
+ */
+
+#ifndef __CORE_WRITER_H__
+#define __CORE_WRITER_H__
+
+#include <core_segments.h>
+#include <core_compress.h>
+#include <boost/thread/mutex.hpp>
+
+namespace CoRipper
+{
+
+////////////////////////////////////////////////////////////////////////////////////////////////////
+// struct Writer
+
+// Writes stripped core to file descriptor. ELF header, program headers and small
+// segments go from memory, data of segments backed by the source core file is
+// copied by the kernel (copy_file_range for files, splice for pipes) or through
+// a fixed size buffer, so it never has to be kept in memory as a whole.
+// When writing to a regular file with several threads, the output layout is
+// computed up front and segments are put to their final offsets in parallel.
+// Compressed output always goes through memory. Sparse output to a regular file
+// gets holes in place of zero pages, so its layout stays the same.
+struct Writer
+{
+	Writer(int dst_, int src_, unsigned threads_ = 1,
+		const Compression& compression_ = Compression(), bool sparse_ = false);
+	// output which is not a descriptor, everything is written sequentially through it
+	Writer(const Sink::ptr_t& sink_, int src_);
+
+	bool write(const Builder::data_t& d_);
+
+	// zero pages are skipped with holes, otherwise they are written out
+	bool isSparse() const
+	{
+		return m_sparse;
+	}
+
+private:
+	enum mode_t {
+		MODE_BUFFER,
+		MODE_COPY_RANGE,
+		MODE_SPLICE
+	};
+
+	// piece of output put at a known offset by one of the threads
+	struct Job
+	{
+		const char* buff;
+		off_t source;
+		off_t offset;
+		size_t size;
+	};
+
+	template <class Traits>
+	bool doWrite(const Builder::data_t& d_);
+	template <class Traits>
+	bool writeHeaders(const Builder::data_t& d_);
+	template <class Traits>
+	bool writeSectionHeader(const Builder::data_t& d_);
+	bool writeParallel(const Builder::data_t& d_);
+	void runJobs();
+	bool putData(const Job& job_, std::vector<char>& chunk_);
+	bool writeData(const char* buff_, size_t size_);
+	bool writeSegmentData(const char* buff_, size_t size_);
+	bool copyData(off_t offset_, size_t size_);
+	bool flush();
+
+	int m_dst;
+	int m_src;
+	mode_t m_mode;
+	unsigned m_threads;
+	bool m_sparse;
+	Sink::ptr_t m_sink;
+	// parallel write queue, guarded by m_lock
+	boost::mutex m_lock;
+	std::vector<Job> m_jobs;
+	size_t m_next;
+	bool m_failed;
+	// small writes are collected here
+	std::vector<char> m_buff;
+	// bounce buffer for data which the kernel can't copy
+	std::vector<char> m_chunk;
+};
+
+} //namespace CoRipper
+
+#endif //__CORE_WRITER_H__
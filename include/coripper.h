@@ -24,7 +24,12 @@
 #ifndef __CORIPPER_H__
 #define __CORIPPER_H__
 
+#include <string>
 #include <core_segments.h>
+#include <core_compress.h>
+#include <core_signature.h>
+#include <core_stats.h>
+#include <core_writer.h>
 
 namespace CoRipper
 {
@@ -34,23 +39,81 @@ namespace CoRipper
 
 struct Core
 {
+	// step at which reading of the core failed
+	enum error_t {
+		ERROR_NONE,
+		ERROR_OPEN,
+		ERROR_NOTE,
+		ERROR_DYNAMIC,
+		ERROR_RDEBUG,
+		ERROR_LINKMAP,
+		ERROR_STACKS,
+		ERROR_HEADER
+	};
+
+	Core(const Policy& policy = Policy(), const SignatureCache* cache = NULL)
+	: m_policy(policy), m_cache(cache), m_signature(0), m_signatureCount(0), m_duplicate(false),
+		m_error(ERROR_NONE), m_stats(NULL)
+	{
+	}
+
 	~Core()
 	{
 	}
 
-	bool read(const char*);
+	bool read(const char*, size_t scratchLimit);
+	bool readStream(int fd, size_t scratchLimit, pid_t pid = 0);
+	bool readProcess(pid_t pid, double& pauseMs);
+	// descriptor stays owned by the caller
+	bool readDescriptor(int fd, size_t scratchLimit);
+	bool readBuffer(const char* buff, size_t size, size_t scratchLimit);
+	bool write(int fd, unsigned threads = 1,
+		const Compression& compression = Compression()) const;
+	bool write(const Sink::ptr_t& sink) const;
+	bool writeFile(const std::string& path, off_t& size, unsigned threads = 1,
+		const Compression& compression = Compression()) const;
 
-private:
-	friend std::ostream& operator<<(std::ostream& sout, const Core& c);
+	// the core was read, but there are enough cores with its signature already
+	bool isDuplicate() const
+	{
+		return m_duplicate;
+	}
+	uint64_t getSignature() const
+	{
+		return m_signature;
+	}
+	unsigned getSignatureCount() const
+	{
+		return m_signatureCount;
+	}
+	error_t getError() const
+	{
+		return m_error;
+	}
+	// collect timing and counters of the following read and write
+	void setStats(Stats* stats)
+	{
+		m_stats = stats;
+	}
 
+private:
+	bool build();
+	bool doBuild();
+	bool doWrite(Writer& writer) const;
 	void clear();
+	void enter(const char* phase) const;
 
+	Policy m_policy;
+	const SignatureCache* m_cache;
+	uint64_t m_signature;
+	unsigned m_signatureCount;
+	bool m_duplicate;
+	error_t m_error;
+	Stats* m_stats;
 	Builder::data_t m_data;
 	Reader::ptr_t m_reader;
 };
 
-std::ostream& operator<<(std::ostream& o_, const Core& c_);
-
 } //namespace CoRipper
 
 #endif //__CORIPPER_H__
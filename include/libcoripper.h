@@ -0,0 +1,120 @@
+/*
+ * Copyright (c) 2015-2017 Parallels IP Holdings GmbH
+ * Copyright (c) 2017-2019 Virtuozzo International GmbH. All rights reserved.
+ *
+ * This file is part of OpenVZ. OpenVZ is free software; you can redistribute
+ * it and/or modify it under the terms of the GNU General Public License as
+ * published by the Free Software Foundation; either version 2 of the License,
+ * or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA
+ * 02110-1301, USA.
+ *
+ * Our contact details: Virtuozzo International GmbH, Vordergasse 59, 8200
+ * Schaffhausen, Switzerland.
+ */
+
+#ifndef __LIBCORIPPER_H__
+#define __LIBCORIPPER_H__
+
+#include <stddef.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/*
+ * C interface of libcoripper. Every call strips one core, calls are independent
+ * and may be made from several threads at the same time. Errors are returned as
+ * negative codes, nothing is printed.
+ */
+
+#define CORIPPER_API_VERSION	1
+
+enum coripper_error {
+	CORIPPER_OK = 0,
+	CORIPPER_EINVAL = -1,		/* bad arguments or policy */
+	CORIPPER_EREAD = -2,		/* input is not a readable ELF core */
+	CORIPPER_ENOTE = -3,		/* no NOTE segment or thread notes */
+	CORIPPER_EDYNAMIC = -4,		/* no .dynamic of the executable */
+	CORIPPER_ERDEBUG = -5,		/* no r_debug structure */
+	CORIPPER_ELINKMAP = -6,		/* broken linkmap list */
+	CORIPPER_ESTACKS = -7,		/* thread stacks can't be read */
+	CORIPPER_EHEADER = -8,		/* no ELF header */
+	CORIPPER_EWRITE = -9,		/* output failed or was stopped by the callback */
+	CORIPPER_ENOMEM = -10,
+	CORIPPER_EINTERNAL = -11
+};
+
+enum coripper_regsets {
+	CORIPPER_REGSETS_ALL,
+	CORIPPER_REGSETS_CRASHING,
+	CORIPPER_REGSETS_NONE
+};
+
+enum coripper_compression {
+	CORIPPER_COMPRESS_NONE,
+	CORIPPER_COMPRESS_ZSTD,
+	CORIPPER_COMPRESS_LZ4
+};
+
+/* Fill with coripper_policy_init() first, new fields are only added at the end */
+struct coripper_policy {
+	size_t size;			/* sizeof(struct coripper_policy) */
+	size_t scratch_limit;		/* bytes of other segments kept from streamed input */
+	size_t stack_limit;		/* bytes of stack kept for threads but the crashing one, 0 for all */
+	size_t output_budget;		/* limit of the result size, 0 for none */
+	unsigned collapse_keep;		/* threads kept per group of identical stacks, 0 disables */
+	int regsets;			/* enum coripper_regsets */
+	int keep_file_note;		/* keep NT_FILE note */
+	int sparse;			/* leave zero pages out */
+	int compression;		/* enum coripper_compression */
+	int compression_level;		/* 0 for library default */
+	unsigned threads;		/* output writers */
+	unsigned compression_threads;	/* zstd workers, 0 compresses in the writing thread */
+};
+
+/* Core is read from the descriptor when fd >= 0, otherwise from the buffer */
+struct coripper_input {
+	int fd;
+	const void *buff;
+	size_t size;
+};
+
+/* Output function returns 0 to go on, anything else stops the output */
+typedef int (*coripper_write_fn)(void *ctx, const void *buff, size_t size);
+
+/* Result goes to the descriptor when fd >= 0, otherwise to the function */
+struct coripper_output {
+	int fd;
+	coripper_write_fn write;
+	void *ctx;
+};
+
+void coripper_policy_init(struct coripper_policy *policy);
+
+/* Strip the input core to the output, policy may be NULL for defaults. SIGPIPE is
+ * blocked during the call, writes to a closed pipe fail with CORIPPER_EWRITE. */
+int coripper_strip(const struct coripper_input *input, const struct coripper_output *output,
+		const struct coripper_policy *policy);
+
+/* The same for two descriptors */
+int coripper_strip_fd(int in_fd, int out_fd, const struct coripper_policy *policy);
+
+const char *coripper_strerror(int error);
+
+/* Messages of the last failed call made by the calling thread, empty after success */
+const char *coripper_last_message(void);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* __LIBCORIPPER_H__ */
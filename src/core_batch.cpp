@@ -0,0 +1,246 @@
+/*
+ * Copyright (c) 2015-2017 Parallels IP Holdings GmbH
+ * Copyright (c) 2017-2019 Virtuozzo International GmbH. All rights reserved.
+ *
+ * This file is part of OpenVZ. OpenVZ is free software; you can redistribute
+ * it and/or modify it under the terms of the GNU General Public License as
+ * published by the Free Software Foundation; either version 2 of the License,
+ * or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA
+ * 02110-1301, USA.
+ *
+ * Our contact details: Virtuozzo International GmbH, Vordergasse 59, 8200
+ * Schaffhausen, Switzerland.
+ */
+
+#include <core_batch.h>
+#include <iostream>
+#include <fstream>
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+#include <dirent.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <boost/bind/bind.hpp>
+#include <boost/thread/thread.hpp>
+
+namespace CoRipper
+{
+
+namespace
+{
+
+const char* const COMPRESSED_SUFFIXES[] = { ".zst", ".lz4", ".xz" };
+
+bool hasSuffix(const std::string& s_, const std::string& suffix_)
+{
+	return s_.size() > suffix_.size()
+		&& 0 == s_.compare(s_.size() - suffix_.size(), suffix_.size(), suffix_);
+}
+
+double getTime()
+{
+	struct timeval tv;
+	gettimeofday(&tv, NULL);
+	return tv.tv_sec + tv.tv_usec / 1e6;
+}
+
+} // namespace
+
+////////////////////////////////////////////////////////////////////////////////////////////////////
+// struct Batch
+
+Batch::Batch(const std::string& outDir_, const Policy& policy_, size_t scratchLimit_,
+	unsigned threads_, const Compression& compression_, const SignatureCache* cache_)
+: m_policy(policy_), m_scratchLimit(scratchLimit_), m_threads(threads_),
+	m_compression(compression_), m_cache(cache_), m_outDir(outDir_), m_rejected(0), m_next(0),
+	m_failed(0)
+{
+	if (stat(m_outDir.c_str(), &m_outStat) != 0)
+		memset(&m_outStat, 0, sizeof(m_outStat));
+}
+
+bool Batch::add(const char* path_)
+{
+	struct stat st;
+
+	if (stat(path_, &st) != 0) {
+		std::cerr << "ERROR: Failed to access " << path_
+			<< ". Reason:" << strerror(errno) << std::endl;
+		return false;
+	}
+
+	if (S_ISDIR(st.st_mode))
+		return addDir(path_);
+	return addList(path_);
+}
+
+bool Batch::addFile(const std::string& path_)
+{
+	struct stat st;
+
+	if (stat(path_.c_str(), &st) != 0 || !S_ISREG(st.st_mode))
+		return false;
+
+	// the result put in place of the source would destroy the full core
+	size_t slash = path_.rfind('/');
+	std::string name = getOutName(path_.substr(slash + 1), m_compression);
+	std::string dir = slash == std::string::npos ? "." : path_.substr(0, std::max<size_t>(slash, 1));
+	struct stat dirStat;
+	if (m_outStat.st_ino != 0 && stat(dir.c_str(), &dirStat) == 0
+		&& dirStat.st_dev == m_outStat.st_dev && dirStat.st_ino == m_outStat.st_ino) {
+		std::cerr << "ERROR: Output " << name << " of " << path_
+			<< " would be written to its own directory, skipped" << std::endl;
+		m_rejected++;
+		return true;
+	}
+
+	// two workers writing the same output would overwrite each other
+	std::map<std::string, std::string>::const_iterator it = m_names.find(name);
+	if (it != m_names.end()) {
+		std::cerr << "ERROR: Output " << name << " of " << path_
+			<< " is already taken by " << it->second << ", skipped" << std::endl;
+		m_rejected++;
+		return true;
+	}
+	m_names[name] = path_;
+
+	Item i;
+	i.path = path_;
+	i.size = st.st_size;
+	m_items.push_back(i);
+	return true;
+}
+
+bool Batch::addDir(const std::string& path_)
+{
+	DIR* d = opendir(path_.c_str());
+	if (d == NULL) {
+		std::cerr << "ERROR: Failed to open directory " << path_
+			<< ". Reason:" << strerror(errno) << std::endl;
+		return false;
+	}
+
+	struct dirent* e;
+	while ((e = readdir(d)) != NULL) {
+		if (e->d_name[0] != '.')
+			addFile(path_ + "/" + e->d_name);
+	}
+	closedir(d);
+	return true;
+}
+
+bool Batch::addList(const std::string& path_)
+{
+	std::ifstream f(path_.c_str());
+	std::string line;
+
+	if (!f) {
+		std::cerr << "ERROR: Failed to open list " << path_ << std::endl;
+		return false;
+	}
+
+	while (std::getline(f, line)) {
+		if (!line.empty() && !addFile(line))
+			std::cerr << "ERROR: Not a regular file: " << line << std::endl;
+	}
+	return true;
+}
+
+size_t Batch::run(unsigned workers_)
+{
+	m_next = 0;
+	m_failed = m_rejected;
+	std::stable_sort(m_items.begin(), m_items.end());
+
+	boost::thread_group workers;
+	try {
+		for (unsigned i = 1; i < workers_ && i < m_items.size(); i++)
+			workers.create_thread(boost::bind(&Batch::runWorker, this));
+	}
+	catch (const boost::thread_resource_error&) {
+		// go on with the workers which have been started
+	}
+	runWorker();
+	workers.join_all();
+
+	std::cout << "Processed " << m_items.size() + m_rejected << " cores, "
+		<< m_failed << " failed" << std::endl;
+	return m_failed;
+}
+
+void Batch::runWorker()
+{
+	Core core(m_policy, m_cache);
+
+	while (true) {
+		size_t n;
+		{
+			boost::mutex::scoped_lock l(m_lock);
+			if (m_next >= m_items.size())
+				return;
+			n = m_next++;
+		}
+
+		const Item& item = m_items[n];
+		double start = getTime();
+		off_t outSize = 0;
+		bool res = strip(core, item, outSize);
+
+		boost::mutex::scoped_lock l(m_lock);
+		if (res && core.isDuplicate()) {
+			std::cout << "DUPLICATE " << item.path << " " << std::hex << core.getSignature()
+				<< std::dec << " #" << core.getSignatureCount() << std::endl;
+		}
+		else if (res) {
+			std::cout << "OK " << item.path << " " << item.size << " -> " << outSize
+				<< " " << int((getTime() - start) * 1000) << "ms" << std::endl;
+		}
+		else {
+			std::cout << "FAILED " << item.path << std::endl;
+			m_failed++;
+		}
+	}
+}
+
+bool Batch::strip(Core& core_, const Item& item_, off_t& outSize_)
+{
+	if (!core_.read(item_.path.c_str(), m_scratchLimit))
+		return false;
+	if (core_.isDuplicate())
+		return true;
+
+	std::string name = item_.path.substr(item_.path.rfind('/') + 1);
+	return core_.writeFile(m_outDir + "/" + getOutName(name, m_compression),
+		outSize_, m_threads, m_compression);
+}
+
+std::string Batch::getOutName(const std::string& name_, const Compression& compression_)
+{
+	std::string name = name_;
+
+	for (size_t i = 0; i < sizeof(COMPRESSED_SUFFIXES) / sizeof(COMPRESSED_SUFFIXES[0]); i++) {
+		if (hasSuffix(name, COMPRESSED_SUFFIXES[i])) {
+			name.resize(name.size() - strlen(COMPRESSED_SUFFIXES[i]));
+			break;
+		}
+	}
+
+	if (compression_.type == Compression::ZSTD)
+		name += ".zst";
+	else if (compression_.type == Compression::LZ4)
+		name += ".lz4";
+
+	return name;
+}
+
+} //namespace CoRipper
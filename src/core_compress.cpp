@@ -0,0 +1,669 @@
+/*
+ * Copyright (c) 2015-2017 Parallels IP Holdings GmbH
+ * Copyright (c) 2017-2019 Virtuozzo International GmbH. All rights reserved.
+ *
+ * This file is part of OpenVZ. OpenVZ is free software; you can redistribute
+ * it and/or modify it under the terms of the GNU General Public License as
+ * published by the Free Software Foundation; either version 2 of the License,
+ * or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA
+ * 02110-1301, USA.
+ *
+ * Our contact details: Virtuozzo International GmbH, Vordergasse 59, 8200
+ * Schaffhausen, Switzerland.
+ */
+
+#include <core_compress.h>
+#include <core_log.h>
+#include <vector>
+#include <algorithm>
+#include <cerrno>
+#include <cstdlib>
+#include <cstring>
+#include <unistd.h>
+#ifdef HAVE_ZSTD
+#include <zstd.h>
+#endif
+#ifdef HAVE_LZ4
+#include <lz4frame.h>
+#endif
+#ifdef HAVE_LZMA
+#include <lzma.h>
+#endif
+
+enum {
+	LZ4_INPUT_SIZE = 1 << 16,
+	SOURCE_BUFF_SIZE = 1 << 17,
+	MAGIC_SIZE = 6
+};
+
+namespace CoRipper
+{
+
+namespace
+{
+
+bool writeAll(int fd_, const char* buff_, size_t size_)
+{
+	while (size_ > 0) {
+		ssize_t n = ::write(fd_, buff_, size_);
+		if (n < 0 && errno == EINTR)
+			continue;
+		if (n <= 0)
+			return false;
+		buff_ += n;
+		size_ -= n;
+	}
+	return true;
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////
+// struct FdSink
+
+struct FdSink: Sink
+{
+	explicit FdSink(int fd_): m_fd(fd_)
+	{
+	}
+
+	virtual bool write(const char* buff_, size_t size_)
+	{
+		return writeAll(m_fd, buff_, size_);
+	}
+
+	virtual bool finish()
+	{
+		return true;
+	}
+
+private:
+	int m_fd;
+};
+
+////////////////////////////////////////////////////////////////////////////////////////////////////
+// struct CallbackSink
+
+// Data handed over to the function of the library caller
+struct CallbackSink: Sink
+{
+	CallbackSink(write_t write_, void* ctx_): m_write(write_), m_ctx(ctx_)
+	{
+	}
+
+	virtual bool write(const char* buff_, size_t size_)
+	{
+		return m_write(m_ctx, buff_, size_);
+	}
+
+	virtual bool finish()
+	{
+		return true;
+	}
+
+private:
+	write_t m_write;
+	void* m_ctx;
+};
+
+#ifdef HAVE_ZSTD
+////////////////////////////////////////////////////////////////////////////////////////////////////
+// struct ZstdSink
+
+// Single zstd frame, compressed by several workers when the library supports that
+struct ZstdSink: Sink
+{
+	explicit ZstdSink(const Sink::ptr_t& next_)
+	: m_next(next_), m_ctx(ZSTD_createCCtx()), m_out(ZSTD_CStreamOutSize())
+	{
+	}
+
+	virtual ~ZstdSink()
+	{
+		ZSTD_freeCCtx(m_ctx);
+	}
+
+	bool init(const Compression& compression_)
+	{
+		if (m_ctx == NULL)
+			return false;
+
+		if (compression_.level != 0
+			&& ZSTD_isError(ZSTD_CCtx_setParameter(m_ctx, ZSTD_c_compressionLevel, compression_.level)))
+			return false;
+
+		ZSTD_CCtx_setParameter(m_ctx, ZSTD_c_checksumFlag, 1);
+		// single threaded library refuses workers, that is not fatal
+		ZSTD_CCtx_setParameter(m_ctx, ZSTD_c_nbWorkers, compression_.threads);
+		return true;
+	}
+
+	virtual bool write(const char* buff_, size_t size_)
+	{
+		ZSTD_inBuffer in = { buff_, size_, 0 };
+		size_t left;
+
+		while (in.pos < in.size) {
+			if (!compress(in, ZSTD_e_continue, left))
+				return false;
+		}
+		return true;
+	}
+
+	virtual bool finish()
+	{
+		ZSTD_inBuffer in = { NULL, 0, 0 };
+		size_t left;
+
+		do {
+			if (!compress(in, ZSTD_e_end, left))
+				return false;
+		} while (left > 0);
+		return m_next->finish();
+	}
+
+private:
+	// left_ is the amount of data still kept inside the compressor
+	bool compress(ZSTD_inBuffer& in_, ZSTD_EndDirective mode_, size_t& left_)
+	{
+		ZSTD_outBuffer out = { &m_out[0], m_out.size(), 0 };
+		left_ = ZSTD_compressStream2(m_ctx, &out, &in_, mode_);
+
+		if (ZSTD_isError(left_)) {
+			Log::error() << "ERROR: zstd: " << ZSTD_getErrorName(left_) << std::endl;
+			return false;
+		}
+		return m_next->write(&m_out[0], out.pos);
+	}
+
+	Sink::ptr_t m_next;
+	ZSTD_CCtx* m_ctx;
+	std::vector<char> m_out;
+};
+#endif
+
+#ifdef HAVE_LZ4
+////////////////////////////////////////////////////////////////////////////////////////////////////
+// struct Lz4Sink
+
+struct Lz4Sink: Sink
+{
+	explicit Lz4Sink(const Sink::ptr_t& next_): m_next(next_), m_ctx(NULL)
+	{
+		memset(&m_prefs, 0, sizeof(m_prefs));
+	}
+
+	virtual ~Lz4Sink()
+	{
+		LZ4F_freeCompressionContext(m_ctx);
+	}
+
+	bool init(const Compression& compression_)
+	{
+		m_prefs.compressionLevel = compression_.level;
+		m_prefs.frameInfo.contentChecksumFlag = LZ4F_contentChecksumEnabled;
+		m_out.resize(LZ4F_compressBound(LZ4_INPUT_SIZE, &m_prefs));
+
+		if (!check(LZ4F_createCompressionContext(&m_ctx, LZ4F_VERSION)))
+			return false;
+
+		return put(LZ4F_compressBegin(m_ctx, &m_out[0], m_out.size(), &m_prefs));
+	}
+
+	virtual bool write(const char* buff_, size_t size_)
+	{
+		while (size_ > 0) {
+			size_t n = std::min(size_, size_t(LZ4_INPUT_SIZE));
+			if (!put(LZ4F_compressUpdate(m_ctx, &m_out[0], m_out.size(), buff_, n, NULL)))
+				return false;
+			buff_ += n;
+			size_ -= n;
+		}
+		return true;
+	}
+
+	virtual bool finish()
+	{
+		return put(LZ4F_compressEnd(m_ctx, &m_out[0], m_out.size(), NULL)) && m_next->finish();
+	}
+
+private:
+	static bool check(size_t r_)
+	{
+		if (!LZ4F_isError(r_))
+			return true;
+		Log::error() << "ERROR: lz4: " << LZ4F_getErrorName(r_) << std::endl;
+		return false;
+	}
+
+	bool put(size_t r_)
+	{
+		return check(r_) && m_next->write(&m_out[0], r_);
+	}
+
+	Sink::ptr_t m_next;
+	LZ4F_cctx* m_ctx;
+	LZ4F_preferences_t m_prefs;
+	std::vector<char> m_out;
+};
+#endif
+
+const unsigned char ZSTD_MAGIC[] = { 0x28, 0xb5, 0x2f, 0xfd };
+const unsigned char LZ4_MAGIC[] = { 0x04, 0x22, 0x4d, 0x18 };
+const unsigned char XZ_MAGIC[] = { 0xfd, '7', 'z', 'X', 'Z', 0x00 };
+
+template<size_t N>
+bool hasMagic(const char* head_, size_t size_, const unsigned char (&magic_)[N])
+{
+	return size_ >= N && 0 == memcmp(head_, magic_, N);
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////
+// struct FdSource
+
+// Plain descriptor, the bytes consumed for format detection are returned first
+struct FdSource: Source
+{
+	FdSource(int fd_, const char* head_, size_t size_)
+	: m_fd(fd_), m_head(head_, head_ + size_), m_pos(0)
+	{
+	}
+
+	virtual ssize_t read(char* buff_, size_t size_)
+	{
+		if (m_pos < m_head.size()) {
+			size_t n = std::min(size_, m_head.size() - m_pos);
+			memcpy(buff_, &m_head[m_pos], n);
+			m_pos += n;
+			return n;
+		}
+
+		ssize_t n;
+		do {
+			n = ::read(m_fd, buff_, size_);
+		} while (n < 0 && errno == EINTR);
+		return n;
+	}
+
+private:
+	int m_fd;
+	std::vector<char> m_head;
+	size_t m_pos;
+};
+
+////////////////////////////////////////////////////////////////////////////////////////////////////
+// struct MemorySource
+
+// Core already in memory of the library caller
+struct MemorySource: Source
+{
+	MemorySource(const char* buff_, size_t size_): m_buff(buff_), m_size(size_), m_pos(0)
+	{
+	}
+
+	virtual ssize_t read(char* buff_, size_t size_)
+	{
+		size_t n = std::min(size_, m_size - m_pos);
+		memcpy(buff_, m_buff + m_pos, n);
+		m_pos += n;
+		return n;
+	}
+
+private:
+	const char* m_buff;
+	size_t m_size;
+	size_t m_pos;
+};
+
+// Input of decompressing sources
+struct Input
+{
+	explicit Input(const Source::ptr_t& source_)
+	: m_source(source_), m_buff(SOURCE_BUFF_SIZE), m_pos(0), m_size(0), m_error(false)
+	{
+	}
+
+	// refill exhausted buffer, returns false at the end of data or on error
+	bool fill()
+	{
+		if (m_pos < m_size)
+			return true;
+
+		ssize_t n = m_source->read(&m_buff[0], m_buff.size());
+		m_error = n < 0;
+		m_pos = 0;
+		m_size = n > 0 ? n : 0;
+		return n > 0;
+	}
+
+	Source::ptr_t m_source;
+	std::vector<char> m_buff;
+	size_t m_pos;
+	size_t m_size;
+	bool m_error;
+};
+
+ssize_t truncated(const Input& in_, const char* format_)
+{
+	if (!in_.m_error)
+		Log::error() << "ERROR: " << format_ << ": unexpected end of data" << std::endl;
+	return -1;
+}
+
+#ifdef HAVE_ZSTD
+////////////////////////////////////////////////////////////////////////////////////////////////////
+// struct ZstdSource
+
+struct ZstdSource: Source
+{
+	explicit ZstdSource(const Source::ptr_t& source_)
+	: m_in(source_), m_ctx(ZSTD_createDStream()), m_left(1)
+	{
+	}
+
+	virtual ~ZstdSource()
+	{
+		ZSTD_freeDStream(m_ctx);
+	}
+
+	virtual ssize_t read(char* buff_, size_t size_)
+	{
+		ZSTD_outBuffer out = { buff_, size_, 0 };
+
+		while (out.pos == 0) {
+			if (!m_in.fill())
+				return m_left == 0 && !m_in.m_error ? 0 : truncated(m_in, "zstd");
+
+			ZSTD_inBuffer in = { &m_in.m_buff[0], m_in.m_size, m_in.m_pos };
+			m_left = ZSTD_decompressStream(m_ctx, &out, &in);
+			if (ZSTD_isError(m_left)) {
+				Log::error() << "ERROR: zstd: " << ZSTD_getErrorName(m_left) << std::endl;
+				return -1;
+			}
+			m_in.m_pos = in.pos;
+		}
+		return out.pos;
+	}
+
+	bool isValid() const
+	{
+		return m_ctx != NULL;
+	}
+
+private:
+	Input m_in;
+	ZSTD_DStream* m_ctx;
+	// 0 when the last frame is complete
+	size_t m_left;
+};
+#endif
+
+#ifdef HAVE_LZ4
+////////////////////////////////////////////////////////////////////////////////////////////////////
+// struct Lz4Source
+
+struct Lz4Source: Source
+{
+	explicit Lz4Source(const Source::ptr_t& source_)
+	: m_in(source_), m_ctx(NULL), m_left(1)
+	{
+		if (LZ4F_isError(LZ4F_createDecompressionContext(&m_ctx, LZ4F_VERSION)))
+			m_ctx = NULL;
+	}
+
+	virtual ~Lz4Source()
+	{
+		LZ4F_freeDecompressionContext(m_ctx);
+	}
+
+	virtual ssize_t read(char* buff_, size_t size_)
+	{
+		size_t out = 0;
+
+		while (out == 0) {
+			if (!m_in.fill())
+				return m_left == 0 && !m_in.m_error ? 0 : truncated(m_in, "lz4");
+
+			size_t in = m_in.m_size - m_in.m_pos;
+			out = size_;
+			m_left = LZ4F_decompress(m_ctx, buff_, &out, &m_in.m_buff[m_in.m_pos], &in, NULL);
+			if (LZ4F_isError(m_left)) {
+				Log::error() << "ERROR: lz4: " << LZ4F_getErrorName(m_left) << std::endl;
+				return -1;
+			}
+			m_in.m_pos += in;
+		}
+		return out;
+	}
+
+	bool isValid() const
+	{
+		return m_ctx != NULL;
+	}
+
+private:
+	Input m_in;
+	LZ4F_dctx* m_ctx;
+	// 0 when the last frame is complete
+	size_t m_left;
+};
+#endif
+
+#ifdef HAVE_LZMA
+////////////////////////////////////////////////////////////////////////////////////////////////////
+// struct XzSource
+
+struct XzSource: Source
+{
+	explicit XzSource(const Source::ptr_t& source_)
+	: m_in(source_), m_end(false)
+	{
+		lzma_stream init = LZMA_STREAM_INIT;
+		m_strm = init;
+		m_valid = LZMA_OK == lzma_stream_decoder(&m_strm, UINT64_MAX, LZMA_CONCATENATED);
+	}
+
+	virtual ~XzSource()
+	{
+		lzma_end(&m_strm);
+	}
+
+	virtual ssize_t read(char* buff_, size_t size_)
+	{
+		m_strm.next_out = reinterpret_cast<uint8_t*>(buff_);
+		m_strm.avail_out = size_;
+
+		while (!m_end && m_strm.avail_out == size_) {
+			lzma_action action = LZMA_RUN;
+
+			if (m_strm.avail_in == 0) {
+				if (m_in.fill()) {
+					m_strm.next_in = reinterpret_cast<uint8_t*>(&m_in.m_buff[0]);
+					m_strm.avail_in = m_in.m_size;
+					m_in.m_pos = m_in.m_size;
+				}
+				else if (m_in.m_error)
+					return -1;
+				else
+					action = LZMA_FINISH;
+			}
+
+			lzma_ret r = lzma_code(&m_strm, action);
+			if (r == LZMA_STREAM_END)
+				m_end = true;
+			else if (r == LZMA_BUF_ERROR && action == LZMA_FINISH)
+				return truncated(m_in, "xz");
+			else if (r != LZMA_OK) {
+				Log::error() << "ERROR: xz: decoder error " << r << std::endl;
+				return -1;
+			}
+		}
+		return size_ - m_strm.avail_out;
+	}
+
+	bool isValid() const
+	{
+		return m_valid;
+	}
+
+private:
+	Input m_in;
+	lzma_stream m_strm;
+	bool m_valid;
+	bool m_end;
+};
+#endif
+
+template<class T>
+Source::ptr_t makeSource(const Source::ptr_t& input_)
+{
+	T* s = new T(input_);
+	Source::ptr_t p(s);
+
+	if (s->isValid())
+		return p;
+
+	Log::error() << "ERROR: Unable to initialize decompression" << std::endl;
+	return Source::ptr_t();
+}
+
+// Put decompressor on top of plain input according to the magic at its head
+Source::ptr_t makeSource(const Source::ptr_t& input_, const char* head_, size_t size_)
+{
+	if (hasMagic(head_, size_, ZSTD_MAGIC)) {
+#ifdef HAVE_ZSTD
+		return makeSource<ZstdSource>(input_);
+#endif
+	}
+	else if (hasMagic(head_, size_, LZ4_MAGIC)) {
+#ifdef HAVE_LZ4
+		return makeSource<Lz4Source>(input_);
+#endif
+	}
+	else if (hasMagic(head_, size_, XZ_MAGIC)) {
+#ifdef HAVE_LZMA
+		return makeSource<XzSource>(input_);
+#endif
+	}
+	else
+		return input_;
+
+	Log::error() << "ERROR: Compressed input is not supported by this build" << std::endl;
+	return Source::ptr_t();
+}
+
+// Put compressor in front of the final output
+Sink::ptr_t makeSink(const Sink::ptr_t& output_, const Compression& compression_)
+{
+	const Compression& c = compression_;
+
+	switch (c.type) {
+	case Compression::NONE:
+		return output_;
+#ifdef HAVE_ZSTD
+	case Compression::ZSTD: {
+		ZstdSink* s = new ZstdSink(output_);
+		Sink::ptr_t p(s);
+		if (s->init(c))
+			return p;
+		break;
+	}
+#endif
+#ifdef HAVE_LZ4
+	case Compression::LZ4: {
+		Lz4Sink* s = new Lz4Sink(output_);
+		Sink::ptr_t p(s);
+		if (s->init(c))
+			return p;
+		break;
+	}
+#endif
+	default:
+		Log::error() << "ERROR: Compression is not supported by this build" << std::endl;
+		return Sink::ptr_t();
+	}
+
+	Log::error() << "ERROR: Unable to initialize compression" << std::endl;
+	return Sink::ptr_t();
+}
+
+} // namespace
+
+////////////////////////////////////////////////////////////////////////////////////////////////////
+// struct Compression
+
+bool Compression::parse(const char* spec_)
+{
+	const char* colon = strchr(spec_, ':');
+	size_t n = colon ? size_t(colon - spec_) : strlen(spec_);
+
+	if (n == 4 && 0 == strncmp(spec_, "zstd", n))
+		type = ZSTD;
+	else if (n == 3 && 0 == strncmp(spec_, "lz4", n))
+		type = LZ4;
+	else
+		return false;
+
+	if (colon == NULL)
+		return true;
+
+	char* end;
+	level = strtol(colon + 1, &end, 10);
+	return end != colon + 1 && *end == '\0';
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////
+// struct Sink
+
+Sink::ptr_t Sink::create(int fd_, const Compression& compression_)
+{
+	return makeSink(ptr_t(new FdSink(fd_)), compression_);
+}
+
+Sink::ptr_t Sink::create(write_t write_, void* ctx_, const Compression& compression_)
+{
+	return makeSink(ptr_t(new CallbackSink(write_, ctx_)), compression_);
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////
+// struct Source
+
+bool Source::isCompressed(const char* head_, size_t size_)
+{
+	return hasMagic(head_, size_, ZSTD_MAGIC)
+		|| hasMagic(head_, size_, LZ4_MAGIC)
+		|| hasMagic(head_, size_, XZ_MAGIC);
+}
+
+Source::ptr_t Source::open(int fd_)
+{
+	char head[MAGIC_SIZE];
+	size_t size = 0;
+
+	while (size < sizeof(head)) {
+		ssize_t n = ::read(fd_, head + size, sizeof(head) - size);
+		if (n < 0 && errno == EINTR)
+			continue;
+		if (n < 0)
+			return ptr_t();
+		if (n == 0)
+			break;
+		size += n;
+	}
+
+	return makeSource(ptr_t(new FdSource(fd_, head, size)), head, size);
+}
+
+Source::ptr_t Source::open(const char* buff_, size_t size_)
+{
+	return makeSource(ptr_t(new MemorySource(buff_, size_)), buff_, size_);
+}
+
+} //namespace CoRipper
@@ -0,0 +1,533 @@
+/*
+ * Copyright (c) 2015-2017 Parallels IP Holdings GmbH
+ * Copyright (c) 2017-2019 Virtuozzo International GmbH. All rights reserved.
+ *
+ * This file is part of OpenVZ. OpenVZ is free software; you can redistribute
+ * it and/or modify it under the terms of the GNU General Public License as
+ * published by the Free Software Foundation; either version 2 of the License,
+ * or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA
+ * 02110-1301, USA.
+ *
+ * Our contact details: Virtuozzo International GmbH, Vordergasse 59, 8200
+ * Schaffhausen, Switzerland.
+ */
+
+#include <core_daemon.h>
+#include <core_batch.h>
+#include <iostream>
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+#include <csignal>
+#include <cstdio>
+#include <fcntl.h>
+#include <poll.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/inotify.h>
+#include <sys/signalfd.h>
+#include <boost/bind/bind.hpp>
+#include <boost/thread/thread.hpp>
+
+enum {
+	MAX_NAME_SIZE = 256,
+	RATE_WINDOW_SEC = 60,
+	CLIENT_TIMEOUT_SEC = 1,
+	INOTIFY_BUFF_SIZE = 1 << 16
+};
+
+namespace CoRipper
+{
+
+namespace
+{
+
+// binary name is the first dot separated part of core name, "core." prefix
+// of systemd-coredump names is skipped
+std::string getBinary(const std::string& name_)
+{
+	std::string::size_type start = name_.compare(0, 5, "core.") == 0 ? 5 : 0;
+	return name_.substr(start, name_.find('.', start) - start);
+}
+
+bool isSpoolName(const std::string& name_)
+{
+	static const std::string tmp(".tmp");
+
+	return !name_.empty() && name_[0] != '.'
+		&& !(name_.size() > tmp.size() && 0 == name_.compare(name_.size() - tmp.size(), tmp.size(), tmp));
+}
+
+double getTime()
+{
+	struct timeval tv;
+	gettimeofday(&tv, NULL);
+	return tv.tv_sec + tv.tv_usec / 1e6;
+}
+
+bool makeSocketAddress(const char* path_, struct sockaddr_un& addr_)
+{
+	memset(&addr_, 0, sizeof(addr_));
+	addr_.sun_family = AF_UNIX;
+	if (strlen(path_) >= sizeof(addr_.sun_path))
+		return false;
+
+	strcpy(addr_.sun_path, path_);
+	return true;
+}
+
+} // namespace
+
+////////////////////////////////////////////////////////////////////////////////////////////////////
+// struct Daemon
+
+Daemon::Daemon(const Config& config_)
+: m_config(config_), m_socket(-1), m_inotify(-1), m_signal(-1),
+	m_inflight(0), m_running(0), m_seq(0), m_stop(false)
+{
+}
+
+Daemon::~Daemon()
+{
+	if (m_socket >= 0) {
+		close(m_socket);
+		unlink(m_config.socketPath.c_str());
+	}
+	if (m_inotify >= 0)
+		close(m_inotify);
+	if (m_signal >= 0)
+		close(m_signal);
+}
+
+bool Daemon::run()
+{
+	sigset_t mask;
+
+	// block termination signals in all threads, main loop gets them via signalfd
+	sigemptyset(&mask);
+	sigaddset(&mask, SIGINT);
+	sigaddset(&mask, SIGTERM);
+	if (sigprocmask(SIG_BLOCK, &mask, NULL) != 0
+		|| (m_signal = signalfd(-1, &mask, SFD_CLOEXEC)) < 0) {
+		std::cerr << "ERROR: Failed to set up signal handling" << std::endl;
+		return false;
+	}
+	signal(SIGPIPE, SIG_IGN);
+
+	if (!m_config.spoolDir.empty() && !openSpool())
+		return false;
+	if (!m_config.socketPath.empty() && !openSocket())
+		return false;
+
+	boost::thread_group workers;
+	try {
+		for (unsigned i = 0; i < m_config.workers; i++)
+			workers.create_thread(boost::bind(&Daemon::runWorker, this));
+	}
+	catch (const boost::thread_resource_error&) {
+		if (workers.size() == 0) {
+			std::cerr << "ERROR: Failed to start workers" << std::endl;
+			return false;
+		}
+	}
+
+	scanSpool();
+
+	struct pollfd head[3] = {
+		{ m_signal, POLLIN, 0 },
+		{ m_inotify, POLLIN, 0 },
+		{ m_socket, POLLIN, 0 }
+	};
+	std::vector<struct pollfd> fds;
+
+	while (true) {
+		// clients are read here too, a slow one must not hold up the others
+		fds.assign(head, head + 3);
+		for (std::map<int, double>::const_iterator i = m_clients.begin(); i != m_clients.end(); ++i) {
+			struct pollfd p = { i->first, POLLIN, 0 };
+			fds.push_back(p);
+		}
+
+		if (poll(&fds[0], fds.size(), getClientTimeout()) < 0) {
+			if (errno == EINTR)
+				continue;
+			break;
+		}
+
+		if (fds[0].revents)
+			break;
+
+		if (fds[1].revents) {
+			char buff[INOTIFY_BUFF_SIZE];
+			ssize_t n = read(m_inotify, buff, sizeof(buff));
+
+			for (ssize_t pos = 0; pos < n; ) {
+				const struct inotify_event* e = reinterpret_cast<const struct inotify_event*>(buff + pos);
+				if (e->mask & IN_Q_OVERFLOW)
+					scanSpool();
+				else if (e->len > 0)
+					addSpoolFile(e->name);
+				pos += sizeof(*e) + e->len;
+			}
+		}
+
+		if (fds[2].revents)
+			acceptClient();
+
+		double now = getTime();
+		for (size_t i = 3; i < fds.size(); i++) {
+			std::map<int, double>::iterator c = m_clients.find(fds[i].fd);
+			if (fds[i].revents && readClient(c->first))
+				m_clients.erase(c);
+			else if (now - c->second >= CLIENT_TIMEOUT_SEC) {
+				close(c->first);
+				m_clients.erase(c);
+			}
+		}
+	}
+
+	for (std::map<int, double>::const_iterator i = m_clients.begin(); i != m_clients.end(); ++i)
+		close(i->first);
+	m_clients.clear();
+
+	{
+		boost::mutex::scoped_lock l(m_lock);
+		m_stop = true;
+		m_cond.notify_all();
+	}
+	workers.join_all();
+
+	// spooled cores stay for the next run, clients are told to give up
+	while (!m_queue.empty()) {
+		finish(*m_queue.begin(), STATUS_FAILED);
+		m_queue.erase(m_queue.begin());
+	}
+	return true;
+}
+
+bool Daemon::openSpool()
+{
+	if ((m_inotify = inotify_init1(IN_CLOEXEC)) < 0
+		|| inotify_add_watch(m_inotify, m_config.spoolDir.c_str(), IN_CLOSE_WRITE | IN_MOVED_TO) < 0) {
+		std::cerr << "ERROR: Failed to watch spool directory " << m_config.spoolDir
+			<< ". Reason:" << strerror(errno) << std::endl;
+		return false;
+	}
+	return true;
+}
+
+bool Daemon::openSocket()
+{
+	struct sockaddr_un addr;
+
+	if (!makeSocketAddress(m_config.socketPath.c_str(), addr)) {
+		std::cerr << "ERROR: Socket path is too long" << std::endl;
+		return false;
+	}
+
+	unlink(addr.sun_path);
+	if ((m_socket = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0)) < 0
+		|| bind(m_socket, reinterpret_cast<struct sockaddr*>(&addr), sizeof(addr)) != 0
+		|| chmod(addr.sun_path, 0600) != 0
+		|| listen(m_socket, SOMAXCONN) != 0) {
+		std::cerr << "ERROR: Failed to listen on " << m_config.socketPath
+			<< ". Reason:" << strerror(errno) << std::endl;
+		return false;
+	}
+	return true;
+}
+
+// Pick up cores which are already in the spool
+void Daemon::scanSpool()
+{
+	if (m_config.spoolDir.empty())
+		return;
+
+	DIR* d = opendir(m_config.spoolDir.c_str());
+	if (d == NULL)
+		return;
+
+	struct dirent* e;
+	while ((e = readdir(d)) != NULL)
+		addSpoolFile(e->d_name);
+	closedir(d);
+}
+
+void Daemon::addSpoolFile(const std::string& name_)
+{
+	struct stat st;
+	Job j;
+
+	if (!isSpoolName(name_))
+		return;
+
+	j.path = m_config.spoolDir + "/" + name_;
+	if (stat(j.path.c_str(), &st) != 0 || !S_ISREG(st.st_mode))
+		return;
+
+	{
+		boost::mutex::scoped_lock l(m_lock);
+		if (!m_pending.insert(name_).second)
+			return;
+	}
+
+	j.name = name_;
+	j.binary = getBinary(name_);
+	j.size = st.st_size;
+	submit(j);
+}
+
+// Accept client connection, its message is read when it arrives
+void Daemon::acceptClient()
+{
+	int c = accept4(m_socket, NULL, NULL, SOCK_CLOEXEC | SOCK_NONBLOCK);
+	if (c >= 0)
+		m_clients[c] = getTime();
+}
+
+// Milliseconds until the oldest client waiting for its message times out
+int Daemon::getClientTimeout() const
+{
+	if (m_clients.empty())
+		return -1;
+
+	double oldest = getTime();
+	for (std::map<int, double>::const_iterator i = m_clients.begin(); i != m_clients.end(); ++i)
+		oldest = std::min(oldest, i->second);
+
+	return std::max(0, int((oldest + CLIENT_TIMEOUT_SEC - getTime()) * 1000) + 1);
+}
+
+// Take core passed by client: its name in the message and the descriptor
+// to read the core from in SCM_RIGHTS. Returns false while the message is
+// not there yet, the client is closed or taken by a job otherwise.
+bool Daemon::readClient(int client_)
+{
+	char name[MAX_NAME_SIZE];
+	char control[CMSG_SPACE(sizeof(int))];
+	struct iovec iov = { name, sizeof(name) - 1 };
+	struct msghdr msg;
+
+	memset(&msg, 0, sizeof(msg));
+	msg.msg_iov = &iov;
+	msg.msg_iovlen = 1;
+	msg.msg_control = control;
+	msg.msg_controllen = sizeof(control);
+
+	ssize_t n = recvmsg(client_, &msg, MSG_CMSG_CLOEXEC);
+	if (n < 0 && (errno == EAGAIN || errno == EINTR))
+		return false;
+
+	struct cmsghdr* cmsg = n > 0 ? CMSG_FIRSTHDR(&msg) : NULL;
+	if (cmsg == NULL || cmsg->cmsg_level != SOL_SOCKET || cmsg->cmsg_type != SCM_RIGHTS
+		|| cmsg->cmsg_len != CMSG_LEN(sizeof(int))) {
+		close(client_);
+		return true;
+	}
+
+	Job j;
+	memcpy(&j.fd, CMSG_DATA(cmsg), sizeof(int));
+	j.client = client_;
+	j.name.assign(name, n);
+	for (std::string::iterator i = j.name.begin(); i != j.name.end(); ++i) {
+		if (*i == '/' || *i == '\0')
+			*i = '_';
+	}
+	if (!isSpoolName(j.name))
+		j.name = "core." + j.name;
+	j.binary = getBinary(j.name);
+	submit(j);
+	return true;
+}
+
+void Daemon::submit(Job& job_)
+{
+	{
+		boost::mutex::scoped_lock l(m_lock);
+
+		if (!isRateLimited(job_.binary)) {
+			job_.seq = m_seq++;
+			m_queue.insert(job_);
+			m_cond.notify_one();
+			return;
+		}
+
+		std::cout << "SHED " << job_.name << " rate limit of " << job_.binary << std::endl;
+		if (!job_.path.empty())
+			m_pending.erase(job_.name);
+	}
+	finish(job_, STATUS_SHED);
+}
+
+// Sliding window of admissions per binary, called under m_lock
+bool Daemon::isRateLimited(const std::string& binary_)
+{
+	if (m_config.rateLimit == 0)
+		return false;
+
+	time_t now = time(NULL);
+	std::deque<time_t>& d = m_admitted[binary_];
+
+	while (!d.empty() && d.front() <= now - RATE_WINDOW_SEC)
+		d.pop_front();
+
+	if (d.size() >= m_config.rateLimit)
+		return true;
+
+	d.push_back(now);
+	return false;
+}
+
+// Wait for the most important job which fits into in-flight limit, one job
+// is always allowed to run so that a huge core can't stall the queue forever
+bool Daemon::takeJob(Job& job_)
+{
+	boost::mutex::scoped_lock l(m_lock);
+
+	while (!m_stop) {
+		for (std::set<Job>::iterator i = m_queue.begin(); i != m_queue.end(); ++i) {
+			size_t cost = i->fd < 0 ? i->size : m_config.scratchLimit;
+
+			if (m_running > 0 && m_config.maxInflight > 0
+				&& m_inflight + cost > m_config.maxInflight)
+				continue;
+
+			job_ = *i;
+			m_queue.erase(i);
+			m_inflight += cost;
+			m_running++;
+			return true;
+		}
+		m_cond.wait(l);
+	}
+	return false;
+}
+
+void Daemon::runWorker()
+{
+	Core core(m_config.policy, m_config.cache);
+	Job j;
+
+	while (takeJob(j)) {
+		double start = getTime();
+		off_t outSize = 0;
+		bool res = process(core, j, outSize);
+
+		finish(j, !res ? STATUS_FAILED : core.isDuplicate() ? STATUS_DUPLICATE : STATUS_OK);
+
+		boost::mutex::scoped_lock l(m_lock);
+		if (res && core.isDuplicate()) {
+			std::cout << "DUPLICATE " << j.name << " " << std::hex << core.getSignature()
+				<< std::dec << " #" << core.getSignatureCount() << std::endl;
+		}
+		else if (res) {
+			std::cout << "OK " << j.name << " " << j.size << " -> " << outSize
+				<< " " << int((getTime() - start) * 1000) << "ms" << std::endl;
+		}
+		else
+			std::cout << "FAILED " << j.name << std::endl;
+
+		m_inflight -= j.fd < 0 ? j.size : m_config.scratchLimit;
+		m_running--;
+		if (!j.path.empty())
+			m_pending.erase(j.name);
+		m_cond.notify_all();
+	}
+}
+
+bool Daemon::process(Core& core_, const Job& job_, off_t& outSize_)
+{
+	bool res;
+
+	if (job_.fd >= 0)
+		res = core_.readStream(job_.fd, m_config.scratchLimit);
+	else
+		res = core_.read(job_.path.c_str(), m_config.scratchLimit);
+
+	if (res && core_.isDuplicate())
+		return true;
+
+	return res && core_.writeFile(m_config.outDir + "/"
+		+ Batch::getOutName(job_.name, m_config.compression), outSize_, 1, m_config.compression);
+}
+
+// Release resources of the job. Processed spooled cores are removed, the ones
+// which failed are hidden as ".failed.<name>" to be looked at later.
+void Daemon::finish(const Job& job_, status_t status_)
+{
+	if (job_.client >= 0) {
+		char s = status_;
+		if (send(job_.client, &s, sizeof(s), MSG_NOSIGNAL) != sizeof(s))
+			std::cerr << "ERROR: Failed to reply to client of " << job_.name << std::endl;
+		close(job_.client);
+	}
+	if (job_.fd >= 0)
+		close(job_.fd);
+
+	if (job_.path.empty())
+		return;
+
+	if (status_ == STATUS_FAILED && !m_stop)
+		rename(job_.path.c_str(), (m_config.spoolDir + "/.failed." + job_.name).c_str());
+	else if (status_ != STATUS_FAILED)
+		unlink(job_.path.c_str());
+}
+
+int Daemon::runClient(const char* socket_, const char* name_)
+{
+	struct sockaddr_un addr;
+	int s;
+
+	if (!makeSocketAddress(socket_, addr)
+		|| (s = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0)) < 0) {
+		std::cerr << "ERROR: Failed to create socket" << std::endl;
+		return -1;
+	}
+
+	if (connect(s, reinterpret_cast<struct sockaddr*>(&addr), sizeof(addr)) != 0) {
+		std::cerr << "ERROR: Failed to connect to " << socket_
+			<< ". Reason:" << strerror(errno) << std::endl;
+		close(s);
+		return -1;
+	}
+
+	int fd = STDIN_FILENO;
+	char control[CMSG_SPACE(sizeof(int))];
+	struct iovec iov = { const_cast<char*>(name_), strlen(name_) };
+	struct msghdr msg;
+
+	memset(control, 0, sizeof(control));
+	memset(&msg, 0, sizeof(msg));
+	msg.msg_iov = &iov;
+	msg.msg_iovlen = 1;
+	msg.msg_control = control;
+	msg.msg_controllen = sizeof(control);
+
+	struct cmsghdr* cmsg = CMSG_FIRSTHDR(&msg);
+	cmsg->cmsg_level = SOL_SOCKET;
+	cmsg->cmsg_type = SCM_RIGHTS;
+	cmsg->cmsg_len = CMSG_LEN(sizeof(int));
+	memcpy(CMSG_DATA(cmsg), &fd, sizeof(int));
+
+	char status = STATUS_FAILED;
+	if (sendmsg(s, &msg, 0) < 0 || recv(s, &status, sizeof(status), 0) != sizeof(status))
+		std::cerr << "ERROR: No reply from " << socket_ << std::endl;
+
+	close(s);
+	return status;
+}
+
+} //namespace CoRipper
@@ -0,0 +1,62 @@
+/*
+ * Copyright (c) 2015-2017 Parallels IP Holdings GmbH
+ * Copyright (c) 2017-2019 Virtuozzo International GmbH. All rights reserved.
+ *
+ * This file is part of OpenVZ. OpenVZ is free software; you can redistribute
+ * it and/or modify it under the terms of the GNU General Public License as
+ * published by the Free Software Foundation; either version 2 of the License,
+ * or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA
+ * 02110-1301, USA.
+ *
+ * Our contact details: Virtuozzo International GmbH, Vordergasse 59, 8200
+ * Schaffhausen, Switzerland.
+ */
+
+#include <core_log.h>
+#include <iostream>
+#include <boost/thread/tss.hpp>
+
+namespace CoRipper
+{
+
+namespace
+{
+
+// streams are owned by the capturing code
+void keep(std::ostream*)
+{
+}
+
+boost::thread_specific_ptr<std::ostream> s_stream(&keep);
+
+} // namespace
+
+////////////////////////////////////////////////////////////////////////////////////////////////////
+// struct Log
+
+std::ostream& Log::error()
+{
+	std::ostream* s = s_stream.get();
+	return s ? *s : std::cerr;
+}
+
+Log::Capture::Capture(std::ostream& dst_): m_prev(s_stream.get())
+{
+	s_stream.reset(&dst_);
+}
+
+Log::Capture::~Capture()
+{
+	s_stream.reset(m_prev);
+}
+
+} //namespace CoRipper
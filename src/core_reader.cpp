@@ -23,13 +23,35 @@
 
 #include <cstring>
 #include <cerrno>
+#include <cstdlib>
+#include <cstddef>
 #include <fcntl.h>
-#include <iostream>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <sys/procfs.h>
+#include <algorithm>
+#include <limits>
 #include <core_reader.h>
+#include <core_log.h>
+#include <core_compress.h>
+#include <boost/static_assert.hpp>
+#include <boost/bind/bind.hpp>
+#include <boost/thread/thread.hpp>
 
 enum {
 	MIN_PATH_BUFF_SIZE = 16,
-	MAX_PATH_BUFF_SIZE = 4096
+	MAX_PATH_BUFF_SIZE = 4096,
+	STREAM_BUFF_SIZE = 1 << 16,
+	FETCH_PAGE_SIZE = 4096,
+	FETCH_BUFF_SIZE = 1 << 20,
+	// reads of prefetchData() in flight and the most each of them takes
+	PREFETCH_DEPTH = 16,
+	PREFETCH_PIECE_SIZE = 256 << 10,
+	PREFETCH_RESIDENT_SIZE = 64 << 20,
+	// notes walked past by this much are dropped from the mapping
+	NOTES_RELEASE_SIZE = 8 << 20
 };
 
 namespace CoRipper
@@ -37,17 +59,22 @@ namespace CoRipper
 
 typedef struct user_regs_struct regs_t;
 
+BOOST_STATIC_ASSERT(sizeof(prstatus_t) == Elf64Traits::PRSTATUS_SIZE
+	&& offsetof(prstatus_t, pr_reg) == Elf64Traits::PRSTATUS_REGS
+	&& offsetof(regs_t, rsp) == Elf64Traits::REG_SP * sizeof(Elf64_Addr)
+	&& offsetof(regs_t, rip) == Elf64Traits::REG_IP * sizeof(Elf64_Addr));
+
 ////////////////////////////////////////////////////////////////////////////////////////////////////
 // struct Reader
 
-// Reader factory method - opens file and creates ELF descriptor
-Reader::ptr_t Reader::openCoreFile(const char* fname_)
+// Reader factory method - opens file and creates ELF descriptor. Compressed
+// cores are decompressed in one pass the same way as streamed ones.
+Reader::ptr_t Reader::openCoreFile(const char* fname_, size_t scratchLimit_)
 {
 	int fd;
-	Elf* core;
 
 	if ((fd = open(fname_, O_RDONLY, 0)) < 0) {
-		std::cerr << "ERROR: Failed to open file: "
+		Log::error() << "ERROR: Failed to open file: "
 			<< fname_
 			<< ". Reason:"
 			<< strerror(errno)
@@ -55,109 +82,954 @@ Reader::ptr_t Reader::openCoreFile(const char* fname_)
 		return ptr_t();
 	}
 
-	if (elf_version(EV_CURRENT) == EV_NONE
-		|| NULL == (core = elf_begin(fd, ELF_C_READ, NULL)))
+	return openCoreDescriptor(fd, scratchLimit_);
+}
+
+// Reader factory method - takes over opened descriptor. Uncompressed core files are
+// used in place, the rest is read in one pass from the current position. Segments of
+// compressed files left out by the scratch limit are fetched later by another pass.
+Reader::ptr_t Reader::openCoreDescriptor(int fd_, size_t scratchLimit_)
+{
+	char head[SELFMAG];
+	struct stat st;
+	bool regular = fstat(fd_, &st) == 0 && S_ISREG(st.st_mode);
+
+	if (regular
+		&& (pread(fd_, head, sizeof(head), 0) != sizeof(head) || memcmp(head, ELFMAG, SELFMAG) == 0))
+		return openCoreFd(fd_);
+
+	ptr_t r;
+	if (regular && lseek(fd_, 0, SEEK_SET) == 0) {
+		Source::ptr_t source = Source::open(fd_);
+		if (source)
+			r = openCoreSource(source, scratchLimit_, 0, fd_);
+		if (r)
+			return r;
+	}
+	else
+		r = openCoreStream(fd_, scratchLimit_);
+
+	close(fd_);
+	return r;
+}
+
+namespace
+{
+
+////////////////////////////////////////////////////////////////////////////////////////////////////
+// struct Stream - sequential access to non-seekable or compressed core source
+
+struct Stream
+{
+	Stream(const Source::ptr_t& source_, off_t pos_ = 0)
+	: m_source(source_), m_pos(pos_), m_buff(STREAM_BUFF_SIZE)
+	{
+	}
+
+	bool read(void* buff_, size_t size_);
+	bool skip(off_t offset_);
+	bool copy(int dst_, size_t size_);
+
+	off_t getPos() const
+	{
+		return m_pos;
+	}
+
+private:
+	Source::ptr_t m_source;
+	off_t m_pos;
+	std::vector<char> m_buff;
+};
+
+// Read exactly size_ bytes
+bool Stream::read(void* buff_, size_t size_)
+{
+	char* p = reinterpret_cast<char*>(buff_);
+
+	while (size_ > 0) {
+		ssize_t n = m_source->read(p, size_);
+		if (n <= 0)
+			return false;
+		p += n;
+		size_ -= n;
+		m_pos += n;
+	}
+	return true;
+}
+
+// Throw away data up to given offset
+bool Stream::skip(off_t offset_)
+{
+	while (m_pos < offset_) {
+		size_t n = std::min<off_t>(offset_ - m_pos, m_buff.size());
+		if (!read(&m_buff[0], n))
+			return false;
+	}
+	return m_pos == offset_;
+}
+
+// Copy next size_ bytes to the same offset of destination file
+bool Stream::copy(int dst_, size_t size_)
+{
+	while (size_ > 0) {
+		off_t offset = m_pos;
+		size_t n = std::min(size_, m_buff.size());
+		if (!read(&m_buff[0], n))
+			return false;
+		if (pwrite(dst_, &m_buff[0], n, offset) != (ssize_t)n)
+			return false;
+		size_ -= n;
+	}
+	return true;
+}
+
+// Create unlinked temporary file to keep the parts of streamed core
+int openScratchFile()
+{
+	const char* dir = getenv("TMPDIR");
+	if (!dir || !*dir)
+		dir = "/var/tmp";
+
+	int fd = open(dir, O_RDWR | O_TMPFILE | O_EXCL, 0600);
+	if (fd >= 0 || (errno != EOPNOTSUPP && errno != EISDIR && errno != EINVAL))
+		return fd;
+
+	// fallback for file systems without O_TMPFILE support
+	std::string path = std::string(dir) + "/coripper.XXXXXX";
+	std::vector<char> tmpl(path.begin(), path.end());
+	tmpl.push_back('\0');
+	if ((fd = mkstemp(&tmpl[0])) >= 0)
+		unlink(&tmpl[0]);
+	return fd;
+}
+
+// Copy structure of the process out of the data read from the core
+template <class Layout>
+Layout getLayout(const std::vector<char>& data_)
+{
+	Layout l;
+	memcpy(&l, &data_[0], sizeof(l));
+	return l;
+}
+
+template <class Linkmap>
+void setLinkmap(const Linkmap& src_, LinkmapData& dst_)
+{
+	dst_.addr = src_.l_addr;
+	dst_.name = src_.l_name;
+	dst_.next = src_.l_next;
+}
+
+// Stack and instruction pointers from NT_PRSTATUS descriptor of the class. Descriptors
+// are only 4-byte aligned, so registers are copied out.
+template <class Traits>
+bool getNoteRegisters(const char* desc_, size_t size_, GElf_Addr& sp_, GElf_Addr& ip_)
+{
+	typename Traits::Addr regs[Traits::REG_SP + 1];
+
+	if (size_ < Traits::PRSTATUS_SIZE)
+		return false;
+
+	memcpy(regs, desc_ + Traits::PRSTATUS_REGS, sizeof(regs));
+	sp_ = regs[Traits::REG_SP];
+	ip_ = regs[Traits::REG_IP];
+	return true;
+}
+
+// Copy NOTE segment from the stream to the scratch file note by note, so notes of many
+// threads aren't held in memory. Stack pointers of all threads are collected, AUXV and
+// FILE notes are kept for getNoteImages().
+template <class Traits>
+bool copyStreamNotes(Stream& s_, int scratch_, off_t offset_, size_t size_,
+		std::vector<GElf_Addr>& stacks_, std::vector<char>& auxv_, std::vector<char>& file_)
+{
+	std::vector<char> note;
+	size_t pos = 0;
+
+	while (pos < size_) {
+		Elf64_Nhdr nhdr;
+		size_t size = size_ - pos;
+		if (size >= sizeof(nhdr)) {
+			if (!s_.read(&nhdr, sizeof(nhdr)))
+				return false;
+			size = std::min(size, sizeof(nhdr) + (((size_t)nhdr.n_namesz + 3) & ~3)
+					+ (((size_t)nhdr.n_descsz + 3) & ~3));
+			note.assign(reinterpret_cast<char*>(&nhdr), reinterpret_cast<char*>(&nhdr + 1));
+		}
+		else
+			note.clear();
+
+		// a truncated last note is copied as it is
+		size_t got = note.size();
+		note.resize(size);
+		if ((size > got && !s_.read(&note[got], size - got))
+			|| pwrite(scratch_, &note[0], size, offset_ + pos) != (ssize_t)size)
+			return false;
+		pos += size;
+
+		if (got == 0)
+			continue;
+		size_t desc_pos = sizeof(nhdr) + (((size_t)nhdr.n_namesz + 3) & ~3);
+		if (desc_pos + nhdr.n_descsz > size)
+			continue;
+
+		const char* desc = &note[desc_pos];
+		GElf_Addr sp, ip;
+		if (nhdr.n_type == NT_PRSTATUS) {
+			if (getNoteRegisters<Traits>(desc, nhdr.n_descsz, sp, ip))
+				stacks_.push_back(sp);
+		}
+		else if (nhdr.n_type == NT_AUXV)
+			auxv_.assign(desc, desc + nhdr.n_descsz);
+		else if (nhdr.n_type == NT_FILE)
+			file_.assign(desc, desc + nhdr.n_descsz);
+	}
+	return true;
+}
+
+typedef std::pair<GElf_Addr, GElf_Addr> vrange_t;
+
+// Collect address ranges of the executable and the dynamic linker from AUXV and FILE
+// notes: mappings with AT_PHDR, AT_ENTRY and AT_BASE addresses and all other mappings
+// of the same files listed in NT_FILE
+template <class Traits>
+void getNoteImages(const std::vector<char>& auxv_, const std::vector<char>& file_,
+		std::vector<vrange_t>& dst_)
+{
+	typedef typename Traits::Auxv Auxv;
+	typedef typename Traits::Addr Addr;
+
+	std::vector<GElf_Addr> addrs;
+	const char* file = file_.empty() ? NULL : &file_[0];
+	size_t fileSize = file_.size();
+
+	for (size_t i = 0; i + sizeof(Auxv) <= auxv_.size(); i += sizeof(Auxv)) {
+		Auxv a;
+		memcpy(&a, &auxv_[i], sizeof(a));
+		if ((a.a_type == AT_PHDR || a.a_type == AT_ENTRY || a.a_type == AT_BASE)
+			&& a.a_un.a_val != 0)
+			addrs.push_back(a.a_un.a_val);
+	}
+
+	// NT_FILE: count, page size, count of (start, end, offset) and names
+	std::vector<Addr> words;
+	if (fileSize >= 2 * sizeof(Addr)) {
+		Addr head[2];
+		memcpy(head, file, sizeof(head));
+		size_t size = (2 + 3 * (size_t)head[0]) * sizeof(Addr);
+		if (head[0] < fileSize && size <= fileSize) {
+			words.resize(3 * head[0]);
+			if (!words.empty())
+				memcpy(&words[0], file + sizeof(head), words.size() * sizeof(Addr));
+		}
+	}
+	std::vector<const char*> names;
+	const char* name = words.empty() ? NULL : file + (2 + words.size()) * sizeof(Addr);
+	for (size_t i = 0; i < words.size(); i += 3) {
+		const char* end = static_cast<const char*>(memchr(name, 0, file + fileSize - name));
+		if (end == NULL) {
+			words.resize(i);
+			break;
+		}
+		names.push_back(name);
+		name = end + 1;
+	}
+
+	for (size_t a = 0; a < addrs.size(); a++) {
+		const char* image = NULL;
+		for (size_t i = 0; i < names.size() && image == NULL; i++) {
+			if (addrs[a] >= words[3 * i] && addrs[a] < words[3 * i + 1])
+				image = names[i];
+		}
+		if (image == NULL) {
+			dst_.push_back(vrange_t(addrs[a], addrs[a] + 1));
+			continue;
+		}
+		for (size_t i = 0; i < names.size(); i++) {
+			if (strcmp(names[i], image) == 0)
+				dst_.push_back(vrange_t(words[3 * i], words[3 * i + 1]));
+		}
+	}
+}
+
+template <class Phdr>
+struct KeepLess
+{
+	explicit KeepLess(const std::vector<Phdr*>& order_): m_order(order_)
+	{
+	}
+
+	// writable segments first, smaller ones before bigger
+	bool operator()(size_t a_, size_t b_) const
+	{
+		const Phdr& a = *m_order[a_];
+		const Phdr& b = *m_order[b_];
+		if ((a.p_flags & PF_W) != (b.p_flags & PF_W))
+			return a.p_flags & PF_W;
+		return a.p_filesz < b.p_filesz;
+	}
+
+	const std::vector<Phdr*>& m_order;
+};
+
+// Choose loadable segments to keep in the scratch file within its limit. Segments of
+// the executable and the dynamic linker, with their .bss right after them, hold .dynamic
+// and r_debug, so they are taken first. Then come small writable segments, which are
+// likely to hold linkmaps and library names, the rest fills the space left. Stacks, with
+// stack pointers sorted, are kept anyway and are not counted. Returns size of the
+// executable and dynamic linker segments, the caller decides if they fit.
+template <class Phdr>
+size_t planStreamSegments(const std::vector<Phdr*>& order_, const std::vector<GElf_Addr>& stacks_,
+	const std::vector<vrange_t>& images_, size_t scratchLimit_, std::vector<bool>& keep_)
+{
+	std::vector<size_t> rest;
+	size_t used = 0;
+
+	keep_.assign(order_.size(), false);
+	for (size_t ndx = 0; ndx < order_.size(); ndx++) {
+		const Phdr& phdr = *order_[ndx];
+		GElf_Addr end = phdr.p_vaddr + phdr.p_memsz;
+		bool required = false;
+
+		if (phdr.p_type != PT_LOAD)
+			continue;
+
+		std::vector<GElf_Addr>::const_iterator sp =
+			std::lower_bound(stacks_.begin(), stacks_.end(), phdr.p_vaddr);
+		if (sp != stacks_.end() && *sp < phdr.p_vaddr + phdr.p_filesz) {
+			keep_[ndx] = true;
+			continue;
+		}
+
+		for (size_t i = 0; i < images_.size() && !required; i++) {
+			required = (phdr.p_vaddr < images_[i].second && end > images_[i].first)
+				|| phdr.p_vaddr == images_[i].second;
+		}
+		if (required) {
+			keep_[ndx] = true;
+			used += phdr.p_filesz;
+		}
+		else
+			rest.push_back(ndx);
+	}
+
+	size_t required = used;
+	std::stable_sort(rest.begin(), rest.end(), KeepLess<Phdr>(order_));
+	for (size_t i = 0; i < rest.size(); i++) {
+		size_t size = order_[rest[i]]->p_filesz;
+		if (used + size <= scratchLimit_) {
+			used += size;
+			keep_[rest[i]] = true;
+		}
+	}
+	return required;
+}
+
+struct VaddrLess
+{
+	bool operator()(const GElf_Phdr& a_, const GElf_Phdr& b_) const
+	{
+		return a_.p_vaddr < b_.p_vaddr;
+	}
+	bool operator()(GElf_Addr a_, const GElf_Phdr& b_) const
+	{
+		return a_ < b_.p_vaddr;
+	}
+};
+
+struct PhdrOffsetLess
+{
+	bool operator()(const GElf_Phdr& a_, const GElf_Phdr& b_) const
+	{
+		return a_.p_offset < b_.p_offset;
+	}
+	bool operator()(off_t a_, const GElf_Phdr& b_) const
+	{
+		return a_ < (off_t)b_.p_offset;
+	}
+};
+
+template <class Phdr>
+struct OffsetLess
+{
+	bool operator()(const Phdr* a_, const Phdr* b_) const
 	{
-		std::cerr << "ERROR: Failed to start work with elf"
+		return a_->p_offset < b_->p_offset;
+	}
+};
+
+// Pass through streamed core once and keep NOTE, stack segments and as many other
+// PT_LOAD segments as scratch limit allows, see planStreamSegments(). Program headers of skipped segments are
+// rewritten with zero file size, so reader will never look into holes of scratch file.
+// In live mode the stream is left right after NOTE, all program headers are kept and
+// scratch file gets the size of the whole core, its holes are filled on demand. With
+// refetch_ skipped segments keep their headers the same way and are returned in holes_.
+template <class Traits>
+bool doStreamCore(Stream& s_, const unsigned char* ident_, int scratch_, size_t scratchLimit_,
+	bool live_, bool refetch_, std::vector<Reader::range_t>& holes_)
+{
+	typedef typename Traits::Ehdr Ehdr;
+	typedef typename Traits::Phdr Phdr;
+	typedef typename Traits::Shdr Shdr;
+
+	Ehdr ehdr;
+	char* p = reinterpret_cast<char*>(&ehdr);
+
+	memcpy(p, ident_, EI_NIDENT);
+	if (!s_.read(p + EI_NIDENT, sizeof(ehdr) - EI_NIDENT))
+		return false;
+
+	if (ehdr.e_phentsize != sizeof(Phdr) || ehdr.e_phoff < sizeof(ehdr))
+		return false;
+
+	std::vector<Phdr> phdrs(ehdr.e_phnum);
+	if (!s_.skip(ehdr.e_phoff))
+		return false;
+
+	if (ehdr.e_phnum == PN_XNUM) {
+		// real number of program headers is kept in the section header at the end of
+		// the core, so read headers up to the beginning of the data they describe
+		off_t data = std::numeric_limits<off_t>::max();
+		phdrs.clear();
+		while (s_.getPos() < data) {
+			Phdr phdr;
+			if (!s_.read(&phdr, sizeof(phdr)))
+				return false;
+			if (phdr.p_filesz > 0 && (off_t)phdr.p_offset < data)
+				data = phdr.p_offset;
+			phdrs.push_back(phdr);
+		}
+	}
+	else if (phdrs.empty() || !s_.read(&phdrs[0], phdrs.size() * sizeof(Phdr)))
+		return false;
+
+	size_t phsize = phdrs.size() * sizeof(Phdr);
+
+	std::vector<Phdr*> order;
+	for (size_t ndx = 0; ndx < phdrs.size(); ndx++) {
+		if (phdrs[ndx].p_filesz > 0)
+			order.push_back(&phdrs[ndx]);
+	}
+	std::sort(order.begin(), order.end(), OffsetLess<Phdr>());
+
+	std::vector<GElf_Addr> stacks;
+	std::vector<bool> keep;
+	size_t used = 0;
+	off_t end = 0;
+	for (size_t ndx = 0; ndx < order.size(); ndx++) {
+		Phdr& phdr = *order[ndx];
+
+		if (live_) {
+			end = std::max<off_t>(end, phdr.p_offset + phdr.p_filesz);
+			if (phdr.p_type != PT_NOTE)
+				continue;
+		}
+
+		if ((off_t)phdr.p_offset < s_.getPos() || !s_.skip(phdr.p_offset))
+			return false;
+
+		if (phdr.p_type == PT_NOTE) {
+			std::vector<char> auxv, file;
+			if (!copyStreamNotes<Traits>(s_, scratch_, phdr.p_offset, phdr.p_filesz, stacks, auxv, file))
+				return false;
+			std::sort(stacks.begin(), stacks.end());
+			if (live_)
+				continue;
+
+			// plan only if NOTE comes before loadable segments as the kernel puts it,
+			// required segments beyond the limit are fine if they can be fetched later
+			std::vector<vrange_t> images;
+			getNoteImages<Traits>(auxv, file, images);
+			size_t required = ndx == 0
+				? planStreamSegments(order, stacks, images, scratchLimit_, keep) : 0;
+			if (required > scratchLimit_ && !refetch_) {
+				Log::error() << "ERROR: Scratch limit of "
+					<< scratchLimit_
+					<< " bytes is less than "
+					<< required
+					<< " bytes of the executable and dynamic linker segments, raise the limit"
+					<< std::endl;
+				return false;
+			}
+			if (required > scratchLimit_)
+				keep.assign(keep.size(), false);
+			continue;
+		}
+
+		if (phdr.p_type != PT_LOAD)
+			continue;
+
+		// stack segment: keep everything from the lowest aligned stack pointer up to the end
+		GElf_Addr begin = phdr.p_vaddr + phdr.p_filesz;
+		std::vector<GElf_Addr>::const_iterator sp =
+			std::lower_bound(stacks.begin(), stacks.end(), phdr.p_vaddr);
+		if (sp != stacks.end() && *sp < begin)
+			begin = *sp;
+		if (begin < phdr.p_vaddr + phdr.p_filesz) {
+			if (phdr.p_align > 1)
+				begin = begin / phdr.p_align * phdr.p_align;
+
+			size_t delta = begin - phdr.p_vaddr;
+			phdr.p_vaddr += delta;
+			phdr.p_offset += delta;
+			phdr.p_filesz -= delta;
+			phdr.p_memsz -= std::min<size_t>(phdr.p_memsz, delta);
+		}
+		// without the plan segments are taken in order while they fit
+		else if (keep.empty() ? used + phdr.p_filesz <= scratchLimit_ : keep[ndx])
+			used += phdr.p_filesz;
+		else {
+			holes_.push_back(Reader::range_t(phdr.p_offset, phdr.p_filesz));
+			if (refetch_)
+				end = std::max<off_t>(end, phdr.p_offset + phdr.p_filesz);
+			else
+				phdr.p_filesz = 0;
+			continue;
+		}
+
+		if (!s_.skip(phdr.p_offset) || !s_.copy(scratch_, phdr.p_filesz))
+			return false;
+	}
+
+	end = std::max(end, s_.getPos());
+	if ((live_ || refetch_) && ftruncate(scratch_, end) != 0)
+		return false;
+
+	// section header is not read from the stream, put new one after the data kept
+	Shdr shdr;
+	memset(&shdr, 0, sizeof(shdr));
+	ehdr.e_shoff = 0;
+	ehdr.e_shnum = 0;
+	ehdr.e_shstrndx = SHN_UNDEF;
+	if (phdrs.size() >= PN_XNUM) {
+		shdr.sh_type = SHT_NULL;
+		shdr.sh_size = 1;
+		shdr.sh_info = phdrs.size();
+		ehdr.e_shoff = (end + sizeof(shdr) - 1) / sizeof(shdr) * sizeof(shdr);
+		ehdr.e_shentsize = sizeof(shdr);
+		ehdr.e_shnum = 1;
+		if (pwrite(scratch_, &shdr, sizeof(shdr), ehdr.e_shoff) != sizeof(shdr))
+			return false;
+	}
+
+	return pwrite(scratch_, &ehdr, sizeof(ehdr), 0) == sizeof(ehdr)
+		&& pwrite(scratch_, &phdrs[0], phsize, ehdr.e_phoff) == (ssize_t)phsize;
+}
+
+} // namespace
+
+// Reader factory method - reads core from non-seekable descriptor in one pass and keeps
+// only the data required to build stripped core in scratch file
+Reader::ptr_t Reader::openCoreStream(int fd_, size_t scratchLimit_, pid_t pid_)
+{
+	Source::ptr_t source = Source::open(fd_);
+	if (!source)
+		return ptr_t();
+
+	return openCoreSource(source, scratchLimit_, pid_);
+}
+
+// Reader factory method - core in memory of the caller is read in one pass the same
+// way as a streamed one, so it may be compressed too
+Reader::ptr_t Reader::openCoreBuffer(const char* buff_, size_t size_, size_t scratchLimit_)
+{
+	Source::ptr_t source = Source::open(buff_, size_);
+	if (!source)
+		return ptr_t();
+
+	return openCoreSource(source, scratchLimit_, 0);
+}
+
+Reader::ptr_t Reader::openCoreSource(const Source::ptr_t& source_, size_t scratchLimit_, pid_t pid_,
+	int refetch_)
+{
+	int scratch;
+
+	if ((scratch = openScratchFile()) < 0) {
+		Log::error() << "ERROR: Failed to create scratch file. Reason:"
+			<< strerror(errno)
+			<< std::endl;
+		return ptr_t();
+	}
+
+	Stream s(source_);
+	unsigned char ident[EI_NIDENT];
+	std::vector<range_t> holes;
+	bool refetch = refetch_ >= 0;
+	bool res = false;
+
+	if (s.read(ident, EI_NIDENT) && memcmp(ident, ELFMAG, SELFMAG) == 0) {
+		if (ident[EI_CLASS] == ELFCLASS32)
+			res = doStreamCore<Elf32Traits>(s, ident, scratch, scratchLimit_, pid_ > 0, refetch, holes);
+		else if (ident[EI_CLASS] == ELFCLASS64)
+			res = doStreamCore<Elf64Traits>(s, ident, scratch, scratchLimit_, pid_ > 0, refetch, holes);
+	}
+
+	if (!res) {
+		Log::error() << "ERROR: Failed to read core from stream at offset "
+			<< s.getPos()
 			<< std::endl;
+		close(scratch);
+		return ptr_t();
+	}
 
-		close(fd);
+	ptr_t r = openCoreFd(scratch);
+	if (!r)
+		return r;
+
+	if (pid_ > 0)
+		r->setLive(pid_);
+	else if (refetch)
+		r->setRefetch(refetch_, holes);
+	else {
+		for (size_t i = 0; i < holes.size(); i++)
+			r->m_skipped += holes[i].second;
+		r->m_scratchLimit = scratchLimit_;
+	}
+	return r;
+}
+
+// Reader factory method - core of running process made up of head_ (headers and
+// notes) and loadable segments which are fetched from the process on demand
+Reader::ptr_t Reader::openProcess(const std::vector<char>& head_, off_t size_, pid_t pid_)
+{
+	int scratch;
+
+	if ((scratch = openScratchFile()) < 0) {
+		Log::error() << "ERROR: Failed to create scratch file. Reason:"
+			<< strerror(errno)
+			<< std::endl;
 		return ptr_t();
 	}
 
-	return ptr_t(new Reader(fd, core));
+	if (pwrite(scratch, &head_[0], head_.size(), 0) != (ssize_t)head_.size()
+		|| ftruncate(scratch, size_) != 0) {
+		Log::error() << "ERROR: Failed to write scratch file. Reason:"
+			<< strerror(errno)
+			<< std::endl;
+		close(scratch);
+		return ptr_t();
+	}
+
+	ptr_t r = openCoreFd(scratch);
+	if (r)
+		r->setLive(pid_);
+	return r;
 }
 
-Reader::~Reader()
+void Reader::setLive(pid_t pid_)
 {
-	elf_end(m_core);
-	close(m_fd);
+	m_pid = pid_;
+	initFetched(false);
 }
 
-// Read ELF headr
-GElf_Ehdr* Reader::getEhdr(GElf_Ehdr& dst_)
+// Compressed file source_ is read again for the data of skipped segments
+void Reader::setRefetch(int source_, const std::vector<range_t>& holes_)
 {
-	return gelf_getehdr(m_core, &dst_);
+	m_source = source_;
+	initFetched(true);
+
+	for (size_t i = 0; i < holes_.size(); i++) {
+		size_t first = holes_[i].first / FETCH_PAGE_SIZE;
+		size_t last = (holes_[i].first + holes_[i].second + FETCH_PAGE_SIZE - 1) / FETCH_PAGE_SIZE;
+		for (size_t page = first; page < last && page < m_fetched.size(); page++)
+			m_fetched[page] = false;
+	}
 }
 
-// Locate and return NOTE program header
-GElf_Phdr* Reader::findNotePhdr(GElf_Phdr& dst_)
+void Reader::initFetched(bool fetched_)
+{
+	struct stat st;
+
+	// empty segments share offset with the next one and would hide it from lookups
+	m_loadsByOffset.clear();
+	for (size_t i = 0; i < m_loads.size(); i++) {
+		if (m_loads[i].p_filesz > 0)
+			m_loadsByOffset.push_back(m_loads[i]);
+	}
+	std::sort(m_loadsByOffset.begin(), m_loadsByOffset.end(), PhdrOffsetLess());
+
+	if (fstat(m_fd, &st) == 0)
+		m_fetched.assign((st.st_size + FETCH_PAGE_SIZE - 1) / FETCH_PAGE_SIZE, fetched_);
+}
+
+// Create ELF descriptor for already opened core file. The file is mapped once, so
+// elf_getdata_rawchunk() returns views into the mapping instead of heap copies.
+// Descriptors which can't be mapped are read with plain ELF_C_READ.
+Reader::ptr_t Reader::openCoreFd(int fd_)
+{
+	Elf* core = NULL;
+	char* image = NULL;
+	struct stat st;
+
+	if (elf_version(EV_CURRENT) == EV_NONE) {
+		Log::error() << "ERROR: Failed to start work with elf"
+			<< std::endl;
+
+		close(fd_);
+		return ptr_t();
+	}
+
+	if (fstat(fd_, &st) == 0 && S_ISREG(st.st_mode) && st.st_size > 0) {
+		// writable private mapping is required by elf_memory(), pages are never written
+		void* p = mmap(NULL, st.st_size, PROT_READ | PROT_WRITE,
+				MAP_PRIVATE | MAP_NORESERVE, fd_, 0);
+		if (p != MAP_FAILED) {
+			image = reinterpret_cast<char*>(p);
+			if (NULL == (core = elf_memory(image, st.st_size))) {
+				munmap(image, st.st_size);
+				image = NULL;
+			}
+		}
+	}
+
+	if (NULL == core && NULL == (core = elf_begin(fd_, ELF_C_READ, NULL))) {
+		Log::error() << "ERROR: Failed to start work with elf"
+			<< std::endl;
+
+		close(fd_);
+		return ptr_t();
+	}
+
+	ptr_t r(new Reader(fd_, core, image, image ? st.st_size : 0));
+	if (!r->indexLoads()) {
+		Log::error() << "ERROR: Failed to read program headers"
+			<< std::endl;
+		return ptr_t();
+	}
+
+	return r;
+}
+
+namespace
 {
-	size_t phnum, ndx;
 
-	if (0 != elf_getphdrnum(m_core, &phnum))
+template <class Traits>
+bool doIndexLoads(Elf* core_, std::vector<GElf_Phdr>& dst_)
+{
+	typename Traits::Phdr* phdrs;
+	size_t phnum;
+
+	if (0 != elf_getphdrnum(core_, &phnum) || NULL == (phdrs = Traits::getPhdrs(core_)))
+		return false;
+
+	dst_.clear();
+	dst_.reserve(phnum);
+	for (size_t ndx = 0; ndx < phnum; ndx++) {
+		if (phdrs[ndx].p_type != PT_LOAD)
+			continue;
+
+		GElf_Phdr phdr;
+		copyPhdr(phdrs[ndx], phdr);
+		dst_.push_back(phdr);
+	}
+
+	std::sort(dst_.begin(), dst_.end(), VaddrLess());
+	return true;
+}
+
+template <class Traits>
+GElf_Phdr* doFindPhdrByType(Elf* core_, unsigned type_, GElf_Phdr& dst_)
+{
+	typename Traits::Phdr* phdrs;
+	size_t phnum;
+
+	if (0 != elf_getphdrnum(core_, &phnum) || NULL == (phdrs = Traits::getPhdrs(core_)))
 		return NULL;
 
-	for (ndx = 0; ndx < phnum; ndx++) {
-		if (gelf_getphdr(m_core, ndx, &dst_) != &dst_)
-			return NULL;
+	for (size_t ndx = 0; ndx < phnum; ndx++) {
+		if (phdrs[ndx].p_type == type_) {
+			copyPhdr(phdrs[ndx], dst_);
+			return &dst_;
+		}
+	}
+	return NULL;
+}
+
+template <class Traits>
+GElf_auxv_t* doFindAuxvByType(Elf_Data *auxvData_, unsigned type_, GElf_auxv_t& dst_)
+{
+	const typename Traits::Auxv* auxv = (const typename Traits::Auxv*) auxvData_->d_buf;
+	size_t num = auxvData_->d_size / sizeof(*auxv);
 
-		if (dst_.p_type == PT_NOTE)
+	for (size_t ndx = 0; ndx < num; ndx++) {
+		if (auxv[ndx].a_type == type_) {
+			dst_.a_type = auxv[ndx].a_type;
+			dst_.a_un.a_val = auxv[ndx].a_un.a_val;
 			return &dst_;
+		}
 	}
+	return NULL;
+}
 
+template <class Traits>
+GElf_Dyn* doFindDynByTag(Elf_Data* data_, GElf_Sxword tag_, GElf_Dyn& dst_)
+{
+	const typename Traits::Dyn* dyn = (const typename Traits::Dyn*) data_->d_buf;
+	size_t num = data_->d_size / sizeof(*dyn);
+
+	for (size_t ndx = 0; ndx < num; ndx++) {
+		if (dyn[ndx].d_tag == tag_) {
+			dst_.d_tag = dyn[ndx].d_tag;
+			dst_.d_un.d_val = dyn[ndx].d_un.d_val;
+			return &dst_;
+		}
+	}
+	return NULL;
+}
+
+template <class Traits>
+GElf_Phdr* doFindExecPhdrByType(Elf_Data *phdrData_, unsigned type_, GElf_Phdr& dst_)
+{
+	const typename Traits::Phdr* phdrs = (const typename Traits::Phdr*) phdrData_->d_buf;
+	size_t phnum = phdrData_->d_size / sizeof(*phdrs);
+
+	for (size_t ndx = 0; ndx < phnum; ndx++) {
+		if (phdrs[ndx].p_type == type_) {
+			copyPhdr(phdrs[ndx], dst_);
+			return &dst_;
+		}
+	}
 	return NULL;
 }
 
+} // namespace
+
+// Build sorted index of loadable segments for address lookups
+bool Reader::indexLoads()
+{
+	if (m_class == ELFCLASS32)
+		return doIndexLoads<Elf32Traits>(m_core, m_loads);
+	return doIndexLoads<Elf64Traits>(m_core, m_loads);
+}
+
+Reader::~Reader()
+{
+	elf_end(m_core);
+	if (m_image)
+		munmap(m_image, m_size);
+	close(m_fd);
+	if (m_source >= 0)
+		close(m_source);
+}
+
+// Read ELF headr
+GElf_Ehdr* Reader::getEhdr(GElf_Ehdr& dst_)
+{
+	return gelf_getehdr(m_core, &dst_);
+}
+
+// Locate and return NOTE program header
+GElf_Phdr* Reader::findNotePhdr(GElf_Phdr& dst_)
+{
+	m_stats.phdrLookups++;
+	if (m_class == ELFCLASS32)
+		return doFindPhdrByType<Elf32Traits>(m_core, PT_NOTE, dst_);
+	return doFindPhdrByType<Elf64Traits>(m_core, PT_NOTE, dst_);
+}
+
 // Read NOTE data
 Elf_Data* Reader::getNoteData(const GElf_Phdr& phdr_)
 {
-	return elf_getdata_rawchunk(m_core, phdr_.p_offset, phdr_.p_filesz, ELF_T_NHDR);
+	return getRawChunk(phdr_.p_offset, phdr_.p_filesz, ELF_T_NHDR);
 }
 
-// Read AUXV data
-Elf_Data* Reader::getAuxvData(const GElf_Phdr& phdr_, Elf_Data* noteData_)
+// Walk through NOTE data once and remember location of notes we are interested in.
+// Per-thread notes follow thread's NT_PRSTATUS, process-wide ones may appear anywhere.
+bool Reader::indexNotes(Elf_Data* noteData_, NoteIndex& dst_)
 {
 	GElf_Nhdr nhdr;
 	size_t name_pos, desc_pos;
-	size_t pos = 0;
+	size_t pos = 0, next;
 
-	while ((pos = gelf_getnote(noteData_, pos, &nhdr,
-	                           &name_pos, &desc_pos)) > 0)
+	dst_ = NoteIndex();
+	for (; (next = gelf_getnote(noteData_, pos, &nhdr,
+	                            &name_pos, &desc_pos)) > 0; pos = next)
 	{
-		if (nhdr.n_type == NT_AUXV)
-			return elf_getdata_rawchunk(m_core,
-					phdr_.p_offset+ desc_pos,
-					nhdr.n_descsz,
-					ELF_T_AUXV);
+		releaseNotes(noteData_, pos);
+
+		NoteEntry e;
+		e.type = nhdr.n_type;
+		e.pos = pos;
+		e.size = next - pos;
+		e.descPos = desc_pos;
+		e.descSize = nhdr.n_descsz;
+
+		switch (nhdr.n_type) {
+		case NT_PRSTATUS:
+			dst_.threads.push_back(NoteIndex::Thread());
+			dst_.threads.back().prstatus = e;
+			break;
+		case NT_PRPSINFO:
+			dst_.prpsinfo = e;
+			break;
+		case NT_AUXV:
+			dst_.auxv = e;
+			break;
+		case NT_FILE:
+			dst_.file = e;
+			break;
+		case NT_SIGINFO:
+			dst_.siginfo = e;
+			break;
+		default:
+			if (!dst_.threads.empty())
+				dst_.threads.back().regsets.push_back(e);
+			else
+				dst_.other.push_back(e);
+		}
 	}
-	return NULL;
+
+	return !dst_.threads.empty();
 }
 
-// Locate and return AUXV with given type
-GElf_auxv_t* Reader::findAuxvByType(Elf_Data *auxvData_, unsigned type_, GElf_auxv_t& dst_)
+// Read AUXV data
+Elf_Data* Reader::getAuxvData(const GElf_Phdr& phdr_, const NoteEntry& auxv_)
 {
-	size_t ndx = 0;
+	if (auxv_.empty())
+		return NULL;
 
-	while(gelf_getauxv(auxvData_, ndx++, &dst_)) {
-		if (dst_.a_type == type_)
-			return &dst_;
-	}
+	return getRawChunk(phdr_.p_offset + auxv_.descPos, auxv_.descSize, ELF_T_AUXV);
+}
 
-	return NULL;
+// Locate and return AUXV with given type
+GElf_auxv_t* Reader::findAuxvByType(Elf_Data *auxvData_, unsigned type_, GElf_auxv_t& dst_)
+{
+	if (m_class == ELFCLASS32)
+		return doFindAuxvByType<Elf32Traits>(auxvData_, type_, dst_);
+	return doFindAuxvByType<Elf64Traits>(auxvData_, type_, dst_);
 }
 
 // Locate and return program header corresponding given virtual address
 GElf_Phdr* Reader::findPhdrByVaddr(GElf_Addr vaddr_, GElf_Phdr& dst_)
 {
-	size_t phnum, ndx;
+	m_stats.phdrLookups++;
+	std::vector<GElf_Phdr>::const_iterator it =
+		std::upper_bound(m_loads.begin(), m_loads.end(), vaddr_, VaddrLess());
 
-	if (0 != elf_getphdrnum(m_core, &phnum))
+	if (it == m_loads.begin())
 		return NULL;
 
-	for (ndx = 0; ndx < phnum; ndx++) {
-		GElf_Phdr phdr;
+	--it;
+	if (vaddr_ >= it->p_vaddr + it->p_filesz)
+		return NULL;
 
-		if (gelf_getphdr(m_core, ndx, &phdr) != &phdr)
-			return NULL;
+	dst_ = *it;
+	return &dst_;
+}
 
-		if (vaddr_ >= phdr.p_vaddr && vaddr_ < phdr.p_vaddr + phdr.p_filesz) {
-			memcpy(&dst_, &phdr, sizeof(GElf_Phdr));
-			return &dst_;
-		}
-	}
+// Check if given address belongs to executable mapping
+bool Reader::isCodeAddress(GElf_Addr vaddr_)
+{
+	m_stats.phdrLookups++;
+	std::vector<GElf_Phdr>::const_iterator it =
+		std::upper_bound(m_loads.begin(), m_loads.end(), vaddr_, VaddrLess());
 
-	return NULL;
+	if (it == m_loads.begin())
+		return false;
+
+	--it;
+	return vaddr_ < it->p_vaddr + it->p_memsz && (it->p_flags & PF_X);
 }
 
 // Retrun offset in file corresponding given virtual address
@@ -175,18 +1047,18 @@ off_t Reader::findOffsetByVaddr(GElf_Addr vaddr_)
 Elf_Data* Reader::getDynData(GElf_Phdr& phdr_)
 {
 	off_t offset = findOffsetByVaddr(phdr_.p_vaddr);
-	return elf_getdata_rawchunk(m_core, offset, phdr_.p_filesz, ELF_T_DYN);
+	if (!fetchData(offset, phdr_.p_filesz))
+		return NULL;
+
+	return getRawChunk(offset, phdr_.p_filesz, ELF_T_DYN);
 }
 
 // Locate and return dynamic unit with given type
 GElf_Dyn* Reader::findDynByTag(Elf_Data* data_, GElf_Sxword tag_, GElf_Dyn& dst_)
 {
-	size_t ndx = 0;
-	while(gelf_getdyn(data_, ndx++, &dst_)) {
-		if (dst_.d_tag == tag_)
-			return &dst_;
-	}
-	return NULL;
+	if (m_class == ELFCLASS32)
+		return doFindDynByTag<Elf32Traits>(data_, tag_, dst_);
+	return doFindDynByTag<Elf64Traits>(data_, tag_, dst_);
 }
 
 // Return program headers data from executable segment
@@ -206,51 +1078,31 @@ Elf_Data* Reader::getExecPhdrData(Elf_Data* auxvData_)
 
 	offset = findOffsetByVaddr(phoff.a_un.a_val);
 	size = phnum.a_un.a_val * phsize.a_un.a_val;
+	if (!fetchData(offset, size))
+		return NULL;
 
-	return elf_getdata_rawchunk(m_core, offset, size, ELF_T_PHDR);
+	return getRawChunk(offset, size, ELF_T_PHDR);
 }
 
-namespace
-{
-
-template <class Src, class Dst>
-void copyPhdr(const Src& src_, Dst& dst_)
+// Locate executable's program header in given data with given type
+GElf_Phdr* Reader::findExecPhdrByType(Elf_Data *phdrData_, unsigned type_, GElf_Phdr& dst_)
 {
-	dst_.p_type = src_.p_type;
-	dst_.p_offset = src_.p_offset;
-	dst_.p_vaddr = src_.p_vaddr;
-	dst_.p_paddr = src_.p_paddr;
-	dst_.p_filesz = src_.p_filesz;
-	dst_.p_memsz = src_.p_memsz;
-	dst_.p_flags = src_.p_flags;
-	dst_.p_align = src_.p_align;
+	m_stats.phdrLookups++;
+	if (m_class == ELFCLASS32)
+		return doFindExecPhdrByType<Elf32Traits>(phdrData_, type_, dst_);
+	return doFindExecPhdrByType<Elf64Traits>(phdrData_, type_, dst_);
 }
 
-template <class T>
-GElf_Phdr* doFindExecPhderByType(Elf_Data *phdrData_, unsigned type_, GElf_Phdr& dst_)
+// Read process memory range, which must be contained in one segment
+bool Reader::readMemory(GElf_Addr vaddr_, void* buff_, size_t size_, bool mapped_)
 {
-	T* phdrArray = (T*) phdrData_->d_buf;
-	size_t phnum = phdrData_->d_size / sizeof(T);
-	for (size_t ndx = 0; ndx < phnum; ndx++) {
-		if (phdrArray[ndx].p_type == type_) {
-			copyPhdr(phdrArray[ndx], dst_);
-			return &dst_;
-		}
-	}
-	return NULL;
-}
-
-} // namespace
+	GElf_Phdr phdr;
 
-// Locate executable's program header in given data with given type 
-GElf_Phdr* Reader::findExecPhdrByType(Elf_Data *phdrData_, unsigned type_, GElf_Phdr& dst_)
-{
-	char* id = elf_getident(m_core, NULL);
+	if (!findPhdrByVaddr(vaddr_, phdr) || vaddr_ + size_ > phdr.p_vaddr + phdr.p_filesz)
+		return false;
 
-	if (id && id[EI_CLASS] == ELFCLASS32)
-		return doFindExecPhderByType<Elf32_Phdr>(phdrData_, type_, dst_);
-	else
-		return doFindExecPhderByType<Elf64_Phdr>(phdrData_, type_, dst_);
+	off_t offset = phdr.p_offset + (vaddr_ - phdr.p_vaddr);
+	return readCoreData(buff_, size_, offset, mapped_) == (ssize_t)size_;
 }
 
 // Read C string
@@ -278,83 +1130,441 @@ bool Reader::getString(GElf_Addr vaddr_, std::vector<char>& buf_)
 }
 
 // Read rdebug structure
-rdebug_t* Reader::getRDebug(GElf_Dyn& dyn_, rdebug_t& rdebug_)
+RDebugData* Reader::getRDebug(GElf_Dyn& dyn_, RDebugData& rdebug_)
 {
 	off_t offset;
+	bool is32 = m_class == ELFCLASS32;
 
 	if ((offset = findOffsetByVaddr(dyn_.d_un.d_ptr)) < 0)
 		return NULL;
 
-	if (readCoreData(&rdebug_, sizeof(rdebug_t), offset) == sizeof(rdebug_t))
-		return &rdebug_;
+	rdebug_.data.resize(is32 ? sizeof(Elf32Traits::RDebug) : sizeof(Elf64Traits::RDebug));
+	if (readCoreData(&rdebug_.data[0], rdebug_.data.size(), offset) != (ssize_t)rdebug_.data.size())
+		return NULL;
 
-	return NULL;
+	rdebug_.map = is32 ? getLayout<Elf32Traits::RDebug>(rdebug_.data).r_map
+		: getLayout<Elf64Traits::RDebug>(rdebug_.data).r_map;
+	return &rdebug_;
 }
 
 // Read linkmap structure
-linkmap_t* Reader::getLinkmap(GElf_Addr vaddr_, linkmap_t& lmap_)
+LinkmapData* Reader::getLinkmap(GElf_Addr vaddr_, LinkmapData& lmap_)
 {
 	off_t offset = findOffsetByVaddr(vaddr_);
+	bool is32 = m_class == ELFCLASS32;
 
 	if (offset < 0)
 		return NULL;
 
-	if (readCoreData(&lmap_, sizeof(linkmap_t), offset) == sizeof(linkmap_t))
-		return &lmap_;
+	lmap_.data.resize(is32 ? sizeof(Elf32Traits::Linkmap) : sizeof(Elf64Traits::Linkmap));
+	if (readCoreData(&lmap_.data[0], lmap_.data.size(), offset) != (ssize_t)lmap_.data.size())
+		return NULL;
 
-	return NULL;
+	if (is32)
+		setLinkmap(getLayout<Elf32Traits::Linkmap>(lmap_.data), lmap_);
+	else
+		setLinkmap(getLayout<Elf64Traits::Linkmap>(lmap_.data), lmap_);
+	return &lmap_;
 }
 
 // Read data from given offset
-ssize_t Reader::readCoreData(void* buff_, size_t size_, off_t offset_)
+ssize_t Reader::readCoreData(void* buff_, size_t size_, off_t offset_, bool mapped_)
 {
-	if (!buff_)
+	if (!buff_ || !fetchData(offset_, size_))
 		return -1;
 
-	return pread(m_fd, buff_, size_, offset_);
+	m_stats.readCalls++;
+	if (!m_image || !mapped_) {
+		ssize_t n = pread(m_fd, buff_, size_, offset_);
+		if (n > 0)
+			m_stats.readBytes += n;
+		return n;
+	}
+
+	if (offset_ < 0 || (size_t)offset_ >= m_size)
+		return 0;
+
+	size_t size = std::min(size_, m_size - offset_);
+	memcpy(buff_, m_image + offset_, size);
+	m_stats.readBytes += size;
+	return size;
 }
 
-// Iterate through NOTE data fron given offset and return next prstatus structure
-size_t Reader::getNextPrStatus(Elf_Data* notes_, size_t pos_, prstatus_t& prs_)
+Elf_Data* Reader::getRawChunk(off_t offset_, size_t size_, Elf_Type type_)
 {
-	GElf_Nhdr nhdr;
-	size_t name_pos, desc_pos;
+	Elf_Data* d = elf_getdata_rawchunk(m_core, offset_, size_, type_);
 
-	while((pos_ = gelf_getnote(notes_, pos_, &nhdr, &name_pos, &desc_pos)) > 0) {
-		if (nhdr.n_type != NT_PRSTATUS)
-			continue;
+	m_stats.chunkCalls++;
+	if (d != NULL)
+		m_stats.chunkBytes += d->d_size;
+	return d;
+}
 
-		memcpy(&prs_, (char *)notes_->d_buf + desc_pos, sizeof(prs_));
-		break;
-	}
+// Take stack and instruction pointers from prstatus note of the core class
+bool Reader::getRegisters(Elf_Data* notes_, const NoteEntry& prstatus_, GElf_Addr& sp_, GElf_Addr& ip_)
+{
+	const char* desc = (char *)notes_->d_buf + prstatus_.descPos;
 
-	return pos_;
+	if (prstatus_.type != NT_PRSTATUS)
+		return false;
+
+	releaseNotes(notes_, prstatus_.descPos);
+	return m_class == ELFCLASS32 ? getNoteRegisters<Elf32Traits>(desc, prstatus_.descSize, sp_, ip_)
+		: getNoteRegisters<Elf64Traits>(desc, prstatus_.descSize, sp_, ip_);
 }
 
-// Return RSP register from prstatus structure
-GElf_Addr Reader::getStack(const prstatus_t& prs_)
+// Notes are walked thread by thread several times, a core of many threads has notes of
+// hundreds of megabytes. Mapped pages well behind the walk are dropped, so they don't
+// stay in RSS; they are never written and come back from the page cache if needed.
+void Reader::releaseNotes(Elf_Data* notes_, size_t pos_)
 {
-	return ((regs_t*) &(prs_.pr_reg))->rsp;
+	char* p = static_cast<char*>(notes_->d_buf) + pos_;
+	if (!m_image || p < m_image || p >= m_image + m_size)
+		return;
+
+	const size_t page = sysconf(_SC_PAGESIZE);
+	char* end = m_image + ((p - m_image) & ~(page - 1));
+	if (!m_released || end < m_released) {
+		// the first or a new walk
+		m_released = end;
+		return;
+	}
+	if ((size_t)(end - m_released) < NOTES_RELEASE_SIZE)
+		return;
+
+	madvise(m_released, end - m_released, MADV_DONTNEED);
+	m_released = end;
 }
 
-// Read stack segment
-Elf_Data* Reader::getStackData(const prstatus_t& prs_, GElf_Addr& vaddr_dst_)
+// Locate stack segment data in core file, the data itself is not read. If set, limit_
+// is the number of innermost bytes kept above stack pointer and maxSize_ is the
+// maximum size of the whole segment.
+bool Reader::getStackRange(Elf_Data* notes_, const NoteEntry& prstatus_, GElf_Addr& vaddr_dst_,
+		off_t& offset_dst_, size_t& size_dst_, size_t limit_, size_t maxSize_)
 {
 	GElf_Phdr phdr;
-	GElf_Addr vaddr = getStack(prs_);
+	GElf_Addr rsp, rip;
 
-	if (!findPhdrByVaddr(vaddr, phdr))
-		return NULL;
+	if (!getRegisters(notes_, prstatus_, rsp, rip))
+		return false;
+
+	if (!findPhdrByVaddr(rsp, phdr))
+		return false;
 
 	// let's align stack pointer and take this as segment begin address
-	vaddr = vaddr / phdr.p_align * phdr.p_align; // align
+	GElf_Addr vaddr = rsp / phdr.p_align * phdr.p_align; // align
 
 	off_t offset = phdr.p_offset + (vaddr - phdr.p_vaddr);
 	size_t size = phdr.p_filesz - (vaddr - phdr.p_vaddr);
 
+	if (limit_ > 0 && limit_ + (rsp - vaddr) < size)
+		size = limit_ + (rsp - vaddr);
+	if (maxSize_ > 0 && maxSize_ < size)
+		size = maxSize_;
+
 	vaddr_dst_ = vaddr;
+	offset_dst_ = offset;
+	size_dst_ = size;
+	return true;
+}
+
+bool Reader::fetchData(off_t offset_, size_t size_)
+{
+	if (m_fetched.empty() || offset_ < 0 || size_ == 0)
+		return true;
+
+	off_t end = offset_ + size_;
+	std::vector<GElf_Phdr>::const_iterator it = std::upper_bound(m_loadsByOffset.begin(),
+			m_loadsByOffset.end(), offset_, PhdrOffsetLess());
+
+	if (it != m_loadsByOffset.begin())
+		--it;
+
+	for (; it != m_loadsByOffset.end() && (off_t)it->p_offset < end; ++it) {
+		off_t begin = std::max<off_t>(offset_, it->p_offset);
+		off_t last = std::min<off_t>(end, it->p_offset + it->p_filesz);
+
+		if (begin < last && !fetchPages(*it, begin, last))
+			return false;
+	}
+	return true;
+}
+
+namespace
+{
+
+// Reads of Reader::prefetchData() shared by its threads, each takes the next one
+struct Prefetch
+{
+	Prefetch(int fd_, const std::vector<Reader::range_t>& pieces_)
+	: m_fd(fd_), m_pieces(pieces_), m_next(0), m_calls(0), m_bytes(0)
+	{
+	}
+
+	void run()
+	{
+		std::vector<char> buff(PREFETCH_PIECE_SIZE);
+
+		while (true) {
+			size_t n;
+			{
+				boost::mutex::scoped_lock l(m_lock);
+				if (m_next >= m_pieces.size())
+					return;
+				n = m_next++;
+			}
+
+			ssize_t got = pread(m_fd, &buff[0], m_pieces[n].second, m_pieces[n].first);
+
+			boost::mutex::scoped_lock l(m_lock);
+			m_calls++;
+			if (got > 0)
+				m_bytes += got;
+		}
+	}
+
+	int m_fd;
+	const std::vector<Reader::range_t>& m_pieces;
+	size_t m_next;
+	uint64_t m_calls;
+	uint64_t m_bytes;
+	boost::mutex m_lock;
+};
+
+} // namespace
+
+void Reader::prefetchData(std::vector<range_t> ranges_)
+{
+	// only a mapped file is looked up in page cache, scratch file of live and refetch
+	// modes is filled by the reads themselves
+	if (!m_image || !m_fetched.empty())
+		return;
+
+	// pages of the ranges joined where they meet, cut into pieces and those which
+	// are not all in page cache yet taken for reading
+	std::vector<range_t> joined;
+	std::sort(ranges_.begin(), ranges_.end());
+	for (size_t i = 0; i < ranges_.size(); i++) {
+		if (ranges_[i].first < 0 || ranges_[i].second == 0 || (size_t)ranges_[i].first >= m_size)
+			continue;
+
+		off_t begin = ranges_[i].first / FETCH_PAGE_SIZE * FETCH_PAGE_SIZE;
+		off_t end = std::min<off_t>(m_size, ranges_[i].first + ranges_[i].second);
+		if (!joined.empty() && begin <= joined.back().first + (off_t)joined.back().second)
+			joined.back().second = std::max<off_t>(joined.back().second, end - joined.back().first);
+		else
+			joined.push_back(range_t(begin, end - begin));
+	}
+
+	// page cache state is taken for PREFETCH_RESIDENT_SIZE bytes at a time
+	std::vector<range_t> pieces;
+	std::vector<unsigned char> resident(PREFETCH_RESIDENT_SIZE / FETCH_PAGE_SIZE);
+	off_t known = 0, knownEnd = 0;
+	for (size_t i = 0; i < joined.size(); i++) {
+		off_t end = joined[i].first + joined[i].second;
+		for (off_t pos = joined[i].first; pos < end; pos += PREFETCH_PIECE_SIZE) {
+			size_t size = std::min<off_t>(PREFETCH_PIECE_SIZE, end - pos);
+			if (pos + (off_t)size > knownEnd) {
+				known = pos;
+				knownEnd = std::min<off_t>(m_size, pos + PREFETCH_RESIDENT_SIZE);
+				resident.assign(resident.size(), 0);
+				if (mincore(m_image + known, knownEnd - known, &resident[0]) != 0)
+					knownEnd = known;
+			}
+
+			size_t first = (pos - known) / FETCH_PAGE_SIZE;
+			size_t last = (pos + size - known + FETCH_PAGE_SIZE - 1) / FETCH_PAGE_SIZE;
+			if (pos + (off_t)size > knownEnd
+				|| std::count(resident.begin() + first, resident.begin() + last, 0) > 0)
+				pieces.push_back(range_t(pos, size));
+		}
+	}
+	if (pieces.empty())
+		return;
+
+	Prefetch p(m_fd, pieces);
+	boost::thread_group threads;
+	try {
+		for (size_t i = 1; i < PREFETCH_DEPTH && i < pieces.size(); i++)
+			threads.create_thread(boost::bind(&Prefetch::run, &p));
+	}
+	catch (const boost::thread_resource_error&) {
+		// go on with the threads which have been started
+	}
+	p.run();
+	threads.join_all();
+
+	m_stats.prefetchCalls += p.m_calls;
+	m_stats.prefetchBytes += p.m_bytes;
+}
+
+// Prefetch C strings read by getString()
+void Reader::prefetchStrings(const std::vector<GElf_Addr>& vaddrs_)
+{
+	std::vector<range_t> ranges;
+
+	for (size_t i = 0; i < vaddrs_.size(); i++)
+		ranges.push_back(range_t(findOffsetByVaddr(vaddrs_[i]), MAX_PATH_BUFF_SIZE));
+	prefetchData(ranges);
+}
+
+// Copy pages of the segment from process memory to the same offset of scratch file.
+// The kernel aligns segments data in core to pages, so a page never spans two
+// segments. Unreadable pages are left zero, as the kernel would write them.
+bool Reader::fetchPages(const GElf_Phdr& phdr_, off_t begin_, off_t end_)
+{
+	std::vector<char> buff;
+
+	begin_ = std::max<off_t>(begin_ / FETCH_PAGE_SIZE * FETCH_PAGE_SIZE, phdr_.p_offset);
+	end_ = std::min<off_t>((end_ + FETCH_PAGE_SIZE - 1) / FETCH_PAGE_SIZE * FETCH_PAGE_SIZE,
+			phdr_.p_offset + phdr_.p_filesz);
+
+	while (begin_ < end_) {
+		if (m_fetched[begin_ / FETCH_PAGE_SIZE]) {
+			begin_ = (begin_ / FETCH_PAGE_SIZE + 1) * FETCH_PAGE_SIZE;
+			continue;
+		}
+
+		// run of pages which are not fetched yet, the whole run is taken in one pass
+		// over compressed file
+		off_t stop = begin_;
+		while (stop < end_ && (m_source >= 0 || stop - begin_ < FETCH_BUFF_SIZE)
+			&& !m_fetched[stop / FETCH_PAGE_SIZE])
+			stop = (stop / FETCH_PAGE_SIZE + 1) * FETCH_PAGE_SIZE;
+		stop = std::min(stop, end_);
+
+		size_t size = stop - begin_;
+		if (m_source >= 0) {
+			if (!refetchData(begin_, size))
+				return false;
+
+			for (off_t pos = begin_; pos < stop; pos += FETCH_PAGE_SIZE)
+				m_fetched[pos / FETCH_PAGE_SIZE] = true;
+			begin_ = stop;
+			continue;
+		}
+
+		GElf_Addr vaddr = phdr_.p_vaddr + (begin_ - phdr_.p_offset);
+		size_t done = 0;
+
+		buff.assign(size, 0);
+		while (done < size) {
+			struct iovec local = { &buff[done], size - done };
+			struct iovec remote = { reinterpret_cast<void*>(vaddr + done), size - done };
+			ssize_t n = process_vm_readv(m_pid, &local, 1, &remote, 1, 0);
+
+			if (n > 0) {
+				done += n;
+				continue;
+			}
+			if (n < 0 && errno != EFAULT && errno != EIO) {
+				Log::error() << "ERROR: Failed to read memory of process " << m_pid
+					<< ". Reason:" << strerror(errno) << std::endl;
+				return false;
+			}
+			done += std::min<size_t>(FETCH_PAGE_SIZE - (vaddr + done) % FETCH_PAGE_SIZE, size - done);
+		}
+
+		if (pwrite(m_fd, &buff[0], size, begin_) != (ssize_t)size)
+			return false;
+
+		for (off_t pos = begin_; pos < stop; pos += FETCH_PAGE_SIZE)
+			m_fetched[pos / FETCH_PAGE_SIZE] = true;
+		begin_ = stop;
+	}
+	return true;
+}
+
+// Decompress the source file further up to the given range and put it into scratch file.
+// The decompression goes on from the previous range and starts over only for a range
+// behind it, so ranges asked in ascending order cost one pass over the file.
+bool Reader::refetchData(off_t offset_, size_t size_)
+{
+	if (!m_refetch || offset_ < m_refetchPos) {
+		m_refetch.reset();
+		m_refetchPos = 0;
+		if (lseek(m_source, 0, SEEK_SET) == 0)
+			m_refetch = Source::open(m_source);
+	}
+
+	Stream s(m_refetch, m_refetchPos);
+	if (!m_refetch || !s.skip(offset_) || !s.copy(m_fd, size_)) {
+		Log::error() << "ERROR: Failed to read core data at offset "
+			<< offset_
+			<< " from compressed file"
+			<< std::endl;
+		m_refetch.reset();
+		return false;
+	}
+	m_refetchPos = s.getPos();
+	return true;
+}
+
+std::pair<off_t, size_t> Reader::getCodeWindow(Elf_Data* notes_, const NoteEntry& prstatus_,
+		size_t window_)
+{
+	GElf_Phdr phdr;
+	GElf_Addr rsp, rip;
+
+	if (!getRegisters(notes_, prstatus_, rsp, rip) || !findPhdrByVaddr(rsp, phdr))
+		return range_t(-1, 0);
+
+	// stack words have the address size of the core class
+	size_t word = m_class == ELFCLASS32 ? sizeof(Elf32_Addr) : sizeof(Elf64_Addr);
+	size_t size = std::min<size_t>(window_, phdr.p_vaddr + phdr.p_filesz - rsp) / word * word;
+	return range_t(phdr.p_offset + (rsp - phdr.p_vaddr), size);
+}
+
+// Collect instruction pointer and code addresses found in window_ bytes above
+// stack pointer of the thread
+bool Reader::getCodeAddresses(Elf_Data* notes_, const NoteEntry& prstatus_, size_t window_,
+		std::vector<GElf_Addr>& addrs_)
+{
+	GElf_Addr rsp, rip;
+
+	addrs_.clear();
+	if (!getRegisters(notes_, prstatus_, rsp, rip))
+		return false;
+
+	addrs_.push_back(rip);
+
+	range_t range = getCodeWindow(notes_, prstatus_, window_);
+	size_t word = m_class == ELFCLASS32 ? sizeof(Elf32_Addr) : sizeof(Elf64_Addr);
+	std::vector<char> window(range.second);
+	size_t size = window.size();
+	if (size == 0 || readCoreData(&window[0], size, range.first) != (ssize_t)size)
+		return true;
+
+	for (size_t pos = 0; pos < size; pos += word) {
+		GElf_Addr addr;
+		if (word == sizeof(Elf32_Addr)) {
+			Elf32_Addr a;
+			memcpy(&a, &window[pos], sizeof(a));
+			addr = a;
+		}
+		else
+			memcpy(&addr, &window[pos], sizeof(addr));
+		if (isCodeAddress(addr))
+			addrs_.push_back(addr);
+	}
+	return true;
+}
+
+// Hash instruction pointer and code addresses found in top window_ bytes of thread's
+// stack, so threads parked at the same place of the same call chain get equal
+// fingerprints regardless of their data.
+uint64_t Reader::getStackFingerprint(Elf_Data* notes_, const NoteEntry& prstatus_, size_t window_)
+{
+	const uint64_t prime = 1099511628211ULL;
+	uint64_t hash = 14695981039346656037ULL;
+	std::vector<GElf_Addr> addrs;
+
+	if (!getCodeAddresses(notes_, prstatus_, window_, addrs))
+		return 0;
 
-	return elf_getdata_rawchunk(m_core, offset, size, ELF_T_BYTE);
+	for (size_t ndx = 0; ndx < addrs.size(); ndx++)
+		hash = (hash ^ addrs[ndx]) * prime;
+	return hash;
 }
 
 } //namespace CoRipper
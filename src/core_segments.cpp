@@ -23,12 +23,45 @@
 
 #include <core_segments.h>
 #include <cstring>
+#include <cstdint>
+#include <map>
+#include <algorithm>
+#include <unistd.h>
 #include <boost/foreach.hpp>
-#include <ostream>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+enum {
+	// pages read at once when looking for zero pages
+	ZERO_SCAN_PAGES = 256
+};
 
 namespace CoRipper
 {
 
+bool isZeroBlock(const char* data_, size_t size_)
+{
+	size_t i = 0;
+
+#ifdef __SSE2__
+	// 64 bytes per step, stop at the first step with non-zero data
+	const __m128i zero = _mm_setzero_si128();
+	for (; i + 64 <= size_; i += 64) {
+		const __m128i* p = reinterpret_cast<const __m128i*>(data_ + i);
+		__m128i v = _mm_or_si128(_mm_or_si128(_mm_loadu_si128(p), _mm_loadu_si128(p + 1)),
+			_mm_or_si128(_mm_loadu_si128(p + 2), _mm_loadu_si128(p + 3)));
+		if (_mm_movemask_epi8(_mm_cmpeq_epi8(v, zero)) != 0xFFFF)
+			return false;
+	}
+#endif
+	for (; i < size_; i++) {
+		if (data_[i] != 0)
+			return false;
+	}
+	return true;
+}
+
 ////////////////////////////////////////////////////////////////////////////////////////////////////
 // struct Segment
 
@@ -36,6 +69,54 @@ Segment::~Segment()
 {
 }
 
+////////////////////////////////////////////////////////////////////////////////////////////////////
+// struct Note
+
+namespace
+{
+
+bool notePosLess(const NoteEntry& a_, const NoteEntry& b_)
+{
+	return a_.pos < b_.pos;
+}
+
+} // namespace
+
+void Note::rewrite(std::vector<NoteEntry> keep_)
+{
+	const char* src = reinterpret_cast<const char*>(m_noteData->d_buf);
+
+	std::sort(keep_.begin(), keep_.end(), notePosLess);
+	m_buf.clear();
+	BOOST_FOREACH(const NoteEntry& e, keep_)
+	{
+		// every note is padded, so they stay aligned when put one after another
+		size_t size = std::min(e.size, m_noteData->d_size - e.pos);
+		m_buf.insert(m_buf.end(), src + e.pos, src + e.pos + size);
+		m_buf.resize((m_buf.size() + 3) & ~3);
+	}
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////
+// struct ExtraNote
+
+ExtraNote::ExtraNote(GElf_Word type, const std::vector<char>& desc)
+{
+	static const char name[] = "CORIPPER";
+	GElf_Nhdr nhdr;
+
+	nhdr.n_namesz = sizeof(name);
+	nhdr.n_descsz = desc.size();
+	nhdr.n_type = type;
+
+	size_t namesz = (sizeof(name) + 3) & ~3;
+	m_buf.resize(sizeof(nhdr) + namesz + ((desc.size() + 3) & ~3));
+	memcpy(&m_buf[0], &nhdr, sizeof(nhdr));
+	memcpy(&m_buf[sizeof(nhdr)], name, sizeof(name));
+	if (!desc.empty())
+		memcpy(&m_buf[sizeof(nhdr) + namesz], &desc[0], desc.size());
+}
+
 ////////////////////////////////////////////////////////////////////////////////////////////////////
 // struct Builder
 
@@ -44,10 +125,115 @@ bool Builder::getResult(Builder::data_t& dst_)
 	GElf_Ehdr h;
 	if (!m_reader->getEhdr(h))
 		return false;
-	h.e_phnum = m_segments.size();
-	h.e_phoff = sizeof(h);
-	dst_.first = Header(h);
+	coalesce();
+
+	// segments copied from source core by writer have to be in place, they are fetched
+	// in the order of the core, so a compressed core is decompressed once for them
+	std::vector<Reader::range_t> ranges;
+	BOOST_FOREACH(const Segment::ptr_t& s, m_segments)
+	{
+		if (s->getSourceOffset() >= 0)
+			ranges.push_back(Reader::range_t(s->getSourceOffset(), s->getSize()));
+	}
+	std::sort(ranges.begin(), ranges.end());
+	BOOST_FOREACH(const Reader::range_t& r, ranges)
+	{
+		if (!m_reader->fetchData(r.first, r.second))
+			return false;
+	}
+
 	dst_.second = m_segments;
+	makeHeader(h, dst_);
+	return true;
+}
+
+// Set up ELF header of the source class for the resulting segments
+void Builder::makeHeader(GElf_Ehdr h_, data_t& dst_)
+{
+	bool is32 = h_.e_ident[EI_CLASS] == ELFCLASS32;
+	h_.e_ehsize = is32 ? sizeof(Elf32_Ehdr) : sizeof(Elf64_Ehdr);
+	h_.e_phentsize = is32 ? sizeof(Elf32_Phdr) : sizeof(Elf64_Phdr);
+
+	size_t phnum = dst_.second.size();
+	size_t size = h_.e_ehsize + phnum * h_.e_phentsize;
+	BOOST_FOREACH(const Segment::ptr_t& s, dst_.second)
+	{
+		size += s->getSize();
+	}
+
+	h_.e_phoff = h_.e_ehsize;
+	h_.e_shoff = 0;
+	h_.e_shnum = 0;
+	h_.e_shstrndx = SHN_UNDEF;
+	if (phnum < PN_XNUM)
+		h_.e_phnum = phnum;
+	else {
+		// extended numbering, the real number is kept in section header 0 put after the data
+		h_.e_phnum = PN_XNUM;
+		h_.e_shoff = size;
+		h_.e_shentsize = is32 ? sizeof(Elf32_Shdr) : sizeof(Elf64_Shdr);
+		h_.e_shnum = 1;
+	}
+	dst_.first = Header(h_, phnum);
+}
+
+bool Builder::elideZeroPages(Reader& r_, data_t& data_)
+{
+	const GElf_Addr page = sysconf(_SC_PAGESIZE);
+	std::vector<char> buff;
+	Segment::list_t result;
+
+	BOOST_FOREACH(const Segment::ptr_t& s, data_.second)
+	{
+		GElf_Phdr phdr = s->getHeader(0);
+		off_t source = s->getSourceOffset();
+
+		// every payload copied from the core is scanned, stacks and .dynamic alike
+		if (source < 0 || phdr.p_type != PT_LOAD) {
+			result.push_back(s);
+			continue;
+		}
+
+		// pieces of data followed by zero pages, memory beyond the data is zero too
+		GElf_Addr begin = phdr.p_vaddr, end = begin + s->getSize();
+		GElf_Addr memEnd = std::max(end, phdr.p_vaddr + phdr.p_memsz);
+		size_t count = result.size();
+		GElf_Addr piece = begin, zeros = begin;
+		for (GElf_Addr chunk = begin; chunk < end; ) {
+			GElf_Addr chunkEnd = std::min(end, (chunk / page + ZERO_SCAN_PAGES) * page);
+
+			// not through the mapping, the pages faulted in around every read would
+			// keep all the data in RSS
+			buff.resize(chunkEnd - chunk);
+			if (!r_.readMemory(chunk, &buff[0], buff.size(), false))
+				return false;
+
+			for (GElf_Addr pos = chunk; pos < chunkEnd; ) {
+				GElf_Addr next = std::min(chunkEnd, (pos / page + 1) * page);
+
+				// partial pages at the ends are kept as data
+				if (next - pos < page || !isZeroBlock(&buff[pos - chunk], next - pos)) {
+					if (zeros < pos) {
+						result.push_back(Stack::ptr_t(new Stack(piece, source + (piece - begin),
+							zeros - piece, pos - zeros, s->getKind())));
+						piece = pos;
+					}
+					zeros = next;
+				}
+				pos = next;
+			}
+			chunk = chunkEnd;
+		}
+		// a segment without zero pages is kept as it is
+		if (result.size() == count && zeros == end)
+			result.push_back(s);
+		else
+			result.push_back(Stack::ptr_t(new Stack(piece, source + (piece - begin),
+				zeros - piece, memEnd - zeros, s->getKind())));
+	}
+
+	data_.second.swap(result);
+	makeHeader(data_.first.getEhdr(), data_);
 	return true;
 }
 
@@ -64,11 +250,45 @@ bool Builder::readNote()
 	if(NULL == (noteData = m_reader->getNoteData(notePhdr)))
 		return false;
 
+	if (!m_reader->indexNotes(noteData, m_noteIndex))
+		return false;
+
 	m_note.reset(new Note(notePhdr, noteData));
+	if (m_policy.regsets != Policy::REGSETS_ALL || !m_policy.keepFileNote)
+		filterNotes();
+
 	m_segments.push_back(m_note);
 	return true;
 }
 
+// Drop the notes not needed by policy. Process-wide notes except NT_FILE and
+// NT_PRSTATUS of every thread are always kept.
+void Builder::filterNotes()
+{
+	std::vector<NoteEntry> keep(m_noteIndex.other);
+	size_t crashing = findCrashingThread();
+
+	for (size_t ndx = 0; ndx < m_noteIndex.threads.size(); ndx++) {
+		const NoteIndex::Thread& t = m_noteIndex.threads[ndx];
+
+		keep.push_back(t.prstatus);
+		if (m_policy.regsets == Policy::REGSETS_ALL
+			|| (m_policy.regsets == Policy::REGSETS_CRASHING && ndx == crashing))
+			keep.insert(keep.end(), t.regsets.begin(), t.regsets.end());
+	}
+
+	const NoteEntry* common[] = {
+		&m_noteIndex.prpsinfo, &m_noteIndex.auxv, &m_noteIndex.siginfo, &m_noteIndex.file
+	};
+	for (size_t i = 0; i < sizeof(common) / sizeof(common[0]); i++) {
+		if (common[i]->size == 0 || (common[i] == &m_noteIndex.file && !m_policy.keepFileNote))
+			continue;
+		keep.push_back(*common[i]);
+	}
+
+	m_note->rewrite(keep);
+}
+
 bool Builder::readDynamic()
 {
 	if (m_dynamic)
@@ -77,7 +297,7 @@ bool Builder::readDynamic()
 	if (!m_note && !readNote())
 		return false;
 
-	Elf_Data* auxvData = m_reader->getAuxvData(m_note->getHeader(), m_note->getData());
+	Elf_Data* auxvData = m_reader->getAuxvData(m_note->getHeader(), m_noteIndex.auxv);
 	Elf_Data* execPhdrData = m_reader->getExecPhdrData(auxvData);
 
 	if (NULL == auxvData || NULL == execPhdrData)
@@ -112,7 +332,7 @@ bool Builder::readDynamic()
 	if (NULL == (dynData = m_reader->getDynData(dynPhdr)))
 		return false;
 
-	m_dynamic.reset(new Dynamic(dynPhdr, dynData));
+	m_dynamic.reset(new Dynamic(dynPhdr, dynData, m_reader->findOffsetByVaddr(dynPhdr.p_vaddr)));
 	m_segments.push_back(m_dynamic);
 	return true;
 }
@@ -129,7 +349,7 @@ bool Builder::readRDebug()
 	if (!m_reader->findDynByTag(m_dynamic->getData(), DT_DEBUG, debugDyn))
 		return false;
 
-	rdebug_t rdebug;
+	RDebugData rdebug;
 	if (!m_reader->getRDebug(debugDyn, rdebug))
 		return false;
 
@@ -138,25 +358,137 @@ bool Builder::readRDebug()
 	return true;
 }
 
-// Read all stack segments
+// Return index of the thread which received fatal signal. pr_cursig is set in every
+// thread of the dump, so it can't tell that thread. The kernel writes the dumping thread
+// first and NT_SIGINFO of the signal right after its NT_PRSTATUS, so the thread followed
+// by NT_SIGINFO is taken, or the first thread of cores without NT_SIGINFO.
+size_t Builder::findCrashingThread()
+{
+	const NoteEntry& siginfo = m_noteIndex.siginfo;
+	size_t crashing = 0;
+
+	if (siginfo.type != NT_SIGINFO)
+		return crashing;
+	for (size_t ndx = 0; ndx < m_noteIndex.threads.size()
+		&& m_noteIndex.threads[ndx].prstatus.pos < siginfo.pos; ndx++)
+	{
+		crashing = ndx;
+	}
+	return crashing;
+}
+
+// Return output bytes left for new segments
+size_t Builder::getFreeBudget() const
+{
+	if (m_policy.outputBudget == 0)
+		return SIZE_MAX;
+
+	size_t used = sizeof(GElf_Ehdr) + m_segments.size() * sizeof(GElf_Phdr);
+	BOOST_FOREACH(const Segment::ptr_t& s, m_segments)
+	{
+		used += s->getSize();
+	}
+	return used < m_policy.outputBudget ? m_policy.outputBudget - used : 0;
+}
+
+// Group threads by stack fingerprint. Threads beyond the first collapseKeep ones of
+// each group keep only collapseWindow bytes of stack. Number of threads collapsed
+// in each group is saved in NT_CORIPPER_COLLAPSED note.
+void Builder::collapseStacks(const std::vector<size_t>& order_, std::vector<size_t>& limits_)
+{
+	typedef std::map<uint64_t, collapsed_t> classes_t;
+	classes_t classes;
+
+	std::vector<Reader::range_t> windows;
+	for (size_t i = 0; i < order_.size(); i++) {
+		windows.push_back(m_reader->getCodeWindow(m_note->getData(),
+				m_noteIndex.threads[order_[i]].prstatus, m_policy.collapseWindow));
+	}
+	m_reader->prefetchData(windows);
+
+	for (size_t i = 0; i < order_.size(); i++) {
+		uint64_t fp = m_reader->getStackFingerprint(m_note->getData(),
+				m_noteIndex.threads[order_[i]].prstatus, m_policy.collapseWindow);
+
+		classes_t::iterator it = classes.find(fp);
+		if (it == classes.end()) {
+			collapsed_t c = { fp, 0, 0 };
+			it = classes.insert(std::make_pair(fp, c)).first;
+		}
+
+		if (++it->second.threads <= m_policy.collapseKeep)
+			continue;
+
+		it->second.collapsed++;
+		if (limits_[i] == 0 || limits_[i] > m_policy.collapseWindow)
+			limits_[i] = m_policy.collapseWindow;
+	}
+
+	std::vector<char> desc;
+	BOOST_FOREACH(const classes_t::value_type& c, classes)
+	{
+		if (c.second.collapsed == 0)
+			continue;
+
+		const char* p = reinterpret_cast<const char*>(&c.second);
+		desc.insert(desc.end(), p, p + sizeof(c.second));
+	}
+
+	if (!desc.empty())
+		m_segments.push_back(ExtraNote::ptr_t(new ExtraNote(NT_CORIPPER_COLLAPSED, desc)));
+}
+
+// Read all stack segments. Stacks are filled into output budget in priority order:
+// the whole stack of crashing thread first, then innermost parts of other threads.
 bool Builder::readStacks()
 {
-	size_t pos = 0;
-	prstatus_t prs;
 	Stack::list_t stacks;
+	std::vector<Reader::range_t> ranges;
 
 	if (!m_note && !readNote())
 		return false;
 
-	// iterate through all prstatus notes and save stack data.
-	while((pos = m_reader->getNextPrStatus(m_note->getData(), pos, prs)) > 0) {
+	// thread indexes in priority order and their stack limits
+	size_t crashing = findCrashingThread();
+	std::vector<size_t> order(1, crashing);
+	std::vector<size_t> limits(1, 0);
+	for (size_t ndx = 0; ndx < m_noteIndex.threads.size(); ndx++) {
+		if (ndx == crashing)
+			continue;
+		order.push_back(ndx);
+		limits.push_back(m_policy.stackLimit);
+	}
+
+	if (m_policy.collapseKeep > 0)
+		collapseStacks(order, limits);
+
+	size_t budget = getFreeBudget();
+
+	for (size_t i = 0; i < order.size(); i++) {
+		size_t maxSize = 0;
+
+		if (budget != SIZE_MAX) {
+			if (budget <= sizeof(GElf_Phdr))
+				break;
+			budget -= sizeof(GElf_Phdr);
+			maxSize = budget;
+		}
+
 		GElf_Addr vaddr;
-		Elf_Data* stackData = m_reader->getStackData(prs, vaddr);
-		if (NULL == stackData)
+		off_t offset;
+		size_t size;
+		if (!m_reader->getStackRange(m_note->getData(), m_noteIndex.threads[order[i]].prstatus,
+				vaddr, offset, size, limits[i], maxSize))
 			return false;
 
-		stacks.push_back(Stack::ptr_t(new Stack(vaddr, stackData)));
+		if (budget != SIZE_MAX)
+			budget -= size;
+
+		stacks.push_back(Stack::ptr_t(new Stack(vaddr, offset, size)));
+		ranges.push_back(Reader::range_t(offset, size));
 	}
+	// the writer copies the stacks one after another
+	m_reader->prefetchData(ranges);
 	m_segments.insert(m_segments.end(), stacks.begin(), stacks.end());
 	return true;
 }
@@ -167,58 +499,204 @@ bool Builder::readLinkmaps()
 	if (!m_rdebug && !readRDebug())
 		return false;
 
-	Segment::list_t linkmapList;
-	GElf_Addr vaddr = (GElf_Addr) m_rdebug->getData().r_map;
+	// the chain is walked first, then the names it points to are read all together
+	std::vector<Linkmap::ptr_t> linkmaps;
+	std::vector<GElf_Addr> names, bases;
+	GElf_Addr vaddr = m_rdebug->getData().map;
 	while (vaddr != 0) {
-		linkmap_t lmap;
+		LinkmapData lmap;
 		if (!m_reader->getLinkmap(vaddr, lmap))
 			return false;
 
-		Linkmap::ptr_t linkmapPtr(new Linkmap(vaddr, lmap));
-		linkmapList.push_back(linkmapPtr);
+		linkmaps.push_back(Linkmap::ptr_t(new Linkmap(vaddr, lmap)));
+		names.push_back(linkmaps.back()->getName());
+		bases.push_back(lmap.addr);
+
+		// next linkmap address
+		vaddr = linkmaps.back()->getNext();
+	}
+	m_reader->prefetchStrings(names);
+
+	Segment::list_t linkmapList;
+	for (size_t i = 0; i < linkmaps.size(); i++) {
+		linkmapList.push_back(linkmaps[i]);
 
 		// get link name
-		vaddr = linkmapPtr->getName();
 		std::vector<char> buf;
-		if (!m_reader->getString(vaddr, buf))
+		if (!m_reader->getString(names[i], buf))
 			return false;
 
+		Module m;
+		m.base = bases[i];
+		m.name = &buf[0];
+		m.name.erase(0, m.name.rfind('/') + 1);
+		m_modules.push_back(m);
+
 		if (NULL != strstr(&buf[0], "/libpthread.so"))
 			strrchr(&buf[0], '/')[4] = 'a';
-		linkmapList.push_back(String::ptr_t(new String(vaddr, buf)));
-
-		// next linkmap address
-		vaddr = linkmapPtr->getNext();
+		linkmapList.push_back(String::ptr_t(new String(names[i], buf)));
 	}
 	m_segments.insert(m_segments.end(), linkmapList.begin(), linkmapList.end());
+	std::sort(m_modules.begin(), m_modules.end());
 	return true;
 }
 
-std::ostream& operator<<(std::ostream& o_, const Builder::data_t& d_)
+bool Builder::getSignature(uint64_t& signature_)
 {
-	off_t offset = d_.first.getOffset();
+	const uint64_t prime = 1099511628211ULL;
+	std::vector<GElf_Addr> addrs;
 
-	// write ELF header
-	if(!o_.write(d_.first.getData(), d_.first.getSize()))
-		return o_;
+	if (!m_note || m_noteIndex.threads.empty())
+		return false;
 
-	// write all program headers
-	BOOST_FOREACH(const Segment::ptr_t& s, d_.second)
+	size_t crashing = findCrashingThread();
+	if (!m_reader->getCodeAddresses(m_note->getData(), m_noteIndex.threads[crashing].prstatus,
+			m_policy.collapseWindow, addrs))
+		return false;
+
+	signature_ = 14695981039346656037ULL;
+	BOOST_FOREACH(GElf_Addr a, addrs)
 	{
-		Segment::Header h = s->getHeader(offset);
-		if (!o_.write(reinterpret_cast<const char*>(&h), d_.first.getHeaderSize()))
-			return o_;
-		offset += s->getSize();
+		// the module loaded at the highest base below the address
+		Module key;
+		key.base = a;
+		std::vector<Module>::const_iterator m = std::upper_bound(m_modules.begin(), m_modules.end(), key);
+
+		if (m != m_modules.begin()) {
+			--m;
+			a -= m->base;
+			BOOST_FOREACH(char c, m->name)
+			{
+				signature_ = (signature_ ^ (unsigned char)c) * prime;
+			}
+		}
+		signature_ = (signature_ ^ a) * prime;
 	}
+	return true;
+}
+
+namespace
+{
 
-	// write segments data
-	BOOST_FOREACH(const Segment::ptr_t& s, d_.second)
+GElf_Addr getVaddr(const Segment::ptr_t& s_)
+{
+	return s_->getHeader(0).p_vaddr;
+}
+
+GElf_Addr getEnd(const Segment::ptr_t& s_)
+{
+	return getVaddr(s_) + s_->getSize();
+}
+
+bool vaddrLess(const Segment::ptr_t& a_, const Segment::ptr_t& b_)
+{
+	return getVaddr(a_) < getVaddr(b_);
+}
+
+} // namespace
+
+// Reduce number of program headers: join overlapping or adjacent segments backed
+// by the core file and group small in-memory segments (linkmaps, strings, rdebug)
+// lying on the same page into one PT_LOAD
+void Builder::coalesce()
+{
+	Segment::list_t result, views, chunks;
+
+	BOOST_FOREACH(const Segment::ptr_t& s, m_segments)
 	{
-		if (!o_.write(s->getBuffer(), s->getSize()))
-			return o_;
+		if (s->getHeader(0).p_type != PT_LOAD || s == m_dynamic)
+			result.push_back(s);
+		else if (s->getSourceOffset() < 0)
+			chunks.push_back(s);
+		else
+			views.push_back(s);
+	}
+
+	coalesceViews(views);
+	coalesceChunks(chunks);
+	result.splice(result.end(), views);
+	result.splice(result.end(), chunks);
+	m_segments.swap(result);
+}
+
+// Join segments which overlap or touch each other both in memory and in core file
+void Builder::coalesceViews(Segment::list_t& views_)
+{
+	Segment::list_t result;
+
+	views_.sort(vaddrLess);
+	while (!views_.empty()) {
+		Segment::ptr_t first = views_.front();
+		GElf_Addr begin = getVaddr(first), end = getEnd(first);
+		GElf_Addr bias = first->getSourceOffset() - begin;
+		size_t count = 1;
+
+		views_.pop_front();
+		while (!views_.empty() && getVaddr(views_.front()) <= end
+			&& views_.front()->getSourceOffset() - getVaddr(views_.front()) == bias)
+		{
+			end = std::max(end, getEnd(views_.front()));
+			views_.pop_front();
+			count++;
+		}
+
+		if (count == 1)
+			result.push_back(first);
+		else
+			result.push_back(Stack::ptr_t(new Stack(begin, begin + bias, end - begin)));
 	}
+	views_.swap(result);
+}
 
-	return o_;
+// Put small segments lying on the same page into one chunk, gaps between them are
+// filled with the core data, so the chunk keeps exact memory content
+void Builder::coalesceChunks(Segment::list_t& chunks_)
+{
+	const GElf_Addr page = sysconf(_SC_PAGESIZE);
+	Segment::list_t result;
+
+	chunks_.sort(vaddrLess);
+	while (!chunks_.empty()) {
+		Segment::list_t group(1, chunks_.front());
+		GElf_Addr begin = getVaddr(chunks_.front()), end = getEnd(chunks_.front());
+		GElf_Phdr phdr;
+
+		chunks_.pop_front();
+		while (!chunks_.empty()) {
+			GElf_Addr next = getVaddr(chunks_.front());
+			if (next > end && (next / page != (end - 1) / page
+				|| !m_reader->findPhdrByVaddr(end, phdr)
+				|| next > phdr.p_vaddr + phdr.p_filesz))
+				break;
+
+			end = std::max(end, getEnd(chunks_.front()));
+			group.splice(group.end(), chunks_, chunks_.begin());
+		}
+
+		if (group.size() == 1) {
+			result.splice(result.end(), group);
+			continue;
+		}
+
+		Chunk::ptr_t chunk(new Chunk(begin, end - begin));
+		GElf_Addr pos = begin;
+		bool res = true;
+		BOOST_FOREACH(const Segment::ptr_t& s, group)
+		{
+			if (getVaddr(s) > pos && !(res = m_reader->readMemory(pos,
+					chunk->getData() + (pos - begin), getVaddr(s) - pos)))
+				break;
+			chunk->put(getVaddr(s), s->getBuffer(), s->getSize());
+			pos = std::max(pos, getEnd(s));
+		}
+
+		// gap bytes which can't be read are not made up, the pieces stay apart
+		if (res)
+			result.push_back(chunk);
+		else
+			result.splice(result.end(), group);
+	}
+	chunks_.swap(result);
 }
 
 } //namespace CoRipper
@@ -0,0 +1,84 @@
+/*
+ * Copyright (c) 2015-2017 Parallels IP Holdings GmbH
+ * Copyright (c) 2017-2019 Virtuozzo International GmbH. All rights reserved.
+ *
+ * This file is part of OpenVZ. OpenVZ is free software; you can redistribute
+ * it and/or modify it under the terms of the GNU General Public License as
+ * published by the Free Software Foundation; either version 2 of the License,
+ * or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA
+ * 02110-1301, USA.
+ *
+ * Our contact details: Virtuozzo International GmbH, Vordergasse 59, 8200
+ * Schaffhausen, Switzerland.
+ */
+
+#include <core_signature.h>
+#include <iostream>
+#include <cstdio>
+#include <cstring>
+#include <cerrno>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/file.h>
+
+enum {
+	ENTRY_BUFF_SIZE = 64
+};
+
+namespace CoRipper
+{
+
+////////////////////////////////////////////////////////////////////////////////////////////////////
+// struct SignatureCache
+
+// Entry is a text line "<first seen> <count>". Cores are admitted when the
+// cache can't be used, losing a core is worse than keeping a duplicate.
+bool SignatureCache::admit(uint64_t signature_, unsigned& count_) const
+{
+	char path[ENTRY_BUFF_SIZE];
+	snprintf(path, sizeof(path), "/%016llx", (unsigned long long)signature_);
+
+	count_ = 1;
+	int fd = open((m_dir + path).c_str(), O_RDWR | O_CREAT | O_CLOEXEC, 0600);
+	if (fd < 0) {
+		std::cerr << "ERROR: Failed to open signature cache entry " << m_dir << path
+			<< ". Reason:" << strerror(errno) << std::endl;
+		return true;
+	}
+
+	if (flock(fd, LOCK_EX) != 0) {
+		close(fd);
+		return true;
+	}
+
+	char buff[ENTRY_BUFF_SIZE];
+	ssize_t n = pread(fd, buff, sizeof(buff) - 1, 0);
+	time_t now = time(NULL);
+	long long first = 0;
+	unsigned count = 0;
+
+	buff[n > 0 ? n : 0] = '\0';
+	if (sscanf(buff, "%lld %u", &first, &count) != 2 || now - first >= m_ttl) {
+		first = now;
+		count = 0;
+	}
+	count_ = ++count;
+
+	n = snprintf(buff, sizeof(buff), "%lld %u\n", first, count);
+	if (pwrite(fd, buff, n, 0) != n || ftruncate(fd, n) != 0)
+		std::cerr << "ERROR: Failed to update signature cache entry " << m_dir << path << std::endl;
+
+	close(fd);
+	return count_ <= m_keep;
+}
+
+} //namespace CoRipper
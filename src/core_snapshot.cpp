@@ -0,0 +1,369 @@
+/*
+ * Copyright (c) 2015-2017 Parallels IP Holdings GmbH
+ * Copyright (c) 2017-2019 Virtuozzo International GmbH. All rights reserved.
+ *
+ * This file is part of OpenVZ. OpenVZ is free software; you can redistribute
+ * it and/or modify it under the terms of the GNU General Public License as
+ * published by the Free Software Foundation; either version 2 of the License,
+ * or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA
+ * 02110-1301, USA.
+ *
+ * Our contact details: Virtuozzo International GmbH, Vordergasse 59, 8200
+ * Schaffhausen, Switzerland.
+ */
+
+#include <core_snapshot.h>
+#include <core_log.h>
+#include <fstream>
+#include <sstream>
+#include <string>
+#include <cerrno>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <dirent.h>
+#include <elf.h>
+#include <sys/ptrace.h>
+#include <sys/wait.h>
+#include <sys/user.h>
+#include <sys/procfs.h>
+
+enum {
+	PAGE_ALIGN = 4096
+};
+
+namespace CoRipper
+{
+
+namespace
+{
+
+std::string getProcPath(pid_t pid_, const char* name_)
+{
+	std::ostringstream s;
+	s << "/proc/" << pid_ << "/" << name_;
+	return s.str();
+}
+
+bool readProcFile(pid_t pid_, const char* name_, std::vector<char>& dst_)
+{
+	std::ifstream f(getProcPath(pid_, name_).c_str(), std::ios::binary);
+	if (!f)
+		return false;
+
+	dst_.assign(std::istreambuf_iterator<char>(f), std::istreambuf_iterator<char>());
+	return true;
+}
+
+template <class T>
+void append(std::vector<char>& dst_, const T& data_)
+{
+	const char* p = reinterpret_cast<const char*>(&data_);
+	dst_.insert(dst_.end(), p, p + sizeof(data_));
+}
+
+void addNote(std::vector<char>& dst_, Elf64_Word type_, const void* desc_, size_t size_)
+{
+	static const char name[] = "CORE";
+	const char* desc = reinterpret_cast<const char*>(desc_);
+	Elf64_Nhdr nhdr;
+
+	nhdr.n_namesz = sizeof(name);
+	nhdr.n_descsz = size_;
+	nhdr.n_type = type_;
+	append(dst_, nhdr);
+	dst_.insert(dst_.end(), name, name + sizeof(name));
+	dst_.resize((dst_.size() + 3) & ~3);
+	dst_.insert(dst_.end(), desc, desc + size_);
+	dst_.resize((dst_.size() + 3) & ~3);
+}
+
+// Readable mappings become loadable segments, their data is fetched later
+bool readMaps(pid_t pid_, std::vector<Elf64_Phdr>& dst_)
+{
+	std::ifstream f(getProcPath(pid_, "maps").c_str());
+	std::string line;
+
+	if (!f)
+		return false;
+
+	while (std::getline(f, line)) {
+		unsigned long begin, end;
+		char perms[5];
+
+		if (sscanf(line.c_str(), "%lx-%lx %4s", &begin, &end, perms) != 3 || perms[0] != 'r')
+			continue;
+		// special mappings which can't be read from outside
+		if (line.find("[vvar]") != std::string::npos || line.find("[vsyscall]") != std::string::npos)
+			continue;
+
+		Elf64_Phdr phdr;
+		memset(&phdr, 0, sizeof(phdr));
+		phdr.p_type = PT_LOAD;
+		phdr.p_vaddr = begin;
+		phdr.p_filesz = phdr.p_memsz = end - begin;
+		phdr.p_flags = PF_R | (perms[1] == 'w' ? PF_W : 0) | (perms[2] == 'x' ? PF_X : 0);
+		phdr.p_align = PAGE_ALIGN;
+		dst_.push_back(phdr);
+	}
+	return true;
+}
+
+// Process information note from /proc/<pid>/stat, comm and cmdline
+void makePrPsInfo(pid_t pid_, prpsinfo_t& dst_)
+{
+	std::vector<char> buf;
+
+	memset(&dst_, 0, sizeof(dst_));
+	dst_.pr_pid = pid_;
+
+	if (readProcFile(pid_, "stat", buf)) {
+		buf.push_back('\0');
+		const char* p = strrchr(&buf[0], ')');
+		int ppid = 0, pgrp = 0, sid = 0;
+		char state = 'R';
+
+		if (p != NULL && sscanf(p + 1, " %c %d %d %d", &state, &ppid, &pgrp, &sid) == 4) {
+			dst_.pr_sname = state;
+			dst_.pr_ppid = ppid;
+			dst_.pr_pgrp = pgrp;
+			dst_.pr_sid = sid;
+		}
+	}
+
+	if (readProcFile(pid_, "comm", buf) && !buf.empty()) {
+		buf.resize(std::min(buf.size() - 1, sizeof(dst_.pr_fname) - 1));
+		memcpy(dst_.pr_fname, &buf[0], buf.size());
+	}
+
+	if (readProcFile(pid_, "cmdline", buf) && !buf.empty()) {
+		buf.resize(std::min(buf.size() - 1, sizeof(dst_.pr_psargs) - 1));
+		for (size_t i = 0; i < buf.size(); i++)
+			dst_.pr_psargs[i] = buf[i] ? buf[i] : ' ';
+	}
+}
+
+double getElapsed(const struct timespec& start_)
+{
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return (now.tv_sec - start_.tv_sec) * 1e3 + (now.tv_nsec - start_.tv_nsec) / 1e6;
+}
+
+} // namespace
+
+////////////////////////////////////////////////////////////////////////////////////////////////////
+// struct Snapshot
+
+bool Snapshot::stop()
+{
+	clock_gettime(CLOCK_MONOTONIC, &m_start);
+	m_stopped = true;
+
+	// threads may be started while the others are attached, repeat until no new ones
+	for (bool found = true; found; ) {
+		DIR* d = opendir(getProcPath(m_pid, "task").c_str());
+		if (d == NULL) {
+			Log::error() << "ERROR: Failed to list threads of process " << m_pid
+				<< ". Reason:" << strerror(errno) << std::endl;
+			return false;
+		}
+
+		found = false;
+		struct dirent* e;
+		while ((e = readdir(d)) != NULL) {
+			pid_t tid = atoi(e->d_name);
+			bool known = tid <= 0;
+
+			for (size_t i = 0; i < m_threads.size() && !known; i++)
+				known = m_threads[i].tid == tid;
+			if (known)
+				continue;
+
+			if (!attach(tid)) {
+				closedir(d);
+				return false;
+			}
+			found = true;
+		}
+		closedir(d);
+	}
+
+	for (size_t i = 0; i < m_threads.size(); ) {
+		if (wait(m_threads[i]))
+			i++;
+		else
+			m_threads.erase(m_threads.begin() + i);
+	}
+
+	// main thread goes first, as in the cores written by the kernel
+	for (size_t i = 1; i < m_threads.size(); i++) {
+		if (m_threads[i].tid == m_pid)
+			std::swap(m_threads[0], m_threads[i]);
+	}
+	return !m_threads.empty();
+}
+
+bool Snapshot::attach(pid_t tid_)
+{
+	if (ptrace(PTRACE_SEIZE, tid_, NULL, NULL) != 0) {
+		// the thread has exited already
+		if (errno == ESRCH)
+			return true;
+
+		Log::error() << "ERROR: Failed to attach to thread " << tid_
+			<< ". Reason:" << strerror(errno) << std::endl;
+		return false;
+	}
+
+	Thread t = { tid_, 0 };
+	m_threads.push_back(t);
+	return ptrace(PTRACE_INTERRUPT, tid_, NULL, NULL) == 0 || errno == ESRCH;
+}
+
+// Wait for the thread to stop, returns false when it has exited
+bool Snapshot::wait(Thread& thread_)
+{
+	int status;
+
+	while (true) {
+		if (waitpid(thread_.tid, &status, __WALL) < 0) {
+			if (errno == EINTR)
+				continue;
+			return false;
+		}
+		if (WIFEXITED(status) || WIFSIGNALED(status))
+			return false;
+		if (WIFSTOPPED(status))
+			break;
+	}
+
+	// stopped with a signal instead of our interrupt, it has to be delivered later
+	if ((status >> 16) != PTRACE_EVENT_STOP)
+		thread_.signal = WSTOPSIG(status);
+	return true;
+}
+
+void Snapshot::resume()
+{
+	if (!m_stopped)
+		return;
+
+	for (size_t i = 0; i < m_threads.size(); i++) {
+		ptrace(PTRACE_DETACH, m_threads[i].tid, NULL,
+			reinterpret_cast<void*>((long)m_threads[i].signal));
+	}
+	m_stopped = false;
+	m_pause = getElapsed(m_start);
+}
+
+bool Snapshot::makeCore(std::vector<char>& head_, off_t& size_)
+{
+	std::vector<Elf64_Phdr> phdrs;
+	std::vector<char> notes;
+
+	if (!readMaps(m_pid, phdrs)) {
+		Log::error() << "ERROR: Failed to read mappings of process " << m_pid << std::endl;
+		return false;
+	}
+
+	for (size_t i = 0; i < m_threads.size(); i++) {
+		struct user_regs_struct regs;
+		struct user_fpregs_struct fpregs;
+		prstatus_t prs;
+
+		if (ptrace(PTRACE_GETREGS, m_threads[i].tid, NULL, &regs) != 0) {
+			Log::error() << "ERROR: Failed to get registers of thread " << m_threads[i].tid
+				<< ". Reason:" << strerror(errno) << std::endl;
+			return false;
+		}
+		bool fpvalid = ptrace(PTRACE_GETFPREGS, m_threads[i].tid, NULL, &fpregs) == 0;
+
+		memset(&prs, 0, sizeof(prs));
+		prs.pr_pid = m_threads[i].tid;
+		memcpy(&prs.pr_reg, &regs, sizeof(regs));
+		prs.pr_fpvalid = fpvalid;
+		addNote(notes, NT_PRSTATUS, &prs, sizeof(prs));
+
+		if (i == 0) {
+			prpsinfo_t psinfo;
+			std::vector<char> auxv;
+
+			makePrPsInfo(m_pid, psinfo);
+			addNote(notes, NT_PRPSINFO, &psinfo, sizeof(psinfo));
+			if (!readProcFile(m_pid, "auxv", auxv) || auxv.empty()) {
+				Log::error() << "ERROR: Failed to read auxv of process " << m_pid << std::endl;
+				return false;
+			}
+			addNote(notes, NT_AUXV, &auxv[0], auxv.size());
+		}
+		if (fpvalid)
+			addNote(notes, NT_FPREGSET, &fpregs, sizeof(fpregs));
+	}
+
+	size_t phnum = phdrs.size() + 1;
+	Elf64_Ehdr ehdr;
+	Elf64_Shdr shdr;
+
+	memset(&ehdr, 0, sizeof(ehdr));
+	memset(&shdr, 0, sizeof(shdr));
+	memcpy(ehdr.e_ident, ELFMAG, SELFMAG);
+	ehdr.e_ident[EI_CLASS] = ELFCLASS64;
+	ehdr.e_ident[EI_DATA] = ELFDATA2LSB;
+	ehdr.e_ident[EI_VERSION] = EV_CURRENT;
+	ehdr.e_ident[EI_OSABI] = ELFOSABI_NONE;
+	ehdr.e_type = ET_CORE;
+	ehdr.e_machine = EM_X86_64;
+	ehdr.e_version = EV_CURRENT;
+	ehdr.e_phoff = sizeof(ehdr);
+	ehdr.e_ehsize = sizeof(ehdr);
+	ehdr.e_phentsize = sizeof(Elf64_Phdr);
+	ehdr.e_phnum = phnum < PN_XNUM ? phnum : PN_XNUM;
+
+	off_t offset = sizeof(ehdr) + phnum * sizeof(Elf64_Phdr);
+	Elf64_Phdr note;
+	memset(&note, 0, sizeof(note));
+	note.p_type = PT_NOTE;
+	note.p_offset = offset;
+	note.p_filesz = notes.size();
+	note.p_align = 4;
+	offset += notes.size();
+
+	if (phnum >= PN_XNUM) {
+		// extended numbering, the real number is kept in section header 0
+		shdr.sh_info = phnum;
+		ehdr.e_shoff = offset;
+		ehdr.e_shentsize = sizeof(shdr);
+		ehdr.e_shnum = 1;
+		offset += sizeof(shdr);
+	}
+
+	for (size_t i = 0; i < phdrs.size(); i++) {
+		offset = (offset + PAGE_ALIGN - 1) / PAGE_ALIGN * PAGE_ALIGN;
+		phdrs[i].p_offset = offset;
+		offset += phdrs[i].p_filesz;
+	}
+
+	head_.clear();
+	append(head_, ehdr);
+	append(head_, note);
+	for (size_t i = 0; i < phdrs.size(); i++)
+		append(head_, phdrs[i]);
+	head_.insert(head_.end(), notes.begin(), notes.end());
+	if (phnum >= PN_XNUM)
+		append(head_, shdr);
+
+	size_ = offset;
+	return true;
+}
+
+} //namespace CoRipper
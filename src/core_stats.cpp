@@ -0,0 +1,236 @@
+/*
+ * Copyright (c) 2015-2017 Parallels IP Holdings GmbH
+ * Copyright (c) 2017-2019 Virtuozzo International GmbH. All rights reserved.
+ *
+ * This file is part of OpenVZ. OpenVZ is free software; you can redistribute
+ * it and/or modify it under the terms of the GNU General Public License as
+ * published by the Free Software Foundation; either version 2 of the License,
+ * or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA
+ * 02110-1301, USA.
+ *
+ * Our contact details: Virtuozzo International GmbH, Vordergasse 59, 8200
+ * Schaffhausen, Switzerland.
+ */
+
+#include <core_stats.h>
+#include <iostream>
+#include <fstream>
+#include <sstream>
+#include <cstdio>
+#include <cstring>
+#include <cerrno>
+#include <ctime>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/file.h>
+#include <sys/resource.h>
+#include <boost/foreach.hpp>
+
+enum {
+	NUMBER_BUFF_SIZE = 32
+};
+
+namespace CoRipper
+{
+
+namespace
+{
+
+double getMs(clockid_t clock_)
+{
+	struct timespec ts;
+	clock_gettime(clock_, &ts);
+	return ts.tv_sec * 1000.0 + ts.tv_nsec / 1000000.0;
+}
+
+long getPeakRss()
+{
+	struct rusage ru;
+	return getrusage(RUSAGE_SELF, &ru) == 0 ? ru.ru_maxrss : 0;
+}
+
+std::string formatNumber(double value_, const char* format_ = "%.15g")
+{
+	char buff[NUMBER_BUFF_SIZE];
+	snprintf(buff, sizeof(buff), format_, value_);
+	return buff;
+}
+
+std::string getSampleName(const std::string& metric_, const char* label_, const std::string& value_)
+{
+	return metric_ + "{" + label_ + "=\"" + value_ + "\"}";
+}
+
+} // namespace
+
+////////////////////////////////////////////////////////////////////////////////////////////////////
+// struct Stats
+
+void Stats::getClocks(double& wallMs_, double& cpuMs_) const
+{
+	wallMs_ = getMs(CLOCK_MONOTONIC);
+	cpuMs_ = getMs(CLOCK_PROCESS_CPUTIME_ID);
+}
+
+void Stats::enter(const char* name_)
+{
+	leave();
+
+	Phase p;
+	p.name = name_;
+	p.wallMs = 0;
+	p.cpuMs = 0;
+	m_phases.push_back(p);
+
+	getClocks(m_wallMs, m_cpuMs);
+	m_started = true;
+}
+
+void Stats::leave()
+{
+	if (!m_started)
+		return;
+
+	double wall, cpu;
+	getClocks(wall, cpu);
+	m_phases.back().wallMs = wall - m_wallMs;
+	m_phases.back().cpuMs = cpu - m_cpuMs;
+	m_started = false;
+}
+
+void Stats::setOutput(const Builder::data_t& data_, uint64_t bytes_)
+{
+	m_segments.clear();
+	BOOST_FOREACH(const Segment::ptr_t& s, data_.second)
+		m_segments[s->getKind()]++;
+	m_outputBytes = bytes_;
+}
+
+void Stats::writeJson(std::ostream& out_) const
+{
+	out_ << "{\n\t\"phases\": [";
+	for (size_t i = 0; i < m_phases.size(); i++) {
+		out_ << (i ? ",\n" : "\n")
+			<< "\t\t{\"name\": \"" << m_phases[i].name
+			<< "\", \"wall_ms\": " << formatNumber(m_phases[i].wallMs, "%.3f")
+			<< ", \"cpu_ms\": " << formatNumber(m_phases[i].cpuMs, "%.3f") << "}";
+	}
+	out_ << "\n\t],\n"
+		<< "\t\"read_core_data\": {\"calls\": " << m_read.readCalls
+		<< ", \"bytes\": " << m_read.readBytes << "},\n"
+		<< "\t\"rawchunk\": {\"calls\": " << m_read.chunkCalls
+		<< ", \"bytes\": " << m_read.chunkBytes << "},\n"
+		<< "\t\"prefetch\": {\"calls\": " << m_read.prefetchCalls
+		<< ", \"bytes\": " << m_read.prefetchBytes << "},\n"
+		<< "\t\"phdr_lookups\": " << m_read.phdrLookups << ",\n"
+		<< "\t\"segments\": {";
+
+	typedef std::map<std::string, unsigned>::const_iterator iterator_t;
+	for (iterator_t it = m_segments.begin(); it != m_segments.end(); ++it) {
+		out_ << (it == m_segments.begin() ? "" : ", ")
+			<< "\"" << it->first << "\": " << it->second;
+	}
+	out_ << "},\n"
+		<< "\t\"bytes_written\": " << m_outputBytes << ",\n"
+		<< "\t\"peak_rss_kb\": " << getPeakRss() << "\n"
+		<< "}" << std::endl;
+}
+
+bool Stats::writeJson(const std::string& path_) const
+{
+	std::ofstream out(path_.c_str());
+	if (out)
+		writeJson(out);
+
+	out.close();
+	if (!out) {
+		std::cerr << "ERROR: Failed to write statistics to " << path_ << std::endl;
+		return false;
+	}
+	return true;
+}
+
+// The textfile keeps counters summed over all the runs, it is rewritten under
+// the lock and replaced at once, so the collector never sees it half written
+bool Stats::updateTextfile(const std::string& path_) const
+{
+	std::string lockPath = path_ + ".lock";
+	int lock = open(lockPath.c_str(), O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+	if (lock < 0 || flock(lock, LOCK_EX) != 0) {
+		std::cerr << "ERROR: Failed to lock " << lockPath
+			<< ". Reason:" << strerror(errno) << std::endl;
+		if (lock >= 0)
+			close(lock);
+		return false;
+	}
+
+	// samples of the previous runs, "# " lines are regenerated
+	std::map<std::string, double> samples;
+	std::ifstream in(path_.c_str());
+	std::string line;
+	while (std::getline(in, line)) {
+		size_t sep = line.rfind(' ');
+		if (line.empty() || line[0] == '#' || sep == std::string::npos)
+			continue;
+		samples[line.substr(0, sep)] = strtod(line.c_str() + sep + 1, NULL);
+	}
+	in.close();
+
+	samples["coripper_cores_total"] += 1;
+	BOOST_FOREACH(const Phase& p, m_phases)
+	{
+		samples[getSampleName("coripper_phase_wall_seconds_total", "phase", p.name)] += p.wallMs / 1000;
+		samples[getSampleName("coripper_phase_cpu_seconds_total", "phase", p.name)] += p.cpuMs / 1000;
+	}
+	samples["coripper_read_core_data_calls_total"] += m_read.readCalls;
+	samples["coripper_read_core_data_bytes_total"] += m_read.readBytes;
+	samples["coripper_rawchunk_calls_total"] += m_read.chunkCalls;
+	samples["coripper_rawchunk_bytes_total"] += m_read.chunkBytes;
+	samples["coripper_prefetch_calls_total"] += m_read.prefetchCalls;
+	samples["coripper_prefetch_bytes_total"] += m_read.prefetchBytes;
+	samples["coripper_phdr_lookups_total"] += m_read.phdrLookups;
+
+	typedef std::map<std::string, unsigned>::const_iterator iterator_t;
+	for (iterator_t it = m_segments.begin(); it != m_segments.end(); ++it)
+		samples[getSampleName("coripper_segments_total", "kind", it->first)] += it->second;
+
+	samples["coripper_written_bytes_total"] += m_outputBytes;
+	samples["coripper_last_peak_rss_bytes"] = getPeakRss() * 1024.0;
+	samples["coripper_last_run_timestamp_seconds"] = time(NULL);
+
+	std::string tmp = path_ + ".tmp";
+	std::ofstream out(tmp.c_str());
+	std::string family;
+
+	typedef std::map<std::string, double>::const_iterator sample_t;
+	for (sample_t it = samples.begin(); out && it != samples.end(); ++it) {
+		std::string f = it->first.substr(0, it->first.find('{'));
+		if (f != family) {
+			family = f;
+			out << "# TYPE " << family << (family.rfind("_total") == family.size() - 6
+				? " counter" : " gauge") << "\n";
+		}
+		out << it->first << " " << formatNumber(it->second) << "\n";
+	}
+	out.close();
+
+	bool res = out && rename(tmp.c_str(), path_.c_str()) == 0;
+	if (!res) {
+		std::cerr << "ERROR: Failed to update statistics textfile " << path_ << std::endl;
+		unlink(tmp.c_str());
+	}
+
+	close(lock);
+	return res;
+}
+
+} //namespace CoRipper
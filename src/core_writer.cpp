@@ -0,0 +1,430 @@
+/*
+ * Copyright (c) 2015-2017 Parallels IP Holdings GmbH
+ * Copyright (c) 2017-2019 Virtuozzo International GmbH. All rights reserved.
+ *
+ * This file is part of OpenVZ. OpenVZ is free software; you can redistribute
+ * it and/or modify it under the terms of the GNU General Public License as
+ * published by the Free Software Foundation; either version 2 of the License,
+ * or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA
+ * 02110-1301, USA.
+ *
+ * Our contact details: Virtuozzo International GmbH, Vordergasse 59, 8200
+ * Schaffhausen, Switzerland.
+ */
+
+#include <core_writer.h>
+#include <cerrno>
+#include <algorithm>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <boost/foreach.hpp>
+#include <boost/bind/bind.hpp>
+#include <boost/thread/thread.hpp>
+
+enum {
+	WRITE_BUFF_SIZE = 1 << 16,
+	COPY_BUFF_SIZE = 1 << 20,
+	// large segments are split so that threads get even share of work
+	PARALLEL_JOB_SIZE = 8 << 20,
+	// zero blocks of this size aligned in the output file are left as holes
+	HOLE_SIZE = 4096
+};
+
+namespace CoRipper
+{
+
+namespace
+{
+
+bool pwriteAll(int fd_, const char* buff_, size_t size_, off_t offset_)
+{
+	while (size_ > 0) {
+		ssize_t n = ::pwrite(fd_, buff_, size_, offset_);
+		if (n < 0 && errno == EINTR)
+			continue;
+		if (n <= 0)
+			return false;
+		buff_ += n;
+		size_ -= n;
+		offset_ += n;
+	}
+	return true;
+}
+
+// Positioned write, in sparse mode zero blocks are left as holes
+bool pwriteData(int fd_, const char* buff_, size_t size_, off_t offset_, bool sparse_)
+{
+	if (!sparse_)
+		return pwriteAll(fd_, buff_, size_, offset_);
+
+	while (size_ > 0) {
+		size_t n = std::min<size_t>(size_, HOLE_SIZE - offset_ % HOLE_SIZE);
+
+		if ((n < HOLE_SIZE || !isZeroBlock(buff_, n)) && !pwriteAll(fd_, buff_, n, offset_))
+			return false;
+
+		buff_ += n;
+		size_ -= n;
+		offset_ += n;
+	}
+	return true;
+}
+
+bool isCopyUnsupported(int err_)
+{
+	return err_ == EXDEV || err_ == EINVAL || err_ == ENOSYS
+		|| err_ == EOPNOTSUPP || err_ == EBADF;
+}
+
+} // namespace
+
+////////////////////////////////////////////////////////////////////////////////////////////////////
+// struct Writer
+
+Writer::Writer(int dst_, int src_, unsigned threads_, const Compression& compression_,
+	bool sparse_)
+: m_dst(dst_), m_src(src_), m_mode(MODE_BUFFER), m_threads(threads_), m_sparse(false),
+	m_sink(Sink::create(dst_, compression_)), m_next(0), m_failed(false)
+{
+	struct stat st;
+
+	m_buff.reserve(WRITE_BUFF_SIZE);
+
+	// compressor has to see all the data
+	if (compression_.type != Compression::NONE)
+		return;
+
+	if (fstat(m_dst, &st) != 0)
+		return;
+
+	// appending descriptors always write at the end, so neither holes nor positioned
+	// writes of parallel jobs can be used
+	if (fcntl(m_dst, F_GETFL) & O_APPEND) {
+		m_threads = 1;
+		return;
+	}
+
+	if (sparse_ && S_ISREG(st.st_mode))
+		m_sparse = true;
+
+	if (m_src < 0)
+		return;
+
+	if (S_ISREG(st.st_mode))
+		m_mode = MODE_COPY_RANGE;
+	else if (S_ISFIFO(st.st_mode))
+		m_mode = MODE_SPLICE;
+}
+
+Writer::Writer(const Sink::ptr_t& sink_, int src_)
+: m_dst(-1), m_src(src_), m_mode(MODE_BUFFER), m_threads(1), m_sparse(false),
+	m_sink(sink_), m_next(0), m_failed(false)
+{
+	m_buff.reserve(WRITE_BUFF_SIZE);
+}
+
+bool Writer::write(const Builder::data_t& d_)
+{
+	if (!m_sink)
+		return false;
+
+	if (d_.first.getClass() == ELFCLASS32)
+		return doWrite<Elf32Traits>(d_);
+	return doWrite<Elf64Traits>(d_);
+}
+
+template <class Traits>
+bool Writer::doWrite(const Builder::data_t& d_)
+{
+	if (!writeHeaders<Traits>(d_))
+		return false;
+
+	if (m_threads > 1 && m_mode == MODE_COPY_RANGE) {
+		if (!writeParallel(d_))
+			return false;
+	}
+	else {
+		// write segments data
+		BOOST_FOREACH(const Segment::ptr_t& s, d_.second)
+		{
+			off_t source = s->getSourceOffset();
+
+			if (source < 0) {
+				if (!writeSegmentData(s->getBuffer(), s->getSize()))
+					return false;
+			}
+			else if (!copyData(source, s->getSize()))
+				return false;
+		}
+	}
+
+	if (!writeSectionHeader<Traits>(d_) || !flush() || !m_sink->finish())
+		return false;
+
+	// the file may end with a hole
+	if (m_sparse) {
+		off_t end = lseek(m_dst, 0, SEEK_CUR);
+		return end >= 0 && ftruncate(m_dst, end) == 0;
+	}
+	return true;
+}
+
+// Write ELF header and all program headers in the class and byte order of the source
+template <class Traits>
+bool Writer::writeHeaders(const Builder::data_t& d_)
+{
+	typedef typename Traits::Ehdr Ehdr;
+	typedef typename Traits::Phdr Phdr;
+
+	Ehdr ehdr;
+	std::vector<Phdr> phdrs(d_.second.size());
+	off_t offset = d_.first.getOffset();
+	size_t ndx = 0;
+
+	copyEhdr(d_.first.getEhdr(), ehdr);
+	BOOST_FOREACH(const Segment::ptr_t& s, d_.second)
+	{
+		copyPhdr(s->getHeader(offset), phdrs[ndx++]);
+		offset += s->getSize();
+	}
+
+	std::vector<char> buff(sizeof(Ehdr) + phdrs.size() * sizeof(Phdr));
+	unsigned encoding = d_.first.getEncoding();
+
+	if (!toFile<Traits>(&buff[0], &ehdr, sizeof(Ehdr), ELF_T_EHDR, encoding))
+		return false;
+	if (!phdrs.empty() && !toFile<Traits>(&buff[sizeof(Ehdr)], &phdrs[0],
+			phdrs.size() * sizeof(Phdr), ELF_T_PHDR, encoding))
+		return false;
+
+	return writeData(&buff[0], buff.size());
+}
+
+template <class Traits>
+bool Writer::writeSectionHeader(const Builder::data_t& d_)
+{
+	typedef typename Traits::Shdr Shdr;
+
+	GElf_Shdr h;
+	if (!d_.first.getSectionHeader(h))
+		return true;
+
+	Shdr shdr, buff;
+	copyShdr(h, shdr);
+	return toFile<Traits>(&buff, &shdr, sizeof(Shdr), ELF_T_SHDR, d_.first.getEncoding())
+		&& writeData(reinterpret_cast<const char*>(&buff), sizeof(buff));
+}
+
+// Put segments data to precomputed offsets of output file from several threads
+bool Writer::writeParallel(const Builder::data_t& d_)
+{
+	if (!flush())
+		return false;
+
+	off_t start = lseek(m_dst, 0, SEEK_CUR);
+	if (start < 0)
+		return false;
+
+	// ELF and program headers are already written, segments data follows them
+	off_t offset = start;
+
+	m_jobs.clear();
+	BOOST_FOREACH(const Segment::ptr_t& s, d_.second)
+	{
+		off_t source = s->getSourceOffset();
+		const char* buff = source < 0 ? s->getBuffer() : NULL;
+
+		for (size_t done = 0; done < s->getSize(); done += PARALLEL_JOB_SIZE) {
+			Job j;
+			j.buff = buff ? buff + done : NULL;
+			j.source = source + done;
+			j.offset = offset + done;
+			j.size = std::min(s->getSize() - done, size_t(PARALLEL_JOB_SIZE));
+			m_jobs.push_back(j);
+		}
+		offset += s->getSize();
+	}
+
+	// reserve the space at once, it is fine if filesystem can't do that
+	if (offset > start && !m_sparse)
+		fallocate(m_dst, 0, start, offset - start);
+
+	m_next = 0;
+	m_failed = false;
+
+	boost::thread_group workers;
+	try {
+		for (unsigned i = 1; i < m_threads && i < m_jobs.size(); i++)
+			workers.create_thread(boost::bind(&Writer::runJobs, this));
+	}
+	catch (const boost::thread_resource_error&) {
+		// go on with the threads which have been started
+	}
+	runJobs();
+	workers.join_all();
+
+	return !m_failed && lseek(m_dst, offset, SEEK_SET) >= 0;
+}
+
+// Thread routine taking jobs from the queue until it is empty or some job failed
+void Writer::runJobs()
+{
+	std::vector<char> chunk;
+
+	while (true) {
+		Job j;
+		{
+			boost::mutex::scoped_lock l(m_lock);
+			if (m_failed || m_next >= m_jobs.size())
+				return;
+			j = m_jobs[m_next++];
+		}
+
+		if (!putData(j, chunk)) {
+			boost::mutex::scoped_lock l(m_lock);
+			m_failed = true;
+			return;
+		}
+	}
+}
+
+bool Writer::putData(const Job& job_, std::vector<char>& chunk_)
+{
+	if (job_.buff != NULL)
+		return pwriteData(m_dst, job_.buff, job_.size, job_.offset, m_sparse);
+
+	// data has to be looked at to find zero pages
+	size_t done = 0;
+	while (!m_sparse && done < job_.size) {
+		loff_t source = job_.source + done;
+		loff_t offset = job_.offset + done;
+		ssize_t n = copy_file_range(m_src, &source, m_dst, &offset, job_.size - done, 0);
+
+		if (n < 0 && errno == EINTR)
+			continue;
+		if (n < 0 && !isCopyUnsupported(errno))
+			return false;
+		if (n <= 0)
+			break;
+		done += n;
+	}
+
+	if (done < job_.size && chunk_.empty())
+		chunk_.resize(COPY_BUFF_SIZE);
+
+	while (done < job_.size) {
+		ssize_t n = pread(m_src, &chunk_[0], std::min(job_.size - done, chunk_.size()), job_.source + done);
+		if (n < 0 && errno == EINTR)
+			continue;
+		if (n <= 0 || !pwriteData(m_dst, &chunk_[0], n, job_.offset + done, m_sparse))
+			return false;
+		done += n;
+	}
+	return true;
+}
+
+// Buffered write of data located in memory
+bool Writer::writeData(const char* buff_, size_t size_)
+{
+	if (m_buff.size() + size_ > m_buff.capacity() && !flush())
+		return false;
+
+	if (size_ >= m_buff.capacity())
+		return m_sink->write(buff_, size_);
+
+	m_buff.insert(m_buff.end(), buff_, buff_ + size_);
+	return true;
+}
+
+// Copy data from source core file in kernel, fall back to copy through fixed size
+// buffer when the kernel refuses to copy between given descriptors
+bool Writer::copyData(off_t offset_, size_t size_)
+{
+	if (m_mode != MODE_BUFFER && !flush())
+		return false;
+
+	size_t done = 0;
+	while (m_mode != MODE_BUFFER && !m_sparse && done < size_) {
+		off_t offset = offset_ + done;
+		ssize_t n;
+
+		if (m_mode == MODE_COPY_RANGE)
+			n = copy_file_range(m_src, &offset, m_dst, NULL, size_ - done, 0);
+		else
+			n = splice(m_src, &offset, m_dst, NULL, size_ - done, SPLICE_F_MOVE);
+
+		if (n < 0 && errno == EINTR)
+			continue;
+		if (n < 0 && !isCopyUnsupported(errno))
+			return false;
+		if (n <= 0)
+			m_mode = MODE_BUFFER;
+		else
+			done += n;
+	}
+
+	if (done < size_ && m_chunk.empty())
+		m_chunk.resize(COPY_BUFF_SIZE);
+
+	while (done < size_) {
+		ssize_t n = pread(m_src, &m_chunk[0], std::min(size_ - done, m_chunk.size()), offset_ + done);
+		if (n < 0 && errno == EINTR)
+			continue;
+		if (n <= 0 || !writeSegmentData(&m_chunk[0], n))
+			return false;
+		done += n;
+	}
+	return true;
+}
+
+// Write segment data, in sparse mode zero pages are skipped leaving holes
+bool Writer::writeSegmentData(const char* buff_, size_t size_)
+{
+	if (!m_sparse)
+		return writeData(buff_, size_);
+
+	off_t pos = lseek(m_dst, 0, SEEK_CUR);
+	if (pos < 0)
+		return false;
+
+	pos += m_buff.size();
+	while (size_ > 0) {
+		size_t n = std::min<size_t>(size_, HOLE_SIZE - pos % HOLE_SIZE);
+
+		if (n == HOLE_SIZE && isZeroBlock(buff_, n)) {
+			if (!flush() || lseek(m_dst, n, SEEK_CUR) < 0)
+				return false;
+		}
+		else if (!writeData(buff_, n))
+			return false;
+
+		buff_ += n;
+		size_ -= n;
+		pos += n;
+	}
+	return true;
+}
+
+bool Writer::flush()
+{
+	if (m_buff.empty())
+		return true;
+
+	if (!m_sink->write(&m_buff[0], m_buff.size()))
+		return false;
+
+	m_buff.clear();
+	return true;
+}
+
+} //namespace CoRipper
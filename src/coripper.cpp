@@ -22,66 +22,320 @@
  */
 
 #include <coripper.h>
-#include <iostream>
+#include <core_snapshot.h>
+#include <core_log.h>
+#include <vector>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <cerrno>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <boost/foreach.hpp>
+
+enum {
+	DRAIN_BUFF_SIZE = 1 << 20
+};
 
 namespace CoRipper
 {
 
+namespace
+{
+
+// Throw away everything left in descriptor without looking at it
+void drain(int fd_)
+{
+	int null = open("/dev/null", O_WRONLY | O_CLOEXEC);
+
+	while (null >= 0 && splice(fd_, NULL, null, NULL, DRAIN_BUFF_SIZE, SPLICE_F_MOVE) > 0)
+		;
+	if (null >= 0)
+		close(null);
+
+	std::vector<char> buff(DRAIN_BUFF_SIZE);
+	ssize_t n;
+	while ((n = ::read(fd_, &buff[0], buff.size())) > 0 || (n < 0 && errno == EINTR))
+		;
+}
+
+// Size of the resulting core before compression
+uint64_t getOutputSize(const Builder::data_t& data_)
+{
+	uint64_t size = data_.first.getOffset();
+	BOOST_FOREACH(const Segment::ptr_t& s, data_.second)
+		size += s->getSize();
+
+	GElf_Shdr shdr;
+	if (data_.first.getSectionHeader(shdr))
+		size += data_.first.getClass() == ELFCLASS32 ? sizeof(Elf32_Shdr) : sizeof(Elf64_Shdr);
+	return size;
+}
+
+// Data looked for may be in streamed segments left out by the scratch limit
+void logSkipped(const Reader& reader_)
+{
+	if (reader_.getSkipped() == 0)
+		return;
+
+	Log::error() << "ERROR: "
+		<< reader_.getSkipped()
+		<< " bytes of segments were left out by scratch limit of "
+		<< reader_.getScratchLimit()
+		<< " bytes"
+		<< std::endl;
+}
+
+} // namespace
+
 ////////////////////////////////////////////////////////////////////////////////////////////////////
 // struct Core
 
-bool Core::read(const char* fname)
+bool Core::read(const char* fname, size_t scratchLimit)
 {
 	clear();
 
-	if(!(m_reader = Reader::openCoreFile(fname)))
+	enter("open");
+	if(!(m_reader = Reader::openCoreFile(fname, scratchLimit)))
 	{
-		std::cerr << "ERROR: Unable to open file " << fname << std::endl;
+		Log::error() << "ERROR: Unable to open file " << fname << std::endl;
+		m_error = ERROR_OPEN;
 		return false;
 	}
 
-	Builder b(*m_reader);
+	return build();
+}
+
+bool Core::readStream(int fd, size_t scratchLimit, pid_t pid)
+{
+	clear();
+
+	enter("open");
+	if(!(m_reader = Reader::openCoreStream(fd, scratchLimit, pid)))
+	{
+		Log::error() << "ERROR: Unable to read core from stream" << std::endl;
+		m_error = ERROR_OPEN;
+		return false;
+	}
+
+	bool res = build();
+
+	// in live mode the rest of the core is not needed, let the kernel finish it
+	if (pid > 0) {
+		enter("drain");
+		drain(fd);
+	}
+
+	return res;
+}
+
+bool Core::readDescriptor(int fd, size_t scratchLimit)
+{
+	clear();
+
+	enter("open");
+	int dup = fcntl(fd, F_DUPFD_CLOEXEC, 0);
+	if (dup < 0 || !(m_reader = Reader::openCoreDescriptor(dup, scratchLimit)))
+	{
+		Log::error() << "ERROR: Unable to read core from descriptor " << fd << std::endl;
+		m_error = ERROR_OPEN;
+		return false;
+	}
+
+	return build();
+}
+
+bool Core::readBuffer(const char* buff, size_t size, size_t scratchLimit)
+{
+	clear();
+
+	enter("open");
+	if(!(m_reader = Reader::openCoreBuffer(buff, size, scratchLimit)))
+	{
+		Log::error() << "ERROR: Unable to read core from memory" << std::endl;
+		m_error = ERROR_OPEN;
+		return false;
+	}
+
+	return build();
+}
+
+bool Core::readProcess(pid_t pid, double& pauseMs)
+{
+	clear();
+
+	Snapshot s(pid);
+	std::vector<char> head;
+	off_t size;
+
+	enter("snapshot");
+	if(!s.stop() || !s.makeCore(head, size)
+		|| !(m_reader = Reader::openProcess(head, size, pid)))
+	{
+		Log::error() << "ERROR: Unable to make snapshot of process " << pid << std::endl;
+		m_error = ERROR_OPEN;
+		return false;
+	}
+
+	// threads are kept stopped until all the needed memory is fetched
+	bool res = build();
+
+	enter("resume");
+	s.resume();
+	pauseMs = s.getPause();
+	return res;
+}
+
+bool Core::build()
+{
+	bool res = doBuild();
+
+	if (m_stats) {
+		m_stats->leave();
+		m_stats->setReadStats(m_reader->getStats());
+	}
+	return res;
+}
+
+bool Core::doBuild()
+{
+	Builder b(*m_reader, m_policy);
+	enter("readNote");
 	if (!b.readNote())
 	{
-		std::cerr << "ERROR: Unable to read core notes" << std::endl;
+		Log::error() << "ERROR: Unable to read core notes" << std::endl;
+		m_error = ERROR_NOTE;
 		return false;
 	}
+	enter("readDynamic");
 	if (!b.readDynamic())
 	{
-		std::cerr << "ERROR: Unable to read dynamic section" << std::endl;
+		Log::error() << "ERROR: Unable to read dynamic section" << std::endl;
+		logSkipped(*m_reader);
+		m_error = ERROR_DYNAMIC;
 		return false;
 	}
+	enter("readRDebug");
 	if (!b.readRDebug())
 	{
-		std::cerr << "ERROR: Unable to read rdebug structure" << std::endl;
+		Log::error() << "ERROR: Unable to read rdebug structure" << std::endl;
+		logSkipped(*m_reader);
+		m_error = ERROR_RDEBUG;
 		return false;
 	}
+	enter("readLinkmaps");
 	if (!b.readLinkmaps())
 	{
-		std::cerr << "ERROR: Unable to read linkmap" << std::endl;
+		Log::error() << "ERROR: Unable to read linkmap" << std::endl;
+		logSkipped(*m_reader);
+		m_error = ERROR_LINKMAP;
 		return false;
 	}
+	// duplicates are recognized before the stacks are read
+	enter("signature");
+	if (m_cache && b.getSignature(m_signature)
+		&& !m_cache->admit(m_signature, m_signatureCount))
+	{
+		m_duplicate = true;
+		return true;
+	}
+	enter("readStacks");
 	if (!b.readStacks())
 	{
-		std::cerr << "ERROR: Unable to read stacks" << std::endl;
+		Log::error() << "ERROR: Unable to read stacks" << std::endl;
+		m_error = ERROR_STACKS;
 		return false;
 	}
+	enter("getResult");
 	if (!b.getResult(m_data))
 	{
-		std::cerr << "ERROR: Unable to read elf header" << std::endl;
+		Log::error() << "ERROR: Unable to read elf header" << std::endl;
+		m_error = ERROR_HEADER;
 		return false;
 	}
 	return true;
 }
 
-void Core::clear()
+bool Core::write(int fd, unsigned threads, const Compression& compression) const
 {
-	m_data.second.clear();
+	Writer w(fd, m_reader ? m_reader->getFd() : -1, threads, compression, m_policy.sparse);
+	return doWrite(w);
+}
+
+bool Core::write(const Sink::ptr_t& sink) const
+{
+	Writer w(sink, m_reader ? m_reader->getFd() : -1);
+	return doWrite(w);
 }
 
-std::ostream& operator<<(std::ostream& s_, const Core& c_)
+bool Core::doWrite(Writer& writer) const
 {
-	return s_ << c_.m_data;
+	const Builder::data_t* data = &m_data;
+	Builder::data_t d;
+	bool res = true;
+
+	// output can't have holes, zero pages are left out of segments data instead
+	if (m_policy.sparse && !writer.isSparse() && m_reader) {
+		enter("zeroScan");
+		d = m_data;
+		data = &d;
+		res = Builder::elideZeroPages(*m_reader, d);
+	}
+	enter("write");
+	res = res && writer.write(*data);
+
+	if (m_stats) {
+		m_stats->leave();
+		m_stats->setOutput(*data, res ? getOutputSize(*data) : 0);
+	}
+	return res;
+}
+
+// Write to temporary file next to path, so the result appears only when complete.
+// The temporary name is unique, so writers of the same path don't mix their data.
+bool Core::writeFile(const std::string& path, off_t& size, unsigned threads,
+	const Compression& compression) const
+{
+	std::string name = path + ".XXXXXX";
+	std::vector<char> tmpl(name.begin(), name.end());
+	tmpl.push_back('\0');
+	const char* tmp = &tmpl[0];
+
+	int fd = mkstemp(&tmpl[0]);
+	if (fd < 0) {
+		Log::error() << "ERROR: Failed to create " << tmp
+			<< ". Reason:" << strerror(errno) << std::endl;
+		return false;
+	}
+
+	struct stat st;
+	bool res = write(fd, threads, compression) && fstat(fd, &st) == 0;
+	if (close(fd) != 0)
+		res = false;
+
+	if (!res || rename(tmp, path.c_str()) != 0) {
+		unlink(tmp);
+		return false;
+	}
+
+	size = st.st_size;
+	return true;
+}
+
+void Core::enter(const char* phase) const
+{
+	if (m_stats)
+		m_stats->enter(phase);
+}
+
+void Core::clear()
+{
+	m_data.second.clear();
+	m_signature = 0;
+	m_signatureCount = 0;
+	m_duplicate = false;
+	m_error = ERROR_NONE;
 }
 
 } //namespace CoRipper
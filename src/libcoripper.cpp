@@ -0,0 +1,291 @@
+/*
+ * Copyright (c) 2015-2017 Parallels IP Holdings GmbH
+ * Copyright (c) 2017-2019 Virtuozzo International GmbH. All rights reserved.
+ *
+ * This file is part of OpenVZ. OpenVZ is free software; you can redistribute
+ * it and/or modify it under the terms of the GNU General Public License as
+ * published by the Free Software Foundation; either version 2 of the License,
+ * or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA
+ * 02110-1301, USA.
+ *
+ * Our contact details: Virtuozzo International GmbH, Vordergasse 59, 8200
+ * Schaffhausen, Switzerland.
+ */
+
+#include <libcoripper.h>
+#include <coripper.h>
+#include <core_log.h>
+#include <new>
+#include <algorithm>
+#include <sstream>
+#include <string>
+#include <cstring>
+#include <cerrno>
+#include <signal.h>
+#include <time.h>
+#include <boost/thread/tss.hpp>
+
+enum {
+	DEFAULT_SCRATCH_LIMIT = 64 << 20
+};
+
+namespace
+{
+
+// messages of the last failed call of every thread
+boost::thread_specific_ptr<std::string> s_message;
+
+void setMessage(const std::string& message_)
+{
+	if (s_message.get() == NULL)
+		s_message.reset(new std::string());
+	*s_message = message_;
+}
+
+struct Callback
+{
+	coripper_write_fn write;
+	void* ctx;
+};
+
+bool callbackWrite(void* ctx_, const char* buff_, size_t size_)
+{
+	Callback* c = reinterpret_cast<Callback*>(ctx_);
+	return c->write(c->ctx, buff_, size_) == 0;
+}
+
+// SIGPIPE is blocked while the caller's thread and the threads started by the call
+// write, a closed pipe or socket fails the write with EPIPE instead of killing the
+// process. SIGPIPE raised by the call is taken back before the mask is restored,
+// one which was already pending stays for the caller.
+struct PipeGuard
+{
+	PipeGuard()
+	{
+		sigset_t pending;
+
+		sigemptyset(&m_pipe);
+		sigaddset(&m_pipe, SIGPIPE);
+		pthread_sigmask(SIG_BLOCK, &m_pipe, &m_old);
+		m_pending = sigpending(&pending) == 0 && sigismember(&pending, SIGPIPE);
+	}
+	~PipeGuard()
+	{
+		if (!m_pending) {
+			const struct timespec zero = { 0, 0 };
+			while (sigtimedwait(&m_pipe, NULL, &zero) < 0 && errno == EINTR)
+				;
+		}
+		pthread_sigmask(SIG_SETMASK, &m_old, NULL);
+	}
+
+private:
+	sigset_t m_pipe;
+	sigset_t m_old;
+	bool m_pending;
+};
+
+int getError(CoRipper::Core::error_t error_)
+{
+	switch (error_) {
+	case CoRipper::Core::ERROR_NONE:
+		return CORIPPER_OK;
+	case CoRipper::Core::ERROR_OPEN:
+		return CORIPPER_EREAD;
+	case CoRipper::Core::ERROR_NOTE:
+		return CORIPPER_ENOTE;
+	case CoRipper::Core::ERROR_DYNAMIC:
+		return CORIPPER_EDYNAMIC;
+	case CoRipper::Core::ERROR_RDEBUG:
+		return CORIPPER_ERDEBUG;
+	case CoRipper::Core::ERROR_LINKMAP:
+		return CORIPPER_ELINKMAP;
+	case CoRipper::Core::ERROR_STACKS:
+		return CORIPPER_ESTACKS;
+	case CoRipper::Core::ERROR_HEADER:
+		return CORIPPER_EHEADER;
+	}
+	return CORIPPER_EINTERNAL;
+}
+
+bool getPolicy(const coripper_policy& src_, CoRipper::Policy& policy_,
+	CoRipper::Compression& compression_)
+{
+	switch (src_.regsets) {
+	case CORIPPER_REGSETS_ALL:
+		policy_.regsets = CoRipper::Policy::REGSETS_ALL;
+		break;
+	case CORIPPER_REGSETS_CRASHING:
+		policy_.regsets = CoRipper::Policy::REGSETS_CRASHING;
+		break;
+	case CORIPPER_REGSETS_NONE:
+		policy_.regsets = CoRipper::Policy::REGSETS_NONE;
+		break;
+	default:
+		return false;
+	}
+
+	switch (src_.compression) {
+	case CORIPPER_COMPRESS_NONE:
+		compression_.type = CoRipper::Compression::NONE;
+		break;
+	case CORIPPER_COMPRESS_ZSTD:
+		compression_.type = CoRipper::Compression::ZSTD;
+		break;
+	case CORIPPER_COMPRESS_LZ4:
+		compression_.type = CoRipper::Compression::LZ4;
+		break;
+	default:
+		return false;
+	}
+
+	policy_.stackLimit = src_.stack_limit;
+	policy_.outputBudget = src_.output_budget;
+	policy_.collapseKeep = src_.collapse_keep;
+	policy_.keepFileNote = src_.keep_file_note != 0;
+	policy_.sparse = src_.sparse != 0;
+	compression_.level = src_.compression_level;
+	compression_.threads = src_.compression_threads;
+	return src_.threads > 0;
+}
+
+int strip(const coripper_input& input_, const coripper_output& output_,
+	const coripper_policy& policy_)
+{
+	CoRipper::Policy policy;
+	CoRipper::Compression compression;
+
+	if (!getPolicy(policy_, policy, compression)
+		|| (input_.fd < 0 && (input_.buff == NULL || input_.size == 0))
+		|| (output_.fd < 0 && output_.write == NULL))
+		return CORIPPER_EINVAL;
+
+	CoRipper::Core core(policy);
+	bool res;
+
+	if (input_.fd >= 0)
+		res = core.readDescriptor(input_.fd, policy_.scratch_limit);
+	else
+		res = core.readBuffer(reinterpret_cast<const char*>(input_.buff), input_.size,
+			policy_.scratch_limit);
+	if (!res)
+		return getError(core.getError());
+
+	if (output_.fd >= 0)
+		res = core.write(output_.fd, policy_.threads, compression);
+	else {
+		Callback c = { output_.write, output_.ctx };
+		CoRipper::Sink::ptr_t sink = CoRipper::Sink::create(&callbackWrite, &c, compression);
+		res = sink && core.write(sink);
+	}
+	if (!res) {
+		CoRipper::Log::error() << "ERROR: Failed to write output" << std::endl;
+		return CORIPPER_EWRITE;
+	}
+	return CORIPPER_OK;
+}
+
+} // namespace
+
+extern "C" {
+
+void coripper_policy_init(struct coripper_policy* policy)
+{
+	memset(policy, 0, sizeof(*policy));
+	policy->size = sizeof(*policy);
+	policy->scratch_limit = DEFAULT_SCRATCH_LIMIT;
+	policy->regsets = CORIPPER_REGSETS_ALL;
+	policy->keep_file_note = 1;
+	policy->compression = CORIPPER_COMPRESS_NONE;
+	policy->threads = 1;
+	policy->compression_threads = 1;
+}
+
+int coripper_strip(const struct coripper_input* input, const struct coripper_output* output,
+	const struct coripper_policy* policy)
+{
+	if (input == NULL || output == NULL || (policy != NULL && policy->size == 0))
+		return CORIPPER_EINVAL;
+
+	// fields unknown to the caller keep their defaults
+	coripper_policy p;
+	coripper_policy_init(&p);
+	if (policy != NULL)
+		memcpy(&p, policy, std::min(policy->size, sizeof(p)));
+
+	std::ostringstream messages;
+	int res;
+	try {
+		CoRipper::Log::Capture capture(messages);
+		PipeGuard guard;
+		res = strip(*input, *output, p);
+	}
+	catch (const std::bad_alloc&) {
+		res = CORIPPER_ENOMEM;
+	}
+	catch (...) {
+		res = CORIPPER_EINTERNAL;
+	}
+
+	try {
+		setMessage(res == CORIPPER_OK ? std::string() : messages.str());
+	}
+	catch (...) {
+		// the code tells enough
+	}
+	return res;
+}
+
+int coripper_strip_fd(int in_fd, int out_fd, const struct coripper_policy* policy)
+{
+	coripper_input input = { in_fd, NULL, 0 };
+	coripper_output output = { out_fd, NULL, NULL };
+
+	return coripper_strip(&input, &output, policy);
+}
+
+const char* coripper_strerror(int error)
+{
+	switch (error) {
+	case CORIPPER_OK:
+		return "Success";
+	case CORIPPER_EINVAL:
+		return "Invalid argument";
+	case CORIPPER_EREAD:
+		return "Unable to read core";
+	case CORIPPER_ENOTE:
+		return "Unable to read core notes";
+	case CORIPPER_EDYNAMIC:
+		return "Unable to read dynamic section";
+	case CORIPPER_ERDEBUG:
+		return "Unable to read rdebug structure";
+	case CORIPPER_ELINKMAP:
+		return "Unable to read linkmap";
+	case CORIPPER_ESTACKS:
+		return "Unable to read stacks";
+	case CORIPPER_EHEADER:
+		return "Unable to read elf header";
+	case CORIPPER_EWRITE:
+		return "Failed to write output";
+	case CORIPPER_ENOMEM:
+		return "Out of memory";
+	}
+	return "Internal error";
+}
+
+const char* coripper_last_message(void)
+{
+	std::string* s = s_message.get();
+	return s ? s->c_str() : "";
+}
+
+} // extern "C"
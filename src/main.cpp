@@ -22,29 +22,375 @@
  */
 
 #include <iostream>
+#include <cstdlib>
+#include <cstring>
+#include <cerrno>
+#include <getopt.h>
+#include <vector>
+#include <unistd.h>
+#include <sys/stat.h>
 #include <coripper.h>
+#include <core_batch.h>
+#include <core_daemon.h>
+
+enum {
+	DEFAULT_SCRATCH_LIMIT_MB = 64,
+	DEFAULT_SIGNATURE_KEEP = 1,
+	DEFAULT_SIGNATURE_TTL_SEC = 3600
+};
+
+static void usage(const char* name)
+{
+	std::cerr << "Usage: "
+		<< name
+		<< " [--scratch-limit <MB>] [--stack-limit <KB>] [--output-budget <MB>]"
+		<< " [--collapse-stacks[=<N>]] [--write-threads <N>]"
+		<< " [--compress=<zstd|lz4>[:<level>]] [--compress-threads <N>]"
+		<< " [--signature-cache <dir> [--signature-keep <N>] [--signature-ttl <sec>]]"
+		<< " [--regsets <all|crashing|none>] [--drop-file-note] [--sparse] [--pid <pid>]"
+		<< " [--stats[=<file>]] [--stats-textfile <file>]"
+		<< " <source path|-> [> <dest path>]"
+		<< std::endl;
+	std::cerr << "       "
+		<< name
+		<< " [options] --pid <pid> > <dest path>"
+		<< std::endl;
+	std::cerr << "       "
+		<< name
+		<< " [options] --batch <dir|list> [--batch ...] --out <dir> [--workers <N>]"
+		<< std::endl;
+	std::cerr << "       "
+		<< name
+		<< " [options] --daemon [--spool <dir>] [--socket <path>] --out <dir> [--workers <N>]"
+		<< " [--max-inflight <MB>] [--rate-limit <N>]"
+		<< std::endl;
+	std::cerr << "       "
+		<< name
+		<< " --client <path> [<name>] < <core>"
+		<< std::endl;
+}
+
+// Parse size with optional K/M/G suffix, plain numbers are taken in given units
+static bool parseSize(const char* arg, unsigned shift, size_t& dst)
+{
+	char* end;
+	unsigned long long v = strtoull(arg, &end, 10);
+
+	if (end == arg)
+		return false;
+
+	switch (*end) {
+	case 'K': case 'k':
+		shift = 10;
+		end++;
+		break;
+	case 'M': case 'm':
+		shift = 20;
+		end++;
+		break;
+	case 'G': case 'g':
+		shift = 30;
+		end++;
+		break;
+	}
+	if (*end != '\0')
+		return false;
+
+	dst = v << shift;
+	return true;
+}
+
+// Statistics go to stderr unless file is given, stdout is taken by the core
+static void writeStats(const CoRipper::Stats& stats, const char* json, const char* textfile)
+{
+	if (json != NULL && *json == '\0')
+		stats.writeJson(std::cerr);
+	else if (json != NULL)
+		stats.writeJson(json);
+
+	if (textfile != NULL)
+		stats.updateTextfile(textfile);
+}
+
+static bool parseRegsets(const char* arg, CoRipper::Policy::regsets_t& dst)
+{
+	if (0 == strcmp(arg, "all"))
+		dst = CoRipper::Policy::REGSETS_ALL;
+	else if (0 == strcmp(arg, "crashing"))
+		dst = CoRipper::Policy::REGSETS_CRASHING;
+	else if (0 == strcmp(arg, "none"))
+		dst = CoRipper::Policy::REGSETS_NONE;
+	else
+		return false;
+	return true;
+}
 
 int main(int argc, char** argv)
 {
-	if (argc < 2) {
-		std::cerr << "Usage: "
-			<< argv[0]
-			<< " <source path> [> <dest path>]"
-			<< std::endl;
+	static const struct option options[] = {
+		{"scratch-limit", required_argument, NULL, 's'},
+		{"stack-limit", required_argument, NULL, 'l'},
+		{"output-budget", required_argument, NULL, 'b'},
+		{"collapse-stacks", optional_argument, NULL, 'c'},
+		{"write-threads", required_argument, NULL, 'j'},
+		{"compress", required_argument, NULL, 'z'},
+		{"compress-threads", required_argument, NULL, 'Z'},
+		{"batch", required_argument, NULL, 'B'},
+		{"out", required_argument, NULL, 'o'},
+		{"workers", required_argument, NULL, 'w'},
+		{"daemon", no_argument, NULL, 'D'},
+		{"spool", required_argument, NULL, 'S'},
+		{"socket", required_argument, NULL, 'U'},
+		{"max-inflight", required_argument, NULL, 'm'},
+		{"rate-limit", required_argument, NULL, 'r'},
+		{"client", required_argument, NULL, 'C'},
+		{"signature-cache", required_argument, NULL, 'K'},
+		{"signature-keep", required_argument, NULL, 'k'},
+		{"signature-ttl", required_argument, NULL, 't'},
+		{"pid", required_argument, NULL, 'p'},
+		{"regsets", required_argument, NULL, 'R'},
+		{"drop-file-note", no_argument, NULL, 'F'},
+		{"sparse", no_argument, NULL, 'H'},
+		{"stats", optional_argument, NULL, 'T'},
+		{"stats-textfile", required_argument, NULL, 'X'},
+		{"help", no_argument, NULL, 'h'},
+		{NULL, 0, NULL, 0}
+	};
+
+	size_t scratchLimit = DEFAULT_SCRATCH_LIMIT_MB << 20;
+	CoRipper::Policy policy;
+	unsigned writeThreads = 1;
+	CoRipper::Compression compression;
+	std::vector<const char*> batch;
+	const char* outDir = NULL;
+	long workers = sysconf(_SC_NPROCESSORS_ONLN);
+	CoRipper::Daemon::Config daemon;
+	bool daemonMode = false;
+	const char* client = NULL;
+	const char* signatureDir = NULL;
+	unsigned signatureKeep = DEFAULT_SIGNATURE_KEEP;
+	long signatureTtl = DEFAULT_SIGNATURE_TTL_SEC;
+	long pid = 0;
+	const char* statsJson = NULL;
+	const char* statsTextfile = NULL;
+	bool valid;
+	int c;
+
+	while ((c = getopt_long(argc, argv, "s:l:b:c::j:z:Z:B:o:w:DS:U:m:r:C:K:k:t:p:R:FHT::X:h", options, NULL)) != -1) {
+		switch (c) {
+		case 's':
+			valid = parseSize(optarg, 20, scratchLimit);
+			break;
+		case 'l':
+			valid = parseSize(optarg, 10, policy.stackLimit);
+			break;
+		case 'b':
+			valid = parseSize(optarg, 20, policy.outputBudget);
+			break;
+		case 'c':
+			policy.collapseKeep = optarg ? strtoul(optarg, NULL, 10) : 1;
+			valid = policy.collapseKeep > 0;
+			break;
+		case 'j':
+			writeThreads = strtoul(optarg, NULL, 10);
+			valid = writeThreads > 0;
+			break;
+		case 'Z':
+			compression.threads = strtoul(optarg, NULL, 10);
+			valid = true;
+			break;
+		case 'z':
+			valid = compression.parse(optarg);
+			break;
+		case 'B':
+			batch.push_back(optarg);
+			valid = true;
+			break;
+		case 'o':
+			outDir = optarg;
+			valid = true;
+			break;
+		case 'w':
+			workers = strtol(optarg, NULL, 10);
+			valid = workers > 0;
+			break;
+		case 'D':
+			daemonMode = true;
+			valid = true;
+			break;
+		case 'S':
+			daemon.spoolDir = optarg;
+			valid = true;
+			break;
+		case 'U':
+			daemon.socketPath = optarg;
+			valid = true;
+			break;
+		case 'm':
+			valid = parseSize(optarg, 20, daemon.maxInflight);
+			break;
+		case 'r':
+			daemon.rateLimit = strtoul(optarg, NULL, 10);
+			valid = daemon.rateLimit > 0;
+			break;
+		case 'C':
+			client = optarg;
+			valid = true;
+			break;
+		case 'K':
+			signatureDir = optarg;
+			valid = true;
+			break;
+		case 'k':
+			signatureKeep = strtoul(optarg, NULL, 10);
+			valid = signatureKeep > 0;
+			break;
+		case 't':
+			signatureTtl = strtol(optarg, NULL, 10);
+			valid = signatureTtl > 0;
+			break;
+		case 'p':
+			pid = strtol(optarg, NULL, 10);
+			valid = pid > 0;
+			break;
+		case 'R':
+			valid = parseRegsets(optarg, policy.regsets);
+			break;
+		case 'F':
+			policy.keepFileNote = false;
+			valid = true;
+			break;
+		case 'H':
+			policy.sparse = true;
+			valid = true;
+			break;
+		case 'T':
+			statsJson = optarg ? optarg : "";
+			valid = true;
+			break;
+		case 'X':
+			statsTextfile = optarg;
+			valid = true;
+			break;
+		default:
+			valid = false;
+		}
+
+		if (!valid) {
+			usage(argv[0]);
+			return -1;
+		}
+	}
+
+	if (client != NULL)
+		return CoRipper::Daemon::runClient(client, optind < argc ? argv[optind] : "core");
+
+	if (outDir != NULL && mkdir(outDir, 0700) != 0 && errno != EEXIST) {
+		std::cerr << "Failed to create output directory." << std::endl;
 		return -1;
 	}
 
-	CoRipper::Core core;
+	if (signatureDir != NULL && mkdir(signatureDir, 0700) != 0 && errno != EEXIST) {
+		std::cerr << "Failed to create signature cache directory." << std::endl;
+		return -1;
+	}
+
+	CoRipper::SignatureCache cache(signatureDir ? signatureDir : "", signatureKeep, signatureTtl);
+	const CoRipper::SignatureCache* pcache = signatureDir ? &cache : NULL;
+
+	// statistics are collected for a single core
+	if ((statsJson != NULL || statsTextfile != NULL) && (daemonMode || !batch.empty())) {
+		usage(argv[0]);
+		return -1;
+	}
+
+	if (daemonMode) {
+		if (outDir == NULL || optind < argc
+			|| (daemon.spoolDir.empty() && daemon.socketPath.empty())) {
+			usage(argv[0]);
+			return -1;
+		}
+
+		// results in the spool would be taken for new cores and removed when done
+		struct stat out, spool;
+		if (!daemon.spoolDir.empty() && stat(outDir, &out) == 0
+			&& stat(daemon.spoolDir.c_str(), &spool) == 0
+			&& out.st_dev == spool.st_dev && out.st_ino == spool.st_ino) {
+			std::cerr << "Output directory must differ from spool directory." << std::endl;
+			return -1;
+		}
+
+		daemon.outDir = outDir;
+		daemon.workers = workers > 0 ? workers : 1;
+		daemon.scratchLimit = scratchLimit;
+		daemon.policy = policy;
+		daemon.compression = compression;
+		daemon.cache = pcache;
+		return CoRipper::Daemon(daemon).run() ? 0 : -1;
+	}
+
+	if (!batch.empty()) {
+		if (outDir == NULL || optind < argc) {
+			usage(argv[0]);
+			return -1;
+		}
+
+		CoRipper::Batch b(outDir, policy, scratchLimit, writeThreads, compression, pcache);
+		for (size_t i = 0; i < batch.size(); i++) {
+			if (!b.add(batch[i]))
+				return -1;
+		}
+
+		return b.run(workers > 0 ? workers : 1) ? -1 : 0;
+	}
+
+	if (optind >= argc && pid <= 0) {
+		usage(argv[0]);
+		return -1;
+	}
+
+	CoRipper::Core core(policy, pcache);
+	CoRipper::Stats stats;
+	const char* source = optind < argc ? argv[optind] : NULL;
+	bool res;
+
+	if (statsJson != NULL || statsTextfile != NULL)
+		core.setStats(&stats);
 
-	if (!core.read(argv[1])) {
+	// without source the running process is snapshotted
+	if (source == NULL) {
+		double pause = 0;
+		res = core.readProcess(pid, pause);
+		if (res)
+			std::cerr << "Process " << pid << " was stopped for " << pause << " ms." << std::endl;
+	}
+	// "-" stands for core streamed through stdin, e.g. from kernel core_pattern pipe
+	else if (0 == strcmp(source, "-"))
+		res = core.readStream(STDIN_FILENO, scratchLimit, pid);
+	else if (pid > 0) {
+		usage(argv[0]);
+		return -1;
+	}
+	else
+		res = core.read(source, scratchLimit);
+
+	if (!res) {
 		std::cerr << "Coredump file read failed." << std::endl;
 		return -1;
 	}
 
-	if (!(std::cout << core)) {
+	if (core.isDuplicate()) {
+		std::cerr << "Duplicate of signature " << std::hex << core.getSignature() << std::dec
+			<< " seen " << core.getSignatureCount() << " times, skipped." << std::endl;
+		writeStats(stats, statsJson, statsTextfile);
+		return 0;
+	}
+
+	if (!core.write(STDOUT_FILENO, writeThreads, compression)) {
 		std::cerr << "Failed to write output." << std::endl;
 		return -1;
 	}
 
+	writeStats(stats, statsJson, statsTextfile);
 	return 0;
 }